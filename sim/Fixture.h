@@ -0,0 +1,55 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Fixture.h
+  *
+  * One Call answer of a json fixture or of the python generator for the bench and the checks.
+  */
+#pragma once
+#include "Arduino.h"
+
+#define SIM_FIXTURE_MAX (256 * 1024)  // max. size of the json answer
+
+/* Read the json fixture or the output of the python generator for the time */
+inline bool LoadFixture(const char *fixture, time_t time, String &json)
+{
+   char  command[512];
+   FILE *file;
+
+   if (strstr(fixture, ".py")) {
+      snprintf(command, sizeof(command), "python3 %s %ld", fixture, (long) time);
+      file = popen(command, "r");
+   } else {
+      file = fopen(fixture, "rb");
+   }
+   if (!file) {
+      return false;
+   }
+
+   char  *buffer = new char[SIM_FIXTURE_MAX + 1];
+   size_t size   = fread(buffer, 1, SIM_FIXTURE_MAX, file);
+
+   buffer[size] = 0;
+   json = buffer;
+   delete[] buffer;
+   if (strstr(fixture, ".py")) {
+      pclose(file);
+   } else {
+      fclose(file);
+   }
+   return size > 0;
+}
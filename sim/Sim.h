@@ -0,0 +1,166 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Sim.h
+  *
+  * State of the host simulation, shared between the driver and the wakes.
+  */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <algorithm>
+
+#define SIM_FLASH_SIZE  (4 * 1024 * 1024)  // flash of the custom data partitions
+#define SIM_NVS_SIZE    (64 * 1024)        // flash of the nvs
+#define SIM_RTC_MEM     8192               // RTC_DATA_ATTR memory
+#define SIM_START_EPOCH 1700000000         // RTC time at the start of the simulation
+#define SIM_TIMER_STACK (16 * 1024)        // stack of the esp_timer task, the host minimum instead of its 3584 bytes
+
+#define SIM_HEAP_SIZE        (300 * 1024)       // free internal heap at the start of a wake
+#define SIM_HEAP_LARGEST     (110 * 1024)       // largest block of the internal heap regions
+#define SIM_PSRAM_SIZE       (4 * 1024 * 1024)  // PSRAM of the malloc
+#define SIM_PSRAM_THRESHOLD  4096               // bigger blocks come from the PSRAM like SPIRAM_MALLOC_ALWAYSINTERNAL
+
+/**
+  * Every wake runs in a forked process like after a power on of the M5Paper.
+  * Only this state, the flash and the nvs survive the wake, the RTC memory
+  * only if the wake ended with a deep sleep.
+  */
+struct SimState
+{
+   uint64_t virtualUs;             //!< Virtual clock since the start of the simulation
+   uint64_t wakeStartUs;           //!< Virtual clock at the start of the wake
+   time_t   rtcEpoch;              //!< RTC time at virtualUs == 0
+   int      sleepSec;              //!< Sleep requested by the wake
+   int      wake;                  //!< Number of the wake
+
+   bool     usbPower;              //!< The M5Paper does not switch off
+   bool     buttonPressed;         //!< The wake was started by the button
+   bool     deepSleepWake;         //!< The wake was started by the deep sleep timer
+   bool     rtcValid;              //!< The RTC memory survived the last wake
+   uint8_t  rtcStatus2;            //!< BM8563 flags at the start of the wake
+   uint32_t batteryMv;             //!< Battery voltage
+   float    sht30Temp;             //!< Mean indoor temperature
+   float    sht30Hum;              //!< Mean indoor humidity
+
+   int      wifiAssocMs;           //!< Association time of the wifi, -1 = no connection
+   int      wifiRssi;              //!< Signal strength
+   uint64_t radioOnUs;             //!< Radio on time of the wake
+   uint64_t radioStartUs;          //!< Start of the running radio on time
+   uint32_t bytesRx;               //!< Received bytes of the wake
+   uint32_t bytesTx;               //!< Sent bytes of the wake
+   uint32_t serialBytes;           //!< Serial output of the wake
+   bool     serialMuted;           //!< Count the serial output without printing it
+
+   uint32_t epdUpdates;            //!< Display updates of the wake
+   uint32_t epdPixels;             //!< Updated pixels of the wake
+   uint64_t epdBusyUntilUs;        //!< End of the running waveform
+   int      loops;                 //!< loop() calls after the setup() of a wake on usb
+
+   char     fixture[256];          //!< json file or python generator of the http answer
+   char     server[64];            //!< host:port of a local server instead of the fixture
+   char     collector[64];         //!< host:port of the telemetry collector, empty = POST without a server
+   char     pgm[256];              //!< File for the last full screen image, empty = none
+   char     serialInput[256];      //!< Serial input of the wake
+   int      serialPos;             //!< Read position of the serial input
+   char     touch[256];            //!< Touches of the wake: "ms:x0:x1,..."
+   int      touchWake;             //!< Wake of the touches
+
+   uint8_t  rtcMem[SIM_RTC_MEM];   //!< Copy of the RTC memory
+   uint8_t  nvs[SIM_NVS_SIZE];     //!< Entries of the nvs
+   uint8_t  flash[SIM_FLASH_SIZE]; //!< Custom data partitions
+};
+
+extern SimState *sim;
+
+/**
+  * One shot timer of the esp_timer mock, it fires when the virtual clock passes it.
+  * A timer of the wake, not part of the shared state.
+  */
+struct SimTimer
+{
+   uint64_t dueUs;              //!< Virtual clock of the timeout
+   void   (*callback)(void *);  //!< Callback of the created timer
+   void    *arg;                //!< Argument of the callback
+   bool     running;            //!< The timer is started
+   bool     inCallback;         //!< The callback runs on the timer thread
+};
+
+extern SimTimer simTimer;
+
+/* The esp_timer callback interrupts the wake anywhere: it must not block on the bus, the flash or the serial port */
+inline void SimCheckTimerContext(const char *what)
+{
+   if (simTimer.inCallback) {
+      fprintf(stderr, "sim: %s in the esp_timer callback\n", what);
+      abort();
+   }
+}
+
+/* Thread of the timer callback like the esp_timer task */
+inline void *SimTimerTask(void *)
+{
+   simTimer.inCallback = true;
+   simTimer.callback(simTimer.arg);
+   simTimer.inCallback = false;
+   return NULL;
+}
+
+/* Advance the virtual clock by the duration of a blocking operation, the wake waits for a fired timer */
+inline void SimAdvanceUs(uint64_t us)
+{
+   SimCheckTimerContext("blocking call");
+   sim->virtualUs += us;
+   if (simTimer.running && sim->virtualUs >= simTimer.dueUs) {
+      pthread_attr_t attr;
+      pthread_t      thread;
+
+      simTimer.running = false;
+      pthread_attr_init(&attr);
+      pthread_attr_setstacksize(&attr, SIM_TIMER_STACK);
+      if (!pthread_create(&thread, &attr, SimTimerTask, NULL)) {
+         pthread_join(thread, NULL);
+      }
+      pthread_attr_destroy(&attr);
+   }
+}
+
+/**
+  * Heap of the process, counted by the malloc of heap.cpp. The blocks
+  * of the wake are the difference to the base at the start of the wake.
+  */
+struct SimHeap
+{
+   uint64_t allocs;             //!< Number of the malloc calls
+   uint64_t allocBytes;         //!< Requested bytes of the malloc calls
+   int64_t  internalBytes;      //!< Used internal heap
+   int64_t  internalBlocks;     //!< Allocated internal blocks
+   int64_t  internalPeak;       //!< Most used internal heap since the reset
+   int64_t  internalBase;       //!< Used internal heap at the reset
+   int64_t  internalBaseCount;  //!< Allocated internal blocks at the reset
+   int64_t  psramBytes;         //!< Used PSRAM
+   int64_t  psramBase;          //!< Used PSRAM at the reset
+};
+
+extern SimHeap simHeap;
+
+/* Start the heap of a wake */
+void SimHeapReset();
@@ -0,0 +1,209 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file bench.cpp
+  *
+  * Microbenchmarks of the pure logic of the sketch (parsing, formatting, astronomy and
+  * battery mapping) on the host, with the time and the heap allocations per call.
+  */
+#include <chrono>
+#include <getopt.h>
+#include "Arduino.h"
+#include "Fixture.h"
+#include "M5EPD.h"
+#include "WiFi.h"
+#include "Wire.h"
+
+#define BENCH_INPUTS      64          // different inputs per benchmark
+#define BENCH_MAX_CALLS   (1 << 26)   // upper limit of the calls per benchmark
+
+static SimState state;
+
+SimState      *sim = &state;
+SimTimer       simTimer;
+HardwareSerial Serial;
+WiFiClass      WiFi;
+M5EPD          M5;
+TwoWire        Wire;
+
+#include SIM_SKETCH  // the sketch dir must not be an include path, its Time.h hides the one of the Time library
+
+/* Keeps the results of the benchmarked calls alive */
+static volatile uint32_t benchSink = 0;
+
+/* Minimum measuring time of one benchmark */
+static double benchMinMs = 200;
+
+/* Only the benchmarks that contain this text, empty = all */
+static const char *benchFilter = "";
+
+/**
+  * Calls the body with the index of the call until the minimum measuring time
+  * is reached and prints the time and the allocations per call.
+  */
+template <typename Body>
+void Bench(const char *name, Body body)
+{
+   using Clock = std::chrono::steady_clock;
+
+   if (!strstr(name, benchFilter)) {
+      return;
+   }
+   body(0);  // warm up the caches and the lazy initialisations
+
+   for (uint32_t calls = 1; ; calls *= 2) {
+      uint64_t allocs = simHeap.allocs;  // counted by the malloc of heap.cpp
+      uint64_t bytes  = simHeap.allocBytes;
+      auto     start  = Clock::now();
+
+      for (uint32_t i = 0; i < calls; i++) {
+         body(i);
+      }
+
+      double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+      if (ns >= benchMinMs * 1e6 || calls >= BENCH_MAX_CALLS) {
+         printf("%-28s %10u calls %12.1f ns/call %8.2f allocs/call %10.1f bytes/call\n", name, calls,
+            ns / calls, (double) (simHeap.allocs - allocs) / calls, (double) (simHeap.allocBytes - bytes) / calls);
+         return;
+      }
+   }
+}
+
+/* Access to the protected json mapping of the weather */
+class BenchWeather : public Weather
+{
+public:
+   using Weather::Fill;
+};
+
+/* Print the usage */
+void Usage(const char *name)
+{
+   printf("usage: %s [options] [fixture.json|generator.py]\n"
+          "  --min-ms <ms>       minimum measuring time per benchmark (default 200)\n"
+          "  --filter <text>     only the benchmarks with the text in the name\n", name);
+}
+
+int main(int argc, char **argv)
+{
+   static const struct option longOptions[] = {
+      { "min-ms", required_argument, NULL, 'm' },
+      { "filter", required_argument, NULL, 'f' },
+      { "help",   no_argument,       NULL, 'h' },
+      { NULL,     0,                 NULL, 0   }
+   };
+   const char *fixture = SIM_DEFAULT_FIXTURE;
+   int         option;
+
+   while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+      switch (option) {
+         case 'm': benchMinMs  = atof(optarg); break;
+         case 'f': benchFilter = optarg;       break;
+         default:
+            Usage(argv[0]);
+            return 1;
+      }
+   }
+   if (optind < argc) {
+      fixture = argv[optind];
+   }
+   memset(sim->flash, 0xff, sizeof(sim->flash));
+   sim->rtcEpoch  = SIM_START_EPOCH;
+   sim->batteryMv = 4100;
+
+   // realistic inputs: the hours of the forecast, the voltages of a discharge and the signal levels
+   time_t   times[BENCH_INPUTS];
+   uint32_t voltages[BENCH_INPUTS];
+   int      rssis[BENCH_INPUTS];
+
+   for (int i = 0; i < BENCH_INPUTS; i++) {
+      times[i]    = SIM_START_EPOCH + i * 3607;
+      voltages[i] = 4350 - i * 1050 / (BENCH_INPUTS - 1);
+      rssis[i]    = -40 - i;
+   }
+
+   String json;
+
+   if (!LoadFixture(fixture, SIM_START_EPOCH, json)) {
+      printf("bench: fixture %s not readable\n", fixture);
+      return 1;
+   }
+
+   DynamicJsonDocument doc(35 * 1024);
+   BenchWeather        weather;
+
+   if (deserializeJson(doc, json.c_str()) || !weather.Fill(doc.as<JsonObject>())) {
+      printf("bench: fixture %s is no One Call answer\n", fixture);
+      return 1;
+   }
+   printf("bench: %s, %u bytes json\n", fixture, (unsigned) json.length());
+
+   Bench("deserializeJson", [&](uint32_t) {
+      DynamicJsonDocument parsed(35 * 1024);  // like Weather::Get()
+
+      benchSink += (bool) deserializeJson(parsed, json.c_str());
+   });
+   Bench("Weather::Fill", [&](uint32_t) {
+      benchSink += weather.Fill(doc.as<JsonObject>());
+   });
+   Bench("getDateTimeString", [&](uint32_t i) {
+      benchSink += getDateTimeString(times[i % BENCH_INPUTS]).length();
+   });
+   Bench("getDateString", [&](uint32_t i) {
+      benchSink += getDateString(times[i % BENCH_INPUTS]).length();
+   });
+   Bench("getTimeString", [&](uint32_t i) {
+      benchSink += getTimeString(times[i % BENCH_INPUTS]).length();
+   });
+   Bench("getHourMinString", [&](uint32_t i) {
+      benchSink += getHourMinString(times[i % BENCH_INPUTS]).length();
+   });
+   Bench("getHourString", [&](uint32_t i) {
+      benchSink += getHourString(times[i % BENCH_INPUTS]).length();
+   });
+   Bench("getRTCDateTimeString", [&](uint32_t) {
+      benchSink += getRTCDateTimeString().length();
+   });
+   Bench("WifiGetRssiAsQuality", [&](uint32_t i) {
+      benchSink += WifiGetRssiAsQuality(rssis[i % BENCH_INPUTS]).length();
+   });
+   Bench("NormalizedMoonPhase", [&](uint32_t i) {
+      time_t time = times[i % BENCH_INPUTS];
+
+      benchSink += (uint32_t) (NormalizedMoonPhase(day(time), month(time), year(time)) * 1000);
+   });
+   Bench("GetMoonValues", [&](uint32_t i) {
+      benchSink += GetMoonValues(myData, times[i % BENCH_INPUTS]);
+   });
+   Bench("GetBatteryCapacity", [&](uint32_t i) {
+      benchSink += GetBatteryCapacity(voltages[i % BENCH_INPUTS]);
+   });
+   Bench("GetChargeState", [&](uint32_t i) {
+      benchSink += GetChargeState(voltages[i % BENCH_INPUTS]);
+   });
+
+   // a complete screen with the canvas, the serial output is counted but not printed
+   myData.weather = weather;
+   GetMoonValues(myData, SIM_START_EPOCH);
+   sim->serialMuted = true;
+   Bench("WeatherDisplay::Show", [&](uint32_t) {
+      myDisplay.Show(false);
+   });
+   sim->serialMuted = false;
+   return 0;
+}
@@ -0,0 +1,150 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file check.cpp
+  *
+  * Checks of the sketch logic on the host with the synthesized forecast.
+  * Prints every check and returns the number of the failed ones (ctest).
+  */
+#include "Arduino.h"
+#include "Fixture.h"
+#include "M5EPD.h"
+#include "WiFi.h"
+#include "Wire.h"
+
+static SimState state;
+
+SimState      *sim = &state;
+SimTimer       simTimer;
+HardwareSerial Serial;
+WiFiClass      WiFi;
+M5EPD          M5;
+TwoWire        Wire;
+
+#include SIM_SKETCH  // the sketch dir must not be an include path, its Time.h hides the one of the Time library
+
+/* Number of the failed checks */
+static int checkFailures = 0;
+
+/* Print the result of one check */
+void Check(const char *name, bool ok)
+{
+   printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+   checkFailures += !ok;
+}
+
+/* Access to the protected json mapping of the weather */
+class CheckWeather : public Weather
+{
+public:
+   using Weather::Fill;
+};
+
+/* Fill the weather with the answer of the fixture for the UTC time */
+bool FillWeather(CheckWeather &weather, const char *fixture, time_t time)
+{
+   DynamicJsonDocument doc(35 * 1024);
+   String              json;
+
+   return LoadFixture(fixture, time, json) && !deserializeJson(doc, json.c_str()) && weather.Fill(doc.as<JsonObject>());
+}
+
+/* A restore after midnight starts the daily forecast with today like the sun times */
+void CheckRestoreMidnight(const char *fixture)
+{
+   CheckWeather weather;
+
+   if (!FillWeather(weather, fixture, SIM_START_EPOCH)) {
+      Check("Restore: fixture", false);
+      return;
+   }
+   time_t fetch = weather.cache.current.time;
+   time_t after = fetch - fetch % SECS_PER_DAY + SECS_PER_DAY + 30 * SECS_PER_MIN; // 00:30 of the next day
+   bool   ok    = weather.Restore(after);
+
+   Check("Restore: the next day after midnight", ok);
+   Check("Restore: sun times of the next day", ok && weather.sunrise == (time_t) weather.cache.daily[1].sunrise);
+   Check("Restore: the daily forecast starts with the next day", ok
+      && weather.forecastMaxTemp[0] == weather.cache.daily[1].maxTemp
+      && weather.forecastPressure[MAX_FORECAST - 2] == weather.cache.daily[MAX_FORECAST - 1].pressure);
+   Check("Restore: the day beyond the forecast is cleared", ok
+      && !weather.forecastMaxTemp[MAX_FORECAST - 1] && !weather.forecastPressure[MAX_FORECAST - 1]);
+}
+
+/* Two consecutive wakes with the same stored forecast push only the M5Paper information */
+void CheckUnchangedSkip(const char *fixture)
+{
+   CheckWeather weather;
+
+   if (!FillWeather(weather, fixture, SIM_START_EPOCH)) {
+      Check("Unchanged: fixture", false);
+      return;
+   }
+   myData.weather.cache = weather.cache;
+   myData.weather.Save();
+   InitEPD(false);
+
+   time_t   fetch = weather.cache.current.time;
+   uint32_t skips = myData.state.displaySkips;
+   
+   for (int wake = 1; wake <= 2; wake++) {
+      sim->rtcEpoch   = fetch + wake * SECS_PER_HOUR - (time_t) (sim->virtualUs / 1000000);
+      sim->epdUpdates = sim->epdPixels = 0;
+      ShowWeather(false, false);
+   }
+   Check("Unchanged: the second wake skips the refresh", myData.state.displaySkips == skips + 1);
+   Check("Unchanged: the second wake pushes no full screen", sim->epdUpdates && sim->epdPixels < M5EPD_Driver::W * M5EPD_Driver::H / 4);
+}
+
+/* The cadence of a provider with jittered data times is learned, also after the data was live */
+void CheckProviderCadence()
+{
+   static const int jitter[] = { 7, -12, 3, 19, -5, 11 };
+   StateData        state;
+   time_t           update = SIM_START_EPOCH - SIM_START_EPOCH % 600;
+
+   memset(&state, 0, sizeof(state));
+   state.providerCadence = 1;
+   for (int i = 0; i < (int) (sizeof(jitter) / sizeof(jitter[0])); i++) {
+      time_t dataTime = update + jitter[i];
+
+      Schedule::AddFetch(state, dataTime, dataTime + SCHEDULE_FRESH + 4);
+      update += (i % 2 ? 3 : 2) * 600; // the fetches are 20 and 30 minutes apart
+   }
+   Check("Cadence: jittered data times of a 10 minute provider", state.providerCadence == 600);
+
+   time_t call = update + 300;
+
+   Schedule::AddFetch(state, call, call + 2);
+   Check("Cadence: data as old as the call is live", state.providerCadence == 1);
+}
+
+int main(int argc, char **argv)
+{
+   const char *fixture = argc > 1 ? argv[1] : SIM_DEFAULT_FIXTURE;
+
+   memset(sim->flash, 0xff, sizeof(sim->flash));
+   sim->rtcEpoch    = SIM_START_EPOCH;
+   sim->batteryMv   = 4100;
+   sim->serialMuted = true;
+
+   CheckRestoreMidnight(fixture);
+   CheckUnchangedSkip(fixture);
+   CheckProviderCadence();
+   printf("check: %d failed\n", checkFailures);
+   return checkFailures;
+}
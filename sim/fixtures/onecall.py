@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+#
+#  Copyright (C) 2021 SFini
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""Synthesized One Call 3.0 answer for the UTC time of the first argument.
+
+SIM_CADENCE=<seconds> rounds the data time down like a provider that only
+updates its data every few minutes.
+"""
+import json
+import math
+import os
+import sys
+
+ICONS = ["01d", "02d", "03d", "04d", "09d", "10d", "11d", "13d", "50d", "01n", "02n"]
+SUNRISE = 6 * 3600   # UTC
+SUNSET = 16 * 3600   # UTC
+
+
+def weather(index):
+    return [{"id": 800, "main": ["Clear", "Clouds", "Rain"][index % 3], "description": "x",
+             "icon": ICONS[index % len(ICONS)]}]
+
+
+def onecall(time):
+    cadence = int(os.environ.get("SIM_CADENCE", "0"))
+    if cadence:
+        time -= time % cadence
+    midnight = time - time % 86400
+    current = {"dt": time, "sunrise": midnight + SUNRISE, "sunset": midnight + SUNSET,
+               "temp": 12.3, "feels_like": 11, "pressure": 1015, "humidity": 60,
+               "wind_speed": 3.4, "wind_deg": 220, "weather": weather(0)}
+    hourly = [{"dt": time - time % 3600 + 3600 * (i + 1), "temp": round(10 + 5 * math.sin(i / 4), 2),
+               "pressure": 1015, "humidity": 60, "wind_speed": round(3 + 2 * math.cos(i / 6), 1),
+               "wind_deg": 200, "weather": weather(i // 3), "pop": 0.1} for i in range(48)]
+    daily = [{"dt": time + 86400 * i, "sunrise": midnight + 86400 * i + SUNRISE,
+              "sunset": midnight + 86400 * i + SUNSET, "temp": {"min": 5 + i, "max": 15 + i, "day": 10},
+              "pressure": 1010 + i, "humidity": 50 + i, "wind_speed": 3, "wind_deg": 100,
+              "weather": weather(i), "rain": i * 1.5} for i in range(8)]
+    return {"lat": 47.69, "lon": 8.63, "timezone": "Europe/Zurich", "timezone_offset": 3600,
+            "current": current, "hourly": hourly, "daily": daily}
+
+
+if __name__ == "__main__":
+    print(json.dumps(onecall(int(sys.argv[1]) if len(sys.argv) > 1 else 1700000000)))
@@ -0,0 +1,95 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file heap.cpp
+  *
+  * Counting malloc of the simulation, the base of the mocked heap_caps functions and the allocation counts of the bench.
+  */
+#include <malloc.h>
+#include "Sim.h"
+
+SimHeap simHeap = {};
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void  __libc_free(void *ptr);
+}
+
+/* Add or remove a block of the heap, the size decides between the internal heap and the PSRAM */
+static void SimHeapAdd(void *ptr, int sign)
+{
+   if (!ptr) {
+      return;
+   }
+   size_t size = malloc_usable_size(ptr);
+
+   if (size >= SIM_PSRAM_THRESHOLD) {
+      simHeap.psramBytes += sign * (int64_t) size;
+   } else {
+      simHeap.internalBytes  += sign * (int64_t) size;
+      simHeap.internalBlocks += sign;
+      simHeap.internalPeak    = std::max(simHeap.internalPeak, simHeap.internalBytes);
+   }
+}
+
+void SimHeapReset()
+{
+   simHeap.internalBase      = simHeap.internalBytes;
+   simHeap.internalBaseCount = simHeap.internalBlocks;
+   simHeap.internalPeak      = simHeap.internalBytes;
+   simHeap.psramBase         = simHeap.psramBytes;
+}
+
+extern "C" {
+void *malloc(size_t size) noexcept
+{
+   void *ptr = __libc_malloc(size);
+
+   simHeap.allocs++;
+   simHeap.allocBytes += size;
+   SimHeapAdd(ptr, 1);
+   return ptr;
+}
+
+void *calloc(size_t count, size_t size) noexcept
+{
+   void *ptr = __libc_calloc(count, size);
+
+   simHeap.allocs++;
+   simHeap.allocBytes += count * size;
+   SimHeapAdd(ptr, 1);
+   return ptr;
+}
+
+void *realloc(void *ptr, size_t size) noexcept
+{
+   SimHeapAdd(ptr, -1);
+   ptr = __libc_realloc(ptr, size);
+   simHeap.allocs++;
+   simHeap.allocBytes += size;
+   SimHeapAdd(ptr, 1);
+   return ptr;
+}
+
+void free(void *ptr) noexcept
+{
+   SimHeapAdd(ptr, -1);
+   __libc_free(ptr);
+}
+}
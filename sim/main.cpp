@@ -0,0 +1,238 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file main.cpp
+  *
+  * Host simulation of the weather sketch: runs setup() and loop() of every wake on Linux with the mocked M5Paper.
+  */
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "M5EPD.h"
+#include "WiFi.h"
+#include "Wire.h"
+
+#define SIM_BUTTON_WAKES   8      // max. number of the --button options
+
+SimState      *sim;     // shared with the forked wakes
+SimTimer       simTimer; // esp_timer of the wake
+HardwareSerial Serial;
+WiFiClass      WiFi;
+M5EPD          M5;
+TwoWire        Wire;
+
+#include SIM_SKETCH  // the sketch dir must not be an include path, its Time.h hides the one of the Time library
+
+/* Options of the wakes that are not part of the state */
+struct SimOptions
+{
+   int  wakes;                          //!< Number of the wakes
+   int  buttonWakes[SIM_BUTTON_WAKES];  //!< Wakes by the button
+   int  buttons;                        //!< Number of the button wakes
+   int  serialWake;                     //!< Wake of the serial input
+   char serial[256];                    //!< Serial input
+};
+
+/* Totals of all the wakes */
+struct SimTotals
+{
+   double   awakeSec;
+   double   radioSec;
+   uint64_t bytesRx;
+   uint64_t bytesTx;
+   uint32_t epdUpdates;
+};
+
+/* Print the usage */
+void Usage(const char *name)
+{
+   printf("usage: %s [options] <fixture.json|generator.py> [wakes]\n"
+          "  --usb               usb power, the setup() returns into the loop()\n"
+          "  --loops <n>         loop() calls of a wake on usb power (default 10)\n"
+          "  --battery <mV>      battery voltage of the first wake (default 4100)\n"
+          "  --button <wake>     the wake is started by the button (repeatable)\n"
+          "  --serial <wake>:<s> serial input of the wake, \\n separates the lines\n"
+          "  --touch <wake>:<ms>:<x0>:<x1>[,<ms>:<x0>:<x1>...] touches of the wake\n"
+          "  --assoc <ms>        association time of the wifi, -1 = no connection (default 1200)\n"
+          "  --rssi <dBm>        wifi signal strength (default -60)\n"
+          "  --server <host:port> fetch from a local server (owm_server.py) instead of the fixture\n"
+          "  --collector <host:port> post the telemetry to a local collector (telemetry_collector.py)\n"
+          "  --pgm <file>        image of the last full screen update\n", name);
+}
+
+/* Parse the command line into the state and the options, false on an error */
+bool ParseOptions(int argc, char **argv, SimOptions &options)
+{
+   static const struct option longOptions[] = {
+      { "usb",     no_argument,       NULL, 'u' },
+      { "loops",   required_argument, NULL, 'l' },
+      { "battery", required_argument, NULL, 'b' },
+      { "button",  required_argument, NULL, 'p' },
+      { "serial",  required_argument, NULL, 's' },
+      { "touch",   required_argument, NULL, 't' },
+      { "assoc",   required_argument, NULL, 'a' },
+      { "rssi",    required_argument, NULL, 'r' },
+      { "pgm",     required_argument, NULL, 'g' },
+      { "server",  required_argument, NULL, 'v' },
+      { "collector", required_argument, NULL, 'c' },
+      { "help",    no_argument,       NULL, 'h' },
+      { NULL,      0,                 NULL, 0   }
+   };
+   int option;
+
+   while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+      const char *colon = optarg ? strchr(optarg, ':') : NULL;
+
+      if ((option == 's' || option == 't') && !colon) {
+         option = 'h';
+      }
+      switch (option) {
+         case 'u': sim->usbPower    = true;         break;
+         case 'l': sim->loops       = atoi(optarg); break;
+         case 'b': sim->batteryMv   = atoi(optarg); break;
+         case 'a': sim->wifiAssocMs = atoi(optarg); break;
+         case 'r': sim->wifiRssi    = atoi(optarg); break;
+         case 'g': strlcpy(sim->pgm,    optarg, sizeof(sim->pgm));    break;
+         case 'v': strlcpy(sim->server, optarg, sizeof(sim->server)); break;
+         case 'c': strlcpy(sim->collector, optarg, sizeof(sim->collector)); break;
+         case 't':
+            sim->touchWake = atoi(optarg);
+            strlcpy(sim->touch, colon + 1, sizeof(sim->touch));
+            break;
+         case 's':
+            options.serialWake = atoi(optarg);
+            strlcpy(options.serial, colon + 1, sizeof(options.serial));
+            for (char *c = options.serial; *c; c++) {
+               if (c[0] == '\\' && c[1] == 'n') {
+                  c[0] = ' ';
+                  c[1] = '\n';
+               }
+            }
+            break;
+         case 'p':
+            if (options.buttons < SIM_BUTTON_WAKES) {
+               options.buttonWakes[options.buttons++] = atoi(optarg);
+            }
+            break;
+         default:
+            Usage(argv[0]);
+            return false;
+      }
+   }
+   if (optind >= argc) {
+      Usage(argv[0]);
+      return false;
+   }
+   strlcpy(sim->fixture, argv[optind], sizeof(sim->fixture));
+   options.wakes = optind + 1 < argc ? atoi(argv[optind + 1]) : 3;
+   return true;
+}
+
+/* Run one wake in a forked process, the power off or the deep sleep ends the process */
+void RunWake(int wake, const SimOptions &options)
+{
+   bool button = false;
+
+   for (int i = 0; i < options.buttons; i++) {
+      button = button || options.buttonWakes[i] == wake;
+   }
+   sim->wake          = wake;
+   sim->wakeStartUs   = sim->virtualUs;
+   sim->buttonPressed = button;
+   sim->deepSleepWake = wake > 0 && sim->rtcValid;
+   sim->rtcStatus2    = wake > 0 && !sim->rtcValid && !button ? 0x08 : 0; // alarm flag of the BM8563
+   sim->sleepSec      = 0;
+   sim->radioOnUs     = 0;
+   sim->radioStartUs  = 0;
+   sim->bytesRx       = 0;
+   sim->bytesTx       = 0;
+   sim->serialBytes   = 0;
+   sim->epdUpdates    = 0;
+   sim->epdPixels     = 0;
+   sim->serialPos     = 0;
+   strlcpy(sim->serialInput, wake == options.serialWake ? options.serial : "", sizeof(sim->serialInput));
+   fflush(stdout);
+
+   pid_t pid = fork();
+
+   if (pid == 0) {
+      if (sim->rtcValid && __start_rtcsim) {
+         memcpy(__start_rtcsim, sim->rtcMem, __stop_rtcsim - __start_rtcsim);
+      }
+      SimHeapReset();
+      setup();
+      for (int i = 0; i < sim->loops; i++) {
+         loop();
+      }
+      fflush(stdout);
+      _exit(0);
+   }
+   waitpid(pid, NULL, 0);
+   if (sim->radioStartUs) {
+      sim->radioOnUs   += sim->virtualUs - sim->radioStartUs;
+      sim->radioStartUs = 0;
+   }
+}
+
+int main(int argc, char **argv)
+{
+   SimOptions options = {};
+   SimTotals  totals  = {};
+
+   sim = (SimState *) mmap(NULL, sizeof(SimState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   memset(sim, 0, sizeof(SimState));
+   memset(sim->flash, 0xff, sizeof(sim->flash));
+   sim->rtcEpoch      = SIM_START_EPOCH;
+   sim->wifiAssocMs   = 1200;
+   sim->wifiRssi      = -60;
+   sim->sht30Temp     = 21.4;
+   sim->sht30Hum      = 45;
+   sim->batteryMv     = 4100;
+   sim->loops         = 10;
+   sim->touchWake     = -1;
+   options.serialWake = -1;
+   if (!ParseOptions(argc, argv, options)) {
+      return 1;
+   }
+
+   double batteryMv = sim->batteryMv;
+
+   for (int wake = 0; wake < options.wakes; wake++) {
+      RunWake(wake, options);
+
+      double awake = (sim->virtualUs - sim->wakeStartUs) / 1e6;
+
+      printf("## wake %d: %.3f s awake, radio %.3f s, rx %u bytes, tx %u bytes, serial %u bytes, %u epd updates, sleep %d s\n",
+         wake, awake, sim->radioOnUs / 1e6, sim->bytesRx, sim->bytesTx, sim->serialBytes, sim->epdUpdates, sim->sleepSec);
+      totals.awakeSec   += awake;
+      totals.radioSec   += sim->radioOnUs / 1e6;
+      totals.bytesRx    += sim->bytesRx;
+      totals.bytesTx    += sim->bytesTx;
+      totals.epdUpdates += sim->epdUpdates;
+
+      // rough drain of the battery by the awake and the sleep time
+      batteryMv      -= 0.1 * awake + 0.0001 * sim->sleepSec;
+      sim->batteryMv  = (uint32_t) batteryMv;
+      sim->virtualUs += (uint64_t) sim->sleepSec * 1000000;
+   }
+   printf("## total %d wakes in %.1f h: %.3f s awake, radio %.3f s, rx %llu bytes, tx %llu bytes, %u epd updates\n",
+      options.wakes, sim->virtualUs / 3.6e9, totals.awakeSec, totals.radioSec,
+      (unsigned long long) totals.bytesRx, (unsigned long long) totals.bytesTx, totals.epdUpdates);
+   return 0;
+}
@@ -0,0 +1,382 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Arduino.h
+  *
+  * Host stand-in of the Arduino core: virtual time, String and Serial.
+  */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+#include <unistd.h>
+#include "../Sim.h"
+
+using std::min;
+using std::max;
+
+#define PI             3.1415926535897932384626433832795
+#define F(s)           (s)
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define PROGMEM
+#define IRAM_ATTR
+#define LOW            0
+#define HIGH           1
+#define INPUT          0
+#define OUTPUT         1
+
+// the RTC memory is a section that is copied into the state at a deep sleep
+#define RTC_DATA_ATTR  __attribute__((section("rtcsim")))
+
+extern char __start_rtcsim[] __attribute__((weak));
+extern char __stop_rtcsim[] __attribute__((weak));
+
+inline unsigned long millis()               { return (unsigned long) ((sim->virtualUs - sim->wakeStartUs) / 1000); }
+inline unsigned long micros()               { return (unsigned long) (sim->virtualUs - sim->wakeStartUs); }
+inline void          delay(unsigned long ms) { SimAdvanceUs((uint64_t) ms * 1000); }
+inline void          yield()                {}
+inline void          pinMode(int, int)      {}
+inline int           digitalRead(int)       { return HIGH; }
+inline void          digitalWrite(int, int) {}
+
+inline size_t strlcpy(char *dst, const char *src, size_t size)
+{
+   size_t length = strlen(src);
+
+   if (size) {
+      size_t count = min(length, size - 1);
+
+      memcpy(dst, src, count);
+      dst[count] = 0;
+   }
+   return length;
+}
+
+/* Deep sleep with the timer, the RTC memory survives */
+inline void esp_sleep_enable_timer_wakeup(uint64_t us)
+{
+   sim->sleepSec = us / 1000000;
+}
+
+inline void esp_deep_sleep_start()
+{
+   if (__start_rtcsim) {
+      memcpy(sim->rtcMem, __start_rtcsim, __stop_rtcsim - __start_rtcsim);
+      sim->rtcValid = true;
+   }
+   fflush(stdout);
+   _exit(0);
+}
+
+/**
+  * Arduino String with the buffer handling of the ESP32 core: up to 10
+  * characters in the object, longer texts in an exact sized heap buffer
+  * that grows with realloc. So the heap allocations match the device.
+  */
+class String
+{
+protected:
+   enum { SSOSIZE = 11 };  //!< Characters with the termination without the heap
+
+   char    *buffer   = NULL;  //!< Heap buffer, NULL = in the object
+   unsigned capacity = 0;     //!< Characters of the heap buffer without the termination
+   unsigned len      = 0;     //!< Length of the text
+   char     sso[SSOSIZE] = {};
+
+   char *Data() { return buffer ? buffer : sso; }
+
+   /* Space for size characters, the heap buffer grows to the exact size */
+   bool Reserve(unsigned size)
+   {
+      if ((!buffer && size < SSOSIZE) || (buffer && size <= capacity)) {
+         return true;
+      }
+      char *next = (char *) realloc(buffer, size + 1);
+
+      if (!next) {
+         return false;
+      }
+      if (!buffer) {
+         memcpy(next, sso, len + 1);
+      }
+      buffer   = next;
+      capacity = size;
+      return true;
+   }
+
+   String &Copy(const char *c, unsigned length)
+   {
+      if (Reserve(length)) {
+         memmove(Data(), c, length);
+         Data()[length] = 0;
+         len = length;
+      }
+      return *this;
+   }
+
+   String &Append(const char *c, unsigned length)
+   {
+      if (length && Reserve(len + length)) {
+         memmove(Data() + len, c, length);
+         len += length;
+         Data()[len] = 0;
+      }
+      return *this;
+   }
+
+   String &Move(String &o)
+   {
+      free(buffer);
+      buffer   = o.buffer;
+      capacity = o.capacity;
+      len      = o.len;
+      memcpy(sso, o.sso, SSOSIZE);
+      o.buffer   = NULL;
+      o.capacity = 0;
+      o.len      = 0;
+      o.sso[0]   = 0;
+      return *this;
+   }
+
+   String &Format(const char *format, ...) __attribute__((format(printf, 2, 3)))
+   {
+      char    text[64];
+      va_list args;
+
+      va_start(args, format);
+      vsnprintf(text, sizeof(text), format, args);
+      va_end(args);
+      return Copy(text, strlen(text));
+   }
+
+public:
+   String() {}
+   String(const char *c)              { if (c) Copy(c, strlen(c)); }
+   String(const char *c, unsigned n)  { Copy(c, n); }
+   String(const String &o)            { Copy(o.c_str(), o.len); }
+   String(String &&o)                 { Move(o); }
+   String(char c)                     { Copy(&c, 1); }
+   String(int v)                      { Format("%d", v); }
+   String(unsigned int v)             { Format("%u", v); }
+   String(long v)                     { Format("%ld", v); }
+   String(unsigned long v)            { Format("%lu", v); }
+   String(long long v)                { Format("%lld", v); }
+   String(unsigned long long v)       { Format("%llu", v); }
+   String(double v, unsigned int dec = 2) { Format("%.*f", dec, v); }
+   ~String()                          { free(buffer); }
+
+   String &operator=(const String &o) { return this == &o ? *this : Copy(o.c_str(), o.len); }
+   String &operator=(String &&o)      { return this == &o ? *this : Move(o); }
+   String &operator=(const char *c)   { return Copy(c ? c : "", c ? strlen(c) : 0); }
+
+   const char  *c_str() const                   { return buffer ? buffer : sso; }
+   unsigned int length() const                  { return len; }
+   bool         concat(const char *c)           { Append(c, strlen(c)); return true; }
+   void         reserve(unsigned int n)         { Reserve(n); }
+   char         operator[](unsigned int i) const { return i < len ? c_str()[i] : 0; }
+   int          toInt() const                   { return atoi(c_str()); }
+   float        toFloat() const                 { return atof(c_str()); }
+   bool         startsWith(const char *p) const { return !strncmp(c_str(), p, strlen(p)); }
+   String       substring(unsigned int b) const { return substring(b, len); }
+
+   String substring(unsigned int b, unsigned int e) const
+   {
+      e = min(e, len);
+      return b < e ? String(c_str() + b, e - b) : String();
+   }
+
+   int indexOf(char c) const
+   {
+      const char *pos = strchr(c_str(), c);
+
+      return pos && c ? (int) (pos - c_str()) : -1;
+   }
+
+   void trim()
+   {
+      const char *start = c_str();
+      unsigned    end   = len;
+
+      while (*start && isspace((unsigned char) *start)) {
+         start++;
+      }
+      while (end > (unsigned) (start - c_str()) && isspace((unsigned char) c_str()[end - 1])) {
+         end--;
+      }
+      Copy(start, end - (start - c_str()));
+   }
+
+   String &operator+=(const String &o)       { return Append(o.c_str(), o.len); }
+   String &operator+=(const char *o)         { return Append(o, strlen(o)); }
+   String &operator+=(char c)                { return Append(&c, 1); }
+   bool    operator==(const String &o) const { return len == o.len && !strcmp(c_str(), o.c_str()); }
+   bool    operator==(const char *o) const   { return !strcmp(c_str(), o); }
+   bool    operator!=(const String &o) const { return !(*this == o); }
+   bool    operator!=(const char *o) const   { return !(*this == o); }
+
+   friend String operator+(const String &a, const String &b) { String r(a); r += b; return r; }
+   friend String operator+(const String &a, const char *b)   { String r(a); r += b; return r; }
+   friend String operator+(String &&a, const String &b)      { a += b; return std::move(a); }
+   friend String operator+(String &&a, const char *b)        { a += b; return std::move(a); }
+   friend String operator+(const char *a, const String &b)   { String r(a); r += b; return r; }
+};
+
+/**
+  * Output with print(), println() and printf().
+  */
+class Print
+{
+public:
+   virtual ~Print() {}
+   virtual size_t write(uint8_t c) = 0;
+   virtual size_t write(const uint8_t *buffer, size_t size)
+   {
+      size_t written = 0;
+
+      while (size--) {
+         written += write(*buffer++);
+      }
+      return written;
+   }
+
+   size_t write(const char *s)                { return write((const uint8_t *) s, strlen(s)); }
+   size_t print(const char *s)                { return write(s); }
+   size_t print(const String &s)              { return write(s.c_str()); }
+   size_t print(char c)                       { return write((uint8_t) c); }
+   size_t print(int v)                        { return print(String(v)); }
+   size_t print(unsigned int v)               { return print(String(v)); }
+   size_t print(long v)                       { return print(String(v)); }
+   size_t print(unsigned long v)              { return print(String(v)); }
+   size_t print(double v, int dec = 2)        { return print(String(v, dec)); }
+   size_t println()                           { return write("\r\n"); }
+   template<typename T> size_t println(const T &v) { return print(v) + println(); }
+
+   size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+   {
+      char    buffer[512];
+      va_list args;
+
+      va_start(args, format);
+      int length = vsnprintf(buffer, sizeof(buffer), format, args);
+      va_end(args);
+      return write((const uint8_t *) buffer, min(length, (int) sizeof(buffer) - 1));
+   }
+};
+
+/**
+  * Input with a timeout, as used by ArduinoJson.
+  */
+class Stream : public Print
+{
+protected:
+   unsigned long timeout = 1000;  //!< Read timeout in ms
+
+public:
+   virtual int available() = 0;
+   virtual int read() = 0;
+   virtual int peek() { return -1; }
+   virtual void flush() {}
+
+   void          setTimeout(unsigned long t) { timeout = t; }
+   unsigned long getTimeout()                { return timeout; }
+
+   size_t readBytes(uint8_t *buffer, size_t size)
+   {
+      size_t count = 0;
+
+      while (count < size) {
+         int c = read();
+
+         if (c < 0) {
+            break;
+         }
+         buffer[count++] = c;
+      }
+      return count;
+   }
+
+   size_t readBytes(char *buffer, size_t size)
+   {
+      return readBytes((uint8_t *) buffer, size);
+   }
+
+   String readStringUntil(char terminator)
+   {
+      String result;
+      int    c;
+
+      while ((c = read()) >= 0 && c != terminator) {
+         result += (char) c;
+      }
+      return result;
+   }
+};
+
+/**
+  * The serial port at 115200 baud blocks the caller for every written byte,
+  * the input of the wake is scripted.
+  */
+class HardwareSerial : public Stream
+{
+public:
+   void begin(unsigned long) {}
+   operator bool() const     { return true; }
+
+   size_t write(uint8_t c) override { return write(&c, 1); }
+   size_t write(const uint8_t *buffer, size_t size) override
+   {
+      SimCheckTimerContext("serial output");
+      if (!sim->serialMuted) {
+         fwrite(buffer, 1, size, stdout);
+      }
+      sim->serialBytes += size;
+      SimAdvanceUs((uint64_t) size * 10 * 1000000 / 115200);
+      return size;
+   }
+   using Print::write;
+
+   int available() override { return sim->serialInput[sim->serialPos] != 0; }
+   int read() override      { return sim->serialInput[sim->serialPos] ? sim->serialInput[sim->serialPos++] : -1; }
+};
+
+extern HardwareSerial Serial;
+
+/**
+  * IPv4 address.
+  */
+class IPAddress
+{
+protected:
+   uint8_t a[4];
+
+public:
+   IPAddress(uint8_t a0 = 0, uint8_t a1 = 0, uint8_t a2 = 0, uint8_t a3 = 0) : a{a0, a1, a2, a3} {}
+
+   String toString() const
+   {
+      char buffer[16];
+
+      snprintf(buffer, sizeof(buffer), "%d.%d.%d.%d", a[0], a[1], a[2], a[3]);
+      return buffer;
+   }
+};
@@ -0,0 +1,50 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file ConfigOverride.h
+  *
+  * Configuration of the simulation instead of the private ConfigOverride.h of the sketch.
+  */
+#pragma once
+
+// QUIET_MODE of the simulation, cmake -DSIM_QUIET_MODE=1
+#ifdef SIM_QUIET_MODE
+#undef  QUIET_MODE
+#define QUIET_MODE SIM_QUIET_MODE
+#endif
+
+// LOG_BATTERY_LEVEL of the simulation, cmake -DSIM_LOG_BATTERY_LEVEL=3 shows the info records of the battery wakes
+#ifdef SIM_LOG_BATTERY_LEVEL
+#undef  LOG_BATTERY_LEVEL
+#define LOG_BATTERY_LEVEL SIM_LOG_BATTERY_LEVEL
+#endif
+
+// Https to the --server of the simulation, cmake -DSIM_TLS=1 and sim/owm_server.py --tls with its self-signed certificate
+#ifdef SIM_TLS
+#undef  OPENWEATHER_TLS
+#define OPENWEATHER_TLS SIM_TLS
+#undef  OPENWEATHER_TLS_INSECURE
+#define OPENWEATHER_TLS_INSECURE 1
+#endif
+
+// The placeholder of the api key contains spaces, an invalid request line for a http server
+#undef  OPENWEATHER_API
+#define OPENWEATHER_API "simulation"
+
+// The telemetry is posted to the --collector of the simulation, without it only counted
+#undef  TELEMETRY_SRV
+#define TELEMETRY_SRV "collector"
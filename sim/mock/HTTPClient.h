@@ -0,0 +1,213 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file HTTPClient.h
+  *
+  * Host stand-in of the ESP32 http client that answers with the local fixture or a local server.
+  */
+#pragma once
+#include <time.h>
+#include "Arduino.h"
+#include "WiFiClient.h"
+
+#define HTTP_CODE_OK                     200
+#define HTTP_CODE_NO_CONTENT             204
+#define HTTPC_ERROR_CONNECTION_REFUSED   (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED   (-2)
+#define HTTPC_ERROR_CONNECTION_LOST      (-5)
+#define HTTPC_ERROR_READ_TIMEOUT         (-11)
+#define HTTPCLIENT_DEFAULT_TCP_TIMEOUT   5000
+#define SIM_HTTP_ROUND_TRIP_US           150000  // request until the first byte of the fixture
+#define SIM_HTTP_BYTE_US                 8       // ~1 Mbit/s of the fixture
+#define SIM_FIXTURE_FILE                 "/tmp/weather_sim_fixture.json"
+#define SIM_TIMEZONE_OFFSET              3600    // the simulated RTC runs in local time, the fixtures use UTC + 1 h
+
+/* UTC time of the simulated RTC */
+inline time_t SimUtcTime()
+{
+   return sim->rtcEpoch + sim->virtualUs / 1000000 - SIM_TIMEZONE_OFFSET;
+}
+
+/**
+  * Body of the fixture file with the time of the link throughput.
+  */
+class SimFixtureStream : public Stream
+{
+public:
+   FILE *file = NULL;  //!< The open fixture
+
+   size_t write(uint8_t) override { return 0; }
+   int    available() override    { return file && !feof(file) ? 1 : 0; }
+
+   int read() override
+   {
+      int c = file ? fgetc(file) : -1;
+
+      if (c >= 0) {
+         sim->bytesRx++;
+         SimAdvanceUs(SIM_HTTP_BYTE_US);
+      }
+      return c;
+   }
+};
+
+/**
+  * Every GET answers with the fixture: a json file, or the output of a
+  * python generator called with the UTC time of the simulated RTC.
+  * With sim->server the request goes to the local server instead, over the
+  * client of begin(). Like the ESP32 the body of getStream() is the raw stream
+  * of the client, a chunked body still contains the chunk sizes.
+  */
+class HTTPClient
+{
+protected:
+   SimFixtureStream fixture;         //!< Body of the fixture answer
+   WiFiClient      *client = NULL;   //!< Connection to the local server
+   String           uri;             //!< Path and query of the request
+   String           host;            //!< Host of the request
+   uint16_t         port = 80;       //!< Port of the request
+   String           headers;         //!< Headers of addHeader()
+   int              size = -1;       //!< Content length of the body, -1 = unknown
+   bool             http10 = false;  //!< Request with http 1.0, without a chunked answer
+   uint16_t         tcpTimeout = HTTPCLIENT_DEFAULT_TCP_TIMEOUT;
+   int32_t          connectTimeout = HTTPCLIENT_DEFAULT_TCP_TIMEOUT;
+
+   /* Send the request to the local server and read the status and the headers */
+   int ServerRequest(const char *method, const uint8_t *body = NULL, size_t bodySize = 0)
+   {
+      if (!client || !client->connect(host.c_str(), port, connectTimeout)) {
+         return HTTPC_ERROR_CONNECTION_REFUSED;
+      }
+      char request[1024];
+      int  length = snprintf(request, sizeof(request),
+         "%s %s HTTP/1.%d\r\nHost: %s\r\nUser-Agent: ESP32HTTPClient\r\nConnection: close\r\nX-Sim-Time: %ld\r\n%s",
+         method, uri.c_str(), http10 ? 0 : 1, host.c_str(), (long) SimUtcTime(), headers.c_str());
+
+      if (body) {
+         length += snprintf(request + length, sizeof(request) - length, "Content-Length: %u\r\n", (unsigned) bodySize);
+      }
+      length += snprintf(request + length, sizeof(request) - length, "\r\n");
+      client->setTimeout(tcpTimeout);
+      if (client->write((const uint8_t *) request, length) != (size_t) length
+         || (body && client->write(body, bodySize) != bodySize)) {
+         return HTTPC_ERROR_SEND_HEADER_FAILED;
+      }
+
+      String status = client->readStringUntil('\n');
+      int    code   = status.startsWith("HTTP/1.") ? status.substring(9).toInt() : 0;
+
+      if (!code) {
+         return status.length() ? HTTPC_ERROR_CONNECTION_LOST : HTTPC_ERROR_READ_TIMEOUT;
+      }
+      while (true) {
+         String header = client->readStringUntil('\n');
+
+         header.trim();
+         if (!header.length()) {
+            break;
+         }
+         if (header.startsWith("Content-Length:")) {
+            size = header.substring(15).toInt();
+         }
+      }
+      return code;
+   }
+
+public:
+   ~HTTPClient() { end(); }
+
+   bool begin(WiFiClient &c, const char *h, uint16_t p, const String &u, bool = false) { client = &c; host = h; port = p; uri = u; return true; }
+   bool begin(WiFiClient &c, const String &u)                                          { client = &c; uri = u; return true; }
+   void setTimeout(uint16_t timeout)                                                   { tcpTimeout = timeout; }
+   void setConnectTimeout(int32_t timeout)                                             { connectTimeout = timeout; }
+   void setReuse(bool)                                                                 {}
+   void useHTTP10(bool enable = true)                                                  { http10 = enable; }
+   void addHeader(const String &name, const String &value)                             { headers += name + ": " + value + "\r\n"; }
+
+   int GET()
+   {
+      if (sim->server[0]) {
+         return ServerRequest("GET");
+      }
+      SimAdvanceUs(SIM_HTTP_ROUND_TRIP_US);
+      if (strstr(sim->fixture, ".py")) {
+         char command[512];
+
+         snprintf(command, sizeof(command), "python3 %s %ld > %s", sim->fixture, (long) SimUtcTime(), SIM_FIXTURE_FILE);
+         if (system(command) != 0) {
+            return HTTPC_ERROR_CONNECTION_REFUSED;
+         }
+         fixture.file = fopen(SIM_FIXTURE_FILE, "rb");
+      } else {
+         fixture.file = fopen(sim->fixture, "rb");
+      }
+      if (!fixture.file) {
+         return HTTPC_ERROR_CONNECTION_REFUSED;
+      }
+      fseek(fixture.file, 0, SEEK_END);
+      size = ftell(fixture.file);
+      fseek(fixture.file, 0, SEEK_SET);
+      return HTTP_CODE_OK;
+   }
+
+   /* Without a collector the body is only counted */
+   int POST(uint8_t *body, size_t length)
+   {
+      if (sim->collector[0]) {
+         return ServerRequest("POST", body, length);
+      }
+      sim->bytesTx += length;
+      SimAdvanceUs(SIM_HTTP_ROUND_TRIP_US);
+      return HTTP_CODE_OK;
+   }
+
+   int     getSize()   { return size; }
+   Stream &getStream() { return sim->server[0] && client ? (Stream &) *client : (Stream &) fixture; }
+
+   String getString()
+   {
+      String result;
+      int    c;
+
+      while ((c = getStream().read()) >= 0) {
+         result += (char) c;
+      }
+      return result;
+   }
+
+   static String errorToString(int code)
+   {
+      switch (code) {
+         case HTTPC_ERROR_CONNECTION_REFUSED: return "connection refused";
+         case HTTPC_ERROR_SEND_HEADER_FAILED: return "send header failed";
+         case HTTPC_ERROR_CONNECTION_LOST:    return "connection lost";
+         case HTTPC_ERROR_READ_TIMEOUT:       return "read Timeout";
+         default:                             return String("http status ") + String(code);
+      }
+   }
+
+   void end()
+   {
+      if (fixture.file) {
+         fclose(fixture.file);
+      }
+      fixture.file = NULL;
+      if (client) {
+         client->stop();
+      }
+   }
+};
@@ -0,0 +1,538 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file M5EPD.h
+  *
+  * Host stand-in of the M5EPD library: RTC, SHT30, touch, buttons and an in memory e-paper.
+  */
+#pragma once
+#include <time.h>
+#include <vector>
+#include "Arduino.h"
+#include "nvs.h"
+
+#define WHITE     0xFFFF
+#define BLACK     0x0000
+#define TL_DATUM  0
+#define TC_DATUM  1
+#define TR_DATUM  2
+
+typedef enum { M5EPD_OK = 0, M5EPD_BUSYTIMEOUT, M5EPD_OUTOFBOUNDS, M5EPD_NOTINIT } m5epd_err_t;
+
+typedef enum
+{
+   UPDATE_MODE_INIT  = 0,
+   UPDATE_MODE_DU    = 1,
+   UPDATE_MODE_GC16  = 2,
+   UPDATE_MODE_GL16  = 3,
+   UPDATE_MODE_GLR16 = 4,
+   UPDATE_MODE_GLD16 = 5,
+   UPDATE_MODE_DU4   = 6,
+   UPDATE_MODE_A2    = 7,
+   UPDATE_MODE_NONE  = 8
+} m5epd_update_mode_t;
+
+typedef struct RTC_Time
+{
+   int8_t hour, min, sec;
+
+   RTC_Time() : hour(), min(), sec() {}
+   RTC_Time(int8_t h, int8_t m, int8_t s) : hour(h), min(m), sec(s) {}
+} rtc_time_t;
+
+typedef struct RTC_Date
+{
+   int8_t  week, mon, day;
+   int16_t year;
+
+   RTC_Date() : week(), mon(), day(), year() {}
+   RTC_Date(int8_t w, int8_t m, int8_t d, int16_t y) : week(w), mon(m), day(d), year(y) {}
+} rtc_date_t;
+
+typedef struct { uint16_t x, y, size, id; } tp_finger_t;
+
+/**
+  * BM8563 on the virtual clock, an alarm sets the sleep of the wake.
+  */
+class BM8563
+{
+protected:
+   struct tm Now() const
+   {
+      SimCheckTimerContext("RTC access");
+
+      time_t    now = sim->rtcEpoch + (time_t) (sim->virtualUs / 1000000);
+      struct tm tm;
+
+      gmtime_r(&now, &tm);
+      return tm;
+   }
+
+   void Set(const rtc_date_t *date, const rtc_time_t *time)
+   {
+      struct tm tm = Now();
+
+      if (date) {
+         tm.tm_year = date->year - 1900;
+         tm.tm_mon  = date->mon - 1;
+         tm.tm_mday = date->day;
+      }
+      if (time) {
+         tm.tm_hour = time->hour;
+         tm.tm_min  = time->min;
+         tm.tm_sec  = time->sec;
+      }
+      sim->rtcEpoch = timegm(&tm) - (time_t) (sim->virtualUs / 1000000);
+   }
+
+   int SetAlarm(struct tm &tm)
+   {
+      SimCheckTimerContext("RTC access");
+
+      time_t now   = sim->rtcEpoch + (time_t) (sim->virtualUs / 1000000);
+      time_t alarm = timegm(&tm);
+
+      sim->sleepSec = (int) (alarm - now);
+      return 1;
+   }
+
+public:
+   void begin()                             { sim->rtcStatus2 = 0; } // clears the alarm and timer flags
+   void clearIRQ()                          {}
+   void disableIRQ()                        {}
+   void setTime(const rtc_time_t *time)     { Set(NULL, time); }
+   void setDate(const rtc_date_t *date)     { Set(date, NULL); }
+   int  SetAlarmIRQ(int afterSeconds)       { sim->sleepSec = afterSeconds; return afterSeconds; }
+
+   void getTime(rtc_time_t *time)
+   {
+      struct tm tm = Now();
+
+      time->hour = tm.tm_hour;
+      time->min  = tm.tm_min;
+      time->sec  = tm.tm_sec;
+   }
+
+   void getDate(rtc_date_t *date)
+   {
+      struct tm tm = Now();
+
+      date->year = tm.tm_year + 1900;
+      date->mon  = tm.tm_mon + 1;
+      date->day  = tm.tm_mday;
+      date->week = tm.tm_wday;
+   }
+
+   /* Alarm at the next time of the day */
+   int SetAlarmIRQ(const rtc_time_t &time)
+   {
+      struct tm tm  = Now();
+      time_t    now = timegm(&tm);
+
+      tm.tm_hour = time.hour;
+      tm.tm_min  = time.min;
+      tm.tm_sec  = 0;
+      if (timegm(&tm) <= now) {
+         tm.tm_mday++;
+      }
+      return SetAlarm(tm);
+   }
+
+   /* Alarm at the date and time */
+   int SetAlarmIRQ(const rtc_date_t &date, const rtc_time_t &time)
+   {
+      struct tm tm = {};
+
+      tm.tm_year = date.year - 1900;
+      tm.tm_mon  = date.mon - 1;
+      tm.tm_mday = date.day;
+      tm.tm_hour = time.hour;
+      tm.tm_min  = time.min;
+      return SetAlarm(tm);
+   }
+};
+
+/**
+  * SHT30 with a daily sine around the configured indoor values.
+  */
+class SHT3x
+{
+protected:
+   float Daily() const
+   {
+      return sinf((sim->rtcEpoch + sim->virtualUs / 1000000) % 86400 * 2 * PI / 86400);
+   }
+
+public:
+   void    Begin()          {}
+   uint8_t UpdateData()     { SimAdvanceUs(20000); return 0; }
+   float   GetTemperature() { return sim->sht30Temp + 2.5f * Daily(); }
+   float   GetRelHumidity() { return sim->sht30Hum - 8.0f * Daily(); }
+   int     GetError()       { return 0; }
+};
+
+/**
+  * In memory IT8951 with the refresh times of the waveforms,
+  * a new update or CheckAFSR() waits for the running waveform.
+  */
+class M5EPD_Driver
+{
+public:
+   static const int W = 960;
+   static const int H = 540;
+
+   uint8_t gram[W * H / 2];  //!< The image of the e-paper
+   uint8_t updateCount = 0;  //!< Updates since the last reset
+
+   static uint32_t WaveformMs(m5epd_update_mode_t mode)
+   {
+      switch (mode) {
+         case UPDATE_MODE_INIT: return 2000;
+         case UPDATE_MODE_DU:   return 260;
+         case UPDATE_MODE_DU4:  return 290;
+         case UPDATE_MODE_A2:   return 120;
+         default:               return 450;
+      }
+   }
+
+   void Update(m5epd_update_mode_t mode, uint32_t pixels)
+   {
+      CheckAFSR();
+      sim->epdUpdates++;
+      sim->epdPixels += pixels;
+      updateCount++;
+      sim->epdBusyUntilUs = sim->virtualUs + (uint64_t) (WaveformMs(mode) + pixels / 2000) * 1000;
+   }
+
+   m5epd_err_t CheckAFSR()
+   {
+      if (sim->virtualUs < sim->epdBusyUntilUs) {
+         uint64_t wait = sim->epdBusyUntilUs - sim->virtualUs;
+
+         if (wait > 3000000) {
+            SimAdvanceUs(3000000);
+            return M5EPD_BUSYTIMEOUT;
+         }
+         SimAdvanceUs(wait);
+      }
+      return M5EPD_OK;
+   }
+
+   m5epd_err_t WritePartGram4bpp(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const uint8_t *buffer)
+   {
+      for (int yy = 0; yy < h && y + yy < H; yy++) {
+         for (int xx = 0; xx < w && x + xx < W; xx += 2) {
+            gram[((y + yy) * W + x + xx) / 2] = buffer[(yy * w + xx) / 2];
+         }
+      }
+      SimAdvanceUs((uint64_t) w * h / 2 / 10); // 10 MHz SPI
+      return M5EPD_OK;
+   }
+
+   m5epd_err_t SetRotation(uint16_t = 0) { return M5EPD_OK; }
+   m5epd_err_t Clear(bool = false)       { memset(gram, 0, sizeof(gram)); Update(UPDATE_MODE_INIT, W * H); return M5EPD_OK; }
+   m5epd_err_t UpdateFull(m5epd_update_mode_t mode) { Update(mode, W * H); return M5EPD_OK; }
+   m5epd_err_t UpdateArea(uint16_t, uint16_t, uint16_t w, uint16_t h, m5epd_update_mode_t mode) { Update(mode, w * h); return M5EPD_OK; }
+   uint8_t     UpdateCount()             { return updateCount; }
+   void        ResetUpdateCount()        { updateCount = 0; }
+};
+
+/**
+  * GT911 with the scripted touches of the wake sim->touchWake: "ms:x0:x1,..." is
+  * a finger down at x0 ms after the start of the wake, a move to x1 after 100 ms
+  * and the finger up after 200 ms.
+  */
+class GT911
+{
+protected:
+   int  reports = 0;     //!< Consumed touch reports
+   bool fingerUp = true; //!< State of the last report
+   int  x = 0;           //!< Position of the last report
+
+   /* Time and position of the report, false if there are no more reports */
+   bool GetReport(int report, uint32_t &ms, int &reportX, bool &up)
+   {
+      const char *touch = sim->touch;
+      unsigned    start;
+      int         x0, x1;
+
+      if (sim->wake != sim->touchWake) {
+         return false;
+      }
+      for (int i = 0; i < report / 3 && touch; i++) {
+         touch = strchr(touch, ',');
+         touch = touch ? touch + 1 : NULL;
+      }
+      if (!touch || sscanf(touch, "%u:%d:%d", &start, &x0, &x1) != 3) {
+         return false;
+      }
+      ms      = start + report % 3 * 100;
+      reportX = report % 3 == 0 ? x0 : x1;
+      up      = report % 3 == 2;
+      return true;
+   }
+
+public:
+   esp_err_t begin(uint8_t, uint8_t, uint8_t) { return ESP_OK; }
+   void      SetRotation(uint16_t)            {}
+   void      flush()                          {}
+   bool      isFingerUp()                     { return fingerUp; }
+   uint8_t   getFingerNum()                   { return fingerUp ? 0 : 1; }
+   tp_finger_t readFinger(uint8_t)            { return tp_finger_t{ (uint16_t) x, 270, 10, 0 }; }
+
+   bool available()
+   {
+      uint32_t ms;
+      int      reportX;
+      bool     up;
+
+      return GetReport(reports, ms, reportX, up) && millis() >= ms;
+   }
+
+   void update()
+   {
+      uint32_t ms;
+      int      reportX;
+      bool     up;
+
+      if (GetReport(reports, ms, reportX, up) && millis() >= ms) {
+         reports++;
+         x        = reportX;
+         fingerUp = up;
+      }
+   }
+};
+
+/**
+  * Button, only the wake by the button is simulated.
+  */
+class Button
+{
+public:
+   uint8_t read()              { return sim->buttonPressed; }
+   uint8_t isPressed()         { return sim->buttonPressed; }
+   uint8_t isReleased()        { return 1; }
+   uint8_t wasPressed()        { return 0; }
+   uint8_t wasReleased()       { return 0; }
+   uint8_t pressedFor(uint32_t) { return 0; }
+};
+
+/**
+  * 4 bit canvas with the drawing functions of the sketch. The text is drawn
+  * with placeholder glyphs, the layout and the compression are realistic.
+  */
+class M5EPD_Canvas
+{
+public:
+   static const uint8_t G0 = 0, G1 = 1, G2 = 2, G3 = 3, G4 = 4, G5 = 5, G6 = 6, G7 = 7,
+                        G8 = 8, G9 = 9, G10 = 10, G11 = 11, G12 = 12, G13 = 13, G14 = 14, G15 = 15;
+
+protected:
+   M5EPD_Driver        *driver;        //!< The e-paper of the pushes
+   int                  w = 0;         //!< Width
+   int                  h = 0;         //!< Height
+   int                  textSize = 1;  //!< Scale of the 6x8 glyphs
+   std::vector<uint8_t> buffer;        //!< Frame buffer, 2 pixels per byte
+
+   int16_t DrawText(const char *text, int32_t x, int32_t y)
+   {
+      for (const char *c = text; *c; c++, x += 6 * textSize) {
+         for (int gy = 0; gy < 8; gy++) {
+            for (int gx = 0; gx < 5; gx++) {
+               if ((*c * 7 + gy * 3 + gx) % 5 < 2) {
+                  fillRect(x + gx * textSize, y + gy * textSize, textSize, textSize, G15);
+               }
+            }
+         }
+      }
+      return textWidth(text);
+   }
+
+   /* Write the screen as a 16 gray pgm image */
+   void WritePGM(const char *name)
+   {
+      FILE *file = fopen(name, "wb");
+
+      if (file) {
+         fprintf(file, "P5 %d %d 15\n", w, h);
+         for (int i = 0; i < w * h; i++) {
+            fputc(15 - (i & 1 ? buffer[i / 2] & 15 : buffer[i / 2] >> 4), file);
+         }
+         fclose(file);
+      }
+   }
+
+public:
+   M5EPD_Canvas(M5EPD_Driver *d) : driver(d) {}
+
+   void *createCanvas(int16_t width, int16_t height)
+   {
+      w = width;
+      h = height;
+      buffer.assign(w * h / 2, 0);
+      return buffer.data();
+   }
+
+   void    deleteCanvas()                   { buffer.clear(); buffer.shrink_to_fit(); w = h = 0; }
+   void   *frameBuffer(int8_t = 1)          { return buffer.data(); }
+   int16_t width() const                    { return w; }
+   int16_t height() const                   { return h; }
+   void    fillCanvas(uint32_t color)       { memset(buffer.data(), (color & 15) | ((color & 15) << 4), buffer.size()); }
+   void    setTextSize(uint8_t size)        { textSize = size; }
+   void    setTextColor(uint16_t, uint16_t = 0) {}
+   void    setTextDatum(uint8_t)            {}
+   void    setTextFont(uint8_t)             {}
+
+   void drawPixel(int32_t x, int32_t y, uint32_t color)
+   {
+      if (x < 0 || y < 0 || x >= w || y >= h) {
+         return;
+      }
+      uint8_t &pixels = buffer[(y * w + x) / 2];
+
+      pixels = x & 1 ? (pixels & 0xF0) | (color & 15) : (pixels & 0x0F) | ((color & 15) << 4);
+   }
+
+   void drawLine(int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint32_t color)
+   {
+      int dx  = abs(x1 - x0);
+      int sx  = x0 < x1 ? 1 : -1;
+      int dy  = -abs(y1 - y0);
+      int sy  = y0 < y1 ? 1 : -1;
+      int err = dx + dy;
+
+      while (true) {
+         int e2 = 2 * err;
+
+         drawPixel(x0, y0, color);
+         if (x0 == x1 && y0 == y1) {
+            break;
+         }
+         if (e2 >= dy) {
+            err += dy;
+            x0  += sx;
+         }
+         if (e2 <= dx) {
+            err += dx;
+            y0  += sy;
+         }
+      }
+   }
+
+   void drawFastHLine(int32_t x, int32_t y, int32_t length, uint32_t color) { drawLine(x, y, x + length - 1, y, color); }
+   void drawFastVLine(int32_t x, int32_t y, int32_t length, uint32_t color) { drawLine(x, y, x, y + length - 1, color); }
+
+   void drawRect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color)
+   {
+      drawFastHLine(x, y,              width,  color);
+      drawFastHLine(x, y + height - 1, width,  color);
+      drawFastVLine(x, y,              height, color);
+      drawFastVLine(x + width - 1, y,  height, color);
+   }
+
+   void fillRect(int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color)
+   {
+      for (int i = 0; i < height; i++) {
+         drawFastHLine(x, y + i, width, color);
+      }
+   }
+
+   void drawCircle(int32_t x, int32_t y, int32_t r, uint32_t color)
+   {
+      for (int angle = 0; angle < 360; angle++) {
+         drawPixel(x + r * cos(angle * PI / 180), y + r * sin(angle * PI / 180), color);
+      }
+   }
+
+   void fillCircle(int32_t x, int32_t y, int32_t r, uint32_t color)
+   {
+      for (int yy = -r; yy <= r; yy++) {
+         for (int xx = -r; xx <= r; xx++) {
+            if (xx * xx + yy * yy <= r * r) {
+               drawPixel(x + xx, y + yy, color);
+            }
+         }
+      }
+   }
+
+   void fillTriangle(int32_t x0, int32_t y0, int32_t x1, int32_t y1, int32_t x2, int32_t y2, uint32_t color)
+   {
+      drawLine(x0, y0, x1, y1, color);
+      drawLine(x1, y1, x2, y2, color);
+      drawLine(x2, y2, x0, y0, color);
+   }
+
+   int16_t textWidth(const char *text)    { return strlen(text) * 6 * textSize; }
+   int16_t textWidth(const String &text)  { return textWidth(text.c_str()); }
+
+   int16_t drawString(const char *text, int32_t x, int32_t y, uint8_t = 1)        { return DrawText(text, x, y); }
+   int16_t drawString(const String &text, int32_t x, int32_t y, uint8_t = 1)      { return DrawText(text.c_str(), x, y); }
+   int16_t drawCentreString(const char *text, int32_t x, int32_t y, uint8_t = 1)  { return DrawText(text, x - textWidth(text) / 2, y); }
+   int16_t drawCentreString(const String &text, int32_t x, int32_t y, uint8_t = 1) { return drawCentreString(text.c_str(), x, y); }
+   int16_t drawRightString(const char *text, int32_t x, int32_t y, uint8_t = 1)   { return DrawText(text, x - textWidth(text), y); }
+   int16_t drawRightString(const String &text, int32_t x, int32_t y, uint8_t = 1) { return drawRightString(text.c_str(), x, y); }
+
+   void pushCanvas(int32_t x, int32_t y, m5epd_update_mode_t mode)
+   {
+      driver->WritePartGram4bpp(x, y, w, h, buffer.data());
+      driver->UpdateArea(x, y, w, h, mode);
+      if (sim->pgm[0] && w == M5EPD_Driver::W) {
+         WritePGM(sim->pgm);
+      }
+   }
+
+   void pushCanvas(m5epd_update_mode_t mode) { pushCanvas(0, 0, mode); }
+};
+
+/**
+  * The M5Paper. A shutdown on battery ends the wake, on usb power it returns.
+  */
+class M5EPD
+{
+public:
+   BM8563       RTC;
+   M5EPD_Driver EPD;
+   GT911        TP;
+   SHT3x        SHT30;
+   Button       BtnL, BtnP, BtnR;
+
+   void     begin(bool = true, bool = true, bool = true, bool = true, bool = false) { SimAdvanceUs(300000); }
+   void     update()             {}
+   uint32_t getBatteryVoltage()  { return sim->batteryMv; }
+   uint32_t getBatteryRaw()      { return sim->batteryMv; }
+   void     enableEPDPower()     {}
+   void     disableEPDPower()    {}
+   void     enableEXTPower()     {}
+   void     disableEXTPower()    {}
+   void     enableMainPower()    {}
+
+   void disableMainPower()
+   {
+      if (!sim->usbPower) {
+         sim->rtcValid = false;
+         fflush(stdout);
+         _exit(0);
+      }
+   }
+
+   int shutdown()                                          { disableMainPower(); return 0; }
+   int shutdown(int seconds)                               { RTC.SetAlarmIRQ(seconds); disableMainPower(); return 0; }
+   int shutdown(const rtc_time_t &time)                    { RTC.SetAlarmIRQ(time); disableMainPower(); return 0; }
+   int shutdown(const rtc_date_t &date, const rtc_time_t &time) { RTC.SetAlarmIRQ(date, time); disableMainPower(); return 0; }
+};
+
+extern M5EPD M5;
@@ -0,0 +1,83 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file WiFi.h
+  *
+  * Host stand-in of the ESP32 wifi station with a configurable association time.
+  */
+#pragma once
+#include "Arduino.h"
+#include "WiFiClient.h"
+
+typedef enum { WIFI_OFF = 0, WIFI_STA = 1 } wifi_mode_t;
+typedef enum { WL_IDLE_STATUS = 0, WL_CONNECTED = 3, WL_DISCONNECTED = 6 } wl_status_t;
+
+/**
+  * Station that is connected sim->wifiAssocMs after begin(), the radio
+  * on time is counted from the mode(WIFI_STA) until the mode(WIFI_OFF).
+  */
+class WiFiClass
+{
+protected:
+   uint64_t beginUs = 0;      //!< Virtual time of begin()
+   bool     started = false;  //!< begin() was called
+
+public:
+   void mode(wifi_mode_t mode)
+   {
+      if (mode == WIFI_OFF && sim->radioStartUs) {
+         sim->radioOnUs   += sim->virtualUs - sim->radioStartUs;
+         sim->radioStartUs = 0;
+      } else if (mode != WIFI_OFF && !sim->radioStartUs) {
+         sim->radioStartUs = sim->virtualUs;
+      }
+      if (mode == WIFI_OFF) {
+         started = false;
+      }
+   }
+
+   void begin(const char *, const char *)
+   {
+      beginUs = sim->virtualUs;
+      started = true;
+   }
+
+   wl_status_t status()
+   {
+      if (started && sim->wifiAssocMs >= 0 && sim->virtualUs - beginUs >= (uint64_t) sim->wifiAssocMs * 1000) {
+         return WL_CONNECTED;
+      }
+      return WL_DISCONNECTED;
+   }
+
+   bool      disconnect(bool = false) { return true; }
+   bool      setAutoConnect(bool)     { return true; }
+   bool      setAutoReconnect(bool)   { return true; }
+   bool      setSleep(bool)           { return true; }
+   int       RSSI()                   { return sim->wifiRssi; }
+   IPAddress localIP()                { return IPAddress(192, 168, 0, 42); }
+
+   uint8_t *macAddress(uint8_t *mac)
+   {
+      static const uint8_t address[6] = { 0x24, 0x0A, 0xC4, 0x51, 0x4D, 0x00 };
+
+      memcpy(mac, address, sizeof(address));
+      return mac;
+   }
+};
+
+extern WiFiClass WiFi;
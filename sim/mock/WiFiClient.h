@@ -0,0 +1,167 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file WiFiClient.h
+  *
+  * Host stand-in of the ESP32 tcp client on a socket to the local servers.
+  */
+#pragma once
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "Arduino.h"
+
+/**
+  * Tcp connection to a local server. The name resolution of the simulation
+  * maps the host "collector" to the --collector and every other host to the
+  * --server, without one the connect fails. The real time of the waits advances
+  * the virtual clock, so the shaping of the server shows up in the wake.
+  */
+class WiFiClient : public Stream
+{
+protected:
+   uint8_t buffer[1460];    //!< Received data
+   int     used = 0;        //!< Size of the received data
+   int     pos = 0;         //!< Read position
+   int     fd = -1;         //!< The socket
+   bool    closed = false;  //!< The server closed the connection
+
+   static uint64_t NowUs()
+   {
+      struct timespec now;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+   }
+
+   /* Wait up to the ms for new data, false on a timeout or the end of the connection */
+   bool Fill(unsigned long waitMs)
+   {
+      if (fd < 0 || closed) {
+         return false;
+      }
+      uint64_t      start  = NowUs();
+      struct pollfd poller = { fd, POLLIN, 0 };
+      int           ready  = poll(&poller, 1, waitMs);
+
+      used = ready > 0 ? recv(fd, buffer, sizeof(buffer), 0) : -1;
+      pos  = 0;
+      SimAdvanceUs(NowUs() - start);
+      closed = ready > 0 && used <= 0;
+      if (used <= 0) {
+         used = 0;
+         return false;
+      }
+      sim->bytesRx += used;
+      return true;
+   }
+
+public:
+   virtual ~WiFiClient() { stop(); }
+
+   virtual int connect(const char *host, uint16_t port) { return connect(host, port, 30000); }
+
+   /* Connect to the server of the simulation that stands for the host */
+   virtual int connect(const char *host, uint16_t, int32_t)
+   {
+      const char      *server = strcmp(host, "collector") ? sim->server : sim->collector;
+      const char      *colon  = strchr(server, ':');
+      struct addrinfo  hints  = {};
+      struct addrinfo *result = NULL;
+      uint64_t         start  = NowUs();
+      char             name[64];
+
+      stop();
+      if (!server[0]) {
+         return 0;
+      }
+      snprintf(name, sizeof(name), "%.*s", colon ? (int) (colon - server) : (int) strlen(server), server);
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(name, colon ? colon + 1 : "80", &hints, &result) != 0) {
+         return 0;
+      }
+      fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+      if (fd >= 0 && ::connect(fd, result->ai_addr, result->ai_addrlen) != 0) {
+         stop();
+      }
+      freeaddrinfo(result);
+      SimAdvanceUs(NowUs() - start);
+      return fd >= 0;
+   }
+
+   virtual void stop()
+   {
+      if (fd >= 0) {
+         close(fd);
+      }
+      fd     = -1;
+      used   = pos = 0;
+      closed = false;
+   }
+
+   virtual uint8_t connected() { return (fd >= 0 && !closed) || pos < used; }
+
+   size_t write(uint8_t c) override { return write(&c, 1); }
+   size_t write(const uint8_t *data, size_t size) override
+   {
+      ssize_t sent = fd >= 0 ? send(fd, data, size, MSG_NOSIGNAL) : -1;
+
+      sim->bytesTx += sent > 0 ? sent : 0;
+      return sent > 0 ? sent : 0;
+   }
+   using Print::write;
+
+   /* Received bytes without a wait, like the non-blocking socket of the ESP32 */
+   int available() override
+   {
+      if (pos >= used) {
+         Fill(0);
+      }
+      return used - pos;
+   }
+
+   /* Blocks up to the timeout like the timed read of the ESP32 stream */
+   int read() override
+   {
+      if (pos >= used && !Fill(timeout)) {
+         return -1;
+      }
+      return buffer[pos++];
+   }
+
+   virtual int read(uint8_t *data, size_t size)
+   {
+      if (pos >= used && !Fill(timeout)) {
+         return -1;
+      }
+      int count = std::min((int) size, used - pos);
+
+      memcpy(data, buffer + pos, count);
+      pos += count;
+      return count;
+   }
+
+   int peek() override
+   {
+      if (pos >= used && !Fill(timeout)) {
+         return -1;
+      }
+      return buffer[pos];
+   }
+};
@@ -0,0 +1,42 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Wire.h
+  *
+  * Host stand-in of the I2C bus with the status register 2 of the BM8563.
+  */
+#pragma once
+#include "Arduino.h"
+
+/**
+  * I2C bus, only the BM8563 status register 2 (0x01) has a value.
+  */
+class TwoWire
+{
+protected:
+   uint8_t reg = 0;  //!< The written register
+
+public:
+   void    begin(int = -1, int = -1, uint32_t = 0) {}
+   void    beginTransmission(uint8_t)               {}
+   size_t  write(uint8_t value)                     { reg = value; return 1; }
+   uint8_t endTransmission(bool = true)             { SimAdvanceUs(100); return 0; }
+   uint8_t requestFrom(uint8_t, uint8_t count)      { SimAdvanceUs(100); return count; }
+   int     read()                                   { return reg == 0x01 ? sim->rtcStatus2 : 0; }
+};
+
+extern TwoWire Wire;
@@ -0,0 +1,64 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file esp_heap_caps.h
+  *
+  * Host stand-in of the ESP-IDF heap information on the counted malloc of the simulation.
+  * The internal heap has no fragmentation, only the limit of the largest region.
+  */
+#pragma once
+#include <stddef.h>
+#include "../Sim.h"
+
+#define MALLOC_CAP_8BIT      (1 << 2)
+#define MALLOC_CAP_SPIRAM    (1 << 10)
+#define MALLOC_CAP_INTERNAL  (1 << 11)
+
+typedef struct multi_heap_info_t
+{
+   size_t total_free_bytes;
+   size_t total_allocated_bytes;
+   size_t largest_free_block;
+   size_t minimum_free_bytes;
+   size_t allocated_blocks;
+   size_t free_blocks;
+   size_t total_blocks;
+} multi_heap_info_t;
+
+inline size_t heap_caps_get_minimum_free_size(uint32_t caps)
+{
+   if (caps & MALLOC_CAP_SPIRAM) {
+      return SIM_PSRAM_SIZE - (simHeap.psramBytes - simHeap.psramBase);
+   }
+   return SIM_HEAP_SIZE - std::max((int64_t) 0, simHeap.internalPeak - simHeap.internalBase);
+}
+
+inline void heap_caps_get_info(multi_heap_info_t *info, uint32_t caps)
+{
+   bool    psram = caps & MALLOC_CAP_SPIRAM;
+   int64_t used  = psram ? simHeap.psramBytes - simHeap.psramBase : simHeap.internalBytes - simHeap.internalBase;
+   size_t  size  = psram ? SIM_PSRAM_SIZE : SIM_HEAP_SIZE;
+
+   used = std::max((int64_t) 0, used);
+   info->total_free_bytes      = size - used;
+   info->total_allocated_bytes = used;
+   info->largest_free_block    = psram ? size - used : std::min(size - used, (size_t) SIM_HEAP_LARGEST);
+   info->minimum_free_bytes    = heap_caps_get_minimum_free_size(caps);
+   info->allocated_blocks      = psram ? 0 : std::max((int64_t) 0, simHeap.internalBlocks - simHeap.internalBaseCount);
+   info->free_blocks           = 1;
+   info->total_blocks          = info->allocated_blocks + 1;
+}
@@ -0,0 +1,151 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file esp_partition.h
+  *
+  * Host stand-in of the ESP32 partitions: the data partitions of the sketch in the simulated NOR flash.
+  */
+#pragma once
+#include <string.h>
+#include <stdlib.h>
+#include "nvs.h"
+
+#define ESP_PARTITION_SUBTYPE_ANY  0xff
+#define ESP_ERR_INVALID_ARG        0x102
+#define ESP_ERR_INVALID_SIZE       0x104
+#define SIM_PARTITIONS_MAX         16
+#define SIM_SECTOR_ERASE_US        45000  // erase time of a 4 KB sector
+#define SIM_FLASH_READ_BPS         20000000
+
+typedef enum { ESP_PARTITION_TYPE_APP = 0, ESP_PARTITION_TYPE_DATA = 1 } esp_partition_type_t;
+typedef enum { SPI_FLASH_MMAP_DATA, SPI_FLASH_MMAP_INST } spi_flash_mmap_memory_t;
+typedef int      esp_partition_subtype_t;
+typedef uint32_t spi_flash_mmap_handle_t;
+
+struct esp_partition_t
+{
+   esp_partition_type_t type;
+   int                  subtype;
+   uint32_t             address;
+   uint32_t             size;
+   char                 label[17];
+   bool                 encrypted;
+};
+
+/* The custom data partitions (subtype >= 0x40) of the partitions.csv of the sketch, packed into the flash */
+inline esp_partition_t *SimPartitions(int &count)
+{
+   static esp_partition_t partitions[SIM_PARTITIONS_MAX];
+   static int             found = -1;
+
+   if (found < 0) {
+      FILE    *file    = fopen(SIM_PARTITIONS, "r");
+      char     line[256];
+      uint32_t address = 0;
+
+      found = 0;
+      while (file && fgets(line, sizeof(line), file) && found < SIM_PARTITIONS_MAX) {
+         char name[32], type[16], subtype[16], offset[32], size[32];
+
+         if (line[0] == '#' || sscanf(line, " %31[^,], %15[^,], %15[^,], %31[^,], %31[^,\n]", name, type, subtype, offset, size) != 5
+            || strncmp(type, "data", 4) || strtol(subtype, NULL, 0) < 0x40) {
+            continue;
+         }
+         esp_partition_t &partition = partitions[found++];
+
+         partition.type    = ESP_PARTITION_TYPE_DATA;
+         partition.subtype = strtol(subtype, NULL, 0);
+         partition.address = address;
+         partition.size    = strtoul(size, NULL, 0);
+         strlcpy(partition.label, name, sizeof(partition.label));
+         address += partition.size;
+         if (address > SIM_FLASH_SIZE) {
+            fprintf(stderr, "sim: the partitions exceed the simulated flash\n");
+            exit(1);
+         }
+      }
+      if (file) {
+         fclose(file);
+      }
+   }
+   count = found;
+   return partitions;
+}
+
+inline const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, int subtype, const char *label)
+{
+   int              count;
+   esp_partition_t *partitions = SimPartitions(count);
+
+   for (int i = 0; i < count; i++) {
+      if (partitions[i].type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || partitions[i].subtype == subtype)
+         && (!label || !strcmp(label, partitions[i].label))) {
+         return &partitions[i];
+      }
+   }
+   return NULL;
+}
+
+inline esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size)
+{
+   if (offset + size > partition->size) {
+      return ESP_ERR_INVALID_SIZE;
+   }
+   memcpy(dst, sim->flash + partition->address + offset, size);
+   SimAdvanceUs((uint64_t) size * 1000000 / SIM_FLASH_READ_BPS);
+   return ESP_OK;
+}
+
+/* NOR flash: a write can only clear bits */
+inline esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src, size_t size)
+{
+   SimCheckTimerContext("flash write");
+   if (offset + size > partition->size) {
+      return ESP_ERR_INVALID_SIZE;
+   }
+   for (size_t i = 0; i < size; i++) {
+      sim->flash[partition->address + offset + i] &= ((const uint8_t *) src)[i];
+   }
+   SimAdvanceUs(size * 2 + 50);
+   return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+   SimCheckTimerContext("flash erase");
+   if (offset % 4096 || size % 4096 || offset + size > partition->size) {
+      return ESP_ERR_INVALID_ARG;
+   }
+   memset(sim->flash + partition->address + offset, 0xff, size);
+   SimAdvanceUs(size / 4096 * SIM_SECTOR_ERASE_US);
+   return ESP_OK;
+}
+
+inline esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+   spi_flash_mmap_memory_t, const void **pointer, spi_flash_mmap_handle_t *handle)
+{
+   if (offset + size > partition->size) {
+      return ESP_ERR_INVALID_SIZE;
+   }
+   *pointer = sim->flash + partition->address + offset;
+   *handle  = 1;
+   return ESP_OK;
+}
+
+inline void spi_flash_munmap(spi_flash_mmap_handle_t)
+{
+}
@@ -0,0 +1,58 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file esp_timer.h
+  *
+  * Host stand-in of the ESP-IDF high resolution timer: one one shot timer
+  * on the virtual clock, its callback runs on its own thread inside the next
+  * SimAdvanceUs and aborts the simulation if it blocks or uses the flash.
+  */
+#pragma once
+#include "nvs.h"
+
+typedef struct esp_timer *esp_timer_handle_t;
+
+typedef struct esp_timer_create_args_t
+{
+   void      (*callback)(void *);
+   void       *arg;
+   int         dispatch_method;
+   const char *name;
+   bool        skip_unhandled_events;
+} esp_timer_create_args_t;
+
+inline esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+   simTimer.callback = args->callback;
+   simTimer.arg      = args->arg;
+   simTimer.running  = false;
+   *handle = (esp_timer_handle_t) &simTimer;
+   return ESP_OK;
+}
+
+inline esp_err_t esp_timer_start_once(esp_timer_handle_t, uint64_t timeoutUs)
+{
+   simTimer.dueUs   = sim->virtualUs + timeoutUs;
+   simTimer.running = true;
+   return ESP_OK;
+}
+
+inline esp_err_t esp_timer_stop(esp_timer_handle_t)
+{
+   simTimer.running = false;
+   return ESP_OK;
+}
@@ -0,0 +1,355 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file ssl.h
+  *
+  * Host stand-in of the mbedtls 2.x client API of the ESP32 on OpenSSL, so the
+  * tls transport of the sketch talks real TLS 1.2 to a local server. The records
+  * go through the bio callbacks of the sketch, the crypto of the handshake costs
+  * the virtual time of the ESP32.
+  */
+#pragma once
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <stdint.h>
+#include <string.h>
+#include "../Sim.h"
+
+#define SIM_TLS_FULL_US    1200000  // ECDHE and RSA of a full handshake on the ESP32 at 240 MHz
+#define SIM_TLS_RESUME_US  30000    // hashes of a resumed handshake
+
+#define MBEDTLS_SSL_SESSION_TICKETS
+
+#define MBEDTLS_SSL_IS_CLIENT                0
+#define MBEDTLS_SSL_TRANSPORT_STREAM         0
+#define MBEDTLS_SSL_PRESET_DEFAULT           0
+#define MBEDTLS_SSL_VERIFY_NONE              0
+#define MBEDTLS_SSL_VERIFY_OPTIONAL          1
+#define MBEDTLS_SSL_VERIFY_REQUIRED          2
+#define MBEDTLS_SSL_SESSION_TICKETS_DISABLED 0
+#define MBEDTLS_SSL_SESSION_TICKETS_ENABLED  1
+
+#define MBEDTLS_ERR_NET_SEND_FAILED          -0x004E
+#define MBEDTLS_ERR_X509_CERT_VERIFY_FAILED  -0x2700
+#define MBEDTLS_ERR_SSL_BAD_INPUT_DATA       -0x7100
+#define MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE  -0x7780
+#define MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY    -0x7880
+#define MBEDTLS_ERR_SSL_ALLOC_FAILED         -0x7F00
+#define MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL     -0x6A00
+#define MBEDTLS_ERR_SSL_TIMEOUT              -0x6800
+#define MBEDTLS_ERR_SSL_WANT_WRITE           -0x6880
+#define MBEDTLS_ERR_SSL_WANT_READ            -0x6900
+
+typedef int mbedtls_ssl_send_t(void *ctx, const unsigned char *buf, size_t len);
+typedef int mbedtls_ssl_recv_t(void *ctx, unsigned char *buf, size_t len);
+typedef int mbedtls_ssl_recv_timeout_t(void *ctx, unsigned char *buf, size_t len, uint32_t timeout);
+
+struct mbedtls_entropy_context  { int unused; };
+struct mbedtls_ctr_drbg_context { int unused; };
+
+/* Certificate chain, the PEM text of the CA */
+struct mbedtls_x509_crt
+{
+   X509 *cert;
+};
+
+/* Session of a handshake for the resumption */
+struct mbedtls_ssl_session
+{
+   SSL_SESSION *session;
+};
+
+struct mbedtls_ssl_config
+{
+   int               authmode;
+   int               tickets;
+   uint32_t          readTimeout;
+   mbedtls_x509_crt *ca;
+   int             (*verify)(void *, mbedtls_x509_crt *, int, uint32_t *);
+   void             *verifyContext;
+};
+
+struct mbedtls_ssl_context
+{
+   const mbedtls_ssl_config   *conf;
+   SSL_CTX                    *ctx;
+   SSL                        *ssl;
+   BIO                        *in;       //!< Received records for OpenSSL
+   BIO                        *out;      //!< Records of OpenSSL to send
+   void                       *bio;      //!< Context of the callbacks
+   mbedtls_ssl_send_t         *send;
+   mbedtls_ssl_recv_t         *recv;
+   mbedtls_ssl_recv_timeout_t *recvTimeout;
+};
+
+inline void mbedtls_entropy_init(mbedtls_entropy_context *) {}
+inline void mbedtls_entropy_free(mbedtls_entropy_context *) {}
+inline int  mbedtls_entropy_func(void *, unsigned char *, size_t) { return 0; }
+inline void mbedtls_ctr_drbg_init(mbedtls_ctr_drbg_context *) {}
+inline void mbedtls_ctr_drbg_free(mbedtls_ctr_drbg_context *) {}
+inline int  mbedtls_ctr_drbg_random(void *, unsigned char *output, size_t len) { return RAND_bytes(output, len) == 1 ? 0 : -1; }
+inline int  mbedtls_ctr_drbg_seed(mbedtls_ctr_drbg_context *, int (*)(void *, unsigned char *, size_t), void *,
+   const unsigned char *, size_t) { return 0; }
+
+inline void mbedtls_strerror(int ret, char *buffer, size_t size)
+{
+   snprintf(buffer, size, "mbedtls error -0x%04X", (unsigned) -ret);
+}
+
+inline void mbedtls_x509_crt_init(mbedtls_x509_crt *crt) { crt->cert = NULL; }
+inline void mbedtls_x509_crt_free(mbedtls_x509_crt *crt) { X509_free(crt->cert); crt->cert = NULL; }
+
+/* Only the first certificate of the PEM text, the length includes the terminating zero */
+inline int mbedtls_x509_crt_parse(mbedtls_x509_crt *crt, const unsigned char *buf, size_t len)
+{
+   BIO *bio = BIO_new_mem_buf(buf, len);
+
+   crt->cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+   BIO_free(bio);
+   return crt->cert ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+}
+
+inline void mbedtls_ssl_session_init(mbedtls_ssl_session *session) { session->session = NULL; }
+inline void mbedtls_ssl_session_free(mbedtls_ssl_session *session) { SSL_SESSION_free(session->session); session->session = NULL; }
+
+inline int mbedtls_ssl_session_save(const mbedtls_ssl_session *session, unsigned char *buf, size_t buf_len, size_t *olen)
+{
+   int size = session->session ? i2d_SSL_SESSION(session->session, NULL) : 0;
+
+   *olen = size;
+   if (size <= 0) {
+      return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+   }
+   if ((size_t) size > buf_len) {
+      return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+   }
+   i2d_SSL_SESSION(session->session, &buf);
+   return 0;
+}
+
+inline int mbedtls_ssl_session_load(mbedtls_ssl_session *session, const unsigned char *buf, size_t len)
+{
+   SSL_SESSION_free(session->session);
+   session->session = d2i_SSL_SESSION(NULL, &buf, len);
+   return session->session ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+}
+
+inline void mbedtls_ssl_config_init(mbedtls_ssl_config *conf) { memset(conf, 0, sizeof(*conf)); }
+inline void mbedtls_ssl_config_free(mbedtls_ssl_config *) {}
+
+inline int mbedtls_ssl_config_defaults(mbedtls_ssl_config *conf, int, int, int)
+{
+   conf->authmode = MBEDTLS_SSL_VERIFY_REQUIRED;
+   conf->tickets  = MBEDTLS_SSL_SESSION_TICKETS_ENABLED;
+   return 0;
+}
+
+inline void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode)  { conf->authmode = authmode; }
+inline void mbedtls_ssl_conf_read_timeout(mbedtls_ssl_config *conf, uint32_t timeout) { conf->readTimeout = timeout; }
+inline void mbedtls_ssl_conf_session_tickets(mbedtls_ssl_config *conf, int use_tickets) { conf->tickets = use_tickets; }
+inline void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *conf, mbedtls_x509_crt *ca, void *) { conf->ca = ca; }
+inline void mbedtls_ssl_conf_rng(mbedtls_ssl_config *, int (*)(void *, unsigned char *, size_t), void *) {}
+
+inline void mbedtls_ssl_conf_verify(mbedtls_ssl_config *conf, int (*verify)(void *, mbedtls_x509_crt *, int, uint32_t *), void *context)
+{
+   conf->verify        = verify;
+   conf->verifyContext = context;
+}
+
+inline void mbedtls_ssl_init(mbedtls_ssl_context *ssl) { memset(ssl, 0, sizeof(*ssl)); }
+
+inline void mbedtls_ssl_free(mbedtls_ssl_context *ssl)
+{
+   SSL_free(ssl->ssl);  // frees the bios
+   SSL_CTX_free(ssl->ctx);
+   memset(ssl, 0, sizeof(*ssl));
+}
+
+/* The ESP32 has mbedtls 2.x without TLS 1.3, its TLS 1.2 session tickets are resumed */
+inline int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf)
+{
+   ssl->conf = conf;
+   ssl->ctx  = SSL_CTX_new(TLS_client_method());
+   if (!ssl->ctx) {
+      return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+   }
+   SSL_CTX_set_max_proto_version(ssl->ctx, TLS1_2_VERSION);
+   if (conf->tickets != MBEDTLS_SSL_SESSION_TICKETS_ENABLED) {
+      SSL_CTX_set_options(ssl->ctx, SSL_OP_NO_TICKET);
+   }
+   if (conf->authmode == MBEDTLS_SSL_VERIFY_REQUIRED && conf->ca && conf->ca->cert) {
+      X509_STORE_add_cert(SSL_CTX_get_cert_store(ssl->ctx), conf->ca->cert);
+      SSL_CTX_set_verify(ssl->ctx, SSL_VERIFY_PEER, NULL);
+   }
+   ssl->ssl = SSL_new(ssl->ctx);
+   ssl->in  = BIO_new(BIO_s_mem());
+   ssl->out = BIO_new(BIO_s_mem());
+   if (!ssl->ssl || !ssl->in || !ssl->out) {
+      return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+   }
+   BIO_set_mem_eof_return(ssl->in, -1);
+   SSL_set_bio(ssl->ssl, ssl->in, ssl->out);
+   SSL_set_connect_state(ssl->ssl);
+   return 0;
+}
+
+inline int mbedtls_ssl_set_hostname(mbedtls_ssl_context *ssl, const char *hostname)
+{
+   if (ssl->conf->authmode == MBEDTLS_SSL_VERIFY_REQUIRED) {
+      SSL_set1_host(ssl->ssl, hostname);
+   }
+   return SSL_set_tlsext_host_name(ssl->ssl, hostname) == 1 ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+}
+
+inline void mbedtls_ssl_set_bio(mbedtls_ssl_context *ssl, void *bio, mbedtls_ssl_send_t *send, mbedtls_ssl_recv_t *recv,
+   mbedtls_ssl_recv_timeout_t *recvTimeout)
+{
+   ssl->bio         = bio;
+   ssl->send        = send;
+   ssl->recv        = recv;
+   ssl->recvTimeout = recvTimeout;
+}
+
+inline int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session)
+{
+   return SSL_set_session(ssl->ssl, session->session) == 1 ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+}
+
+inline int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session)
+{
+   SSL_SESSION_free(session->session);
+   session->session = SSL_get1_session(ssl->ssl);
+   return session->session ? 0 : MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+}
+
+/* Send the pending records of OpenSSL with the send callback */
+inline int SimTlsFlush(mbedtls_ssl_context *ssl)
+{
+   unsigned char buffer[4096];
+   int           size;
+
+   while ((size = BIO_read(ssl->out, buffer, sizeof(buffer))) > 0) {
+      for (int sent = 0; sent < size; ) {
+         int ret = ssl->send(ssl->bio, buffer + sent, size - sent);
+
+         if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return ret;
+         }
+         sent += ret > 0 ? ret : 0;
+      }
+   }
+   return 0;
+}
+
+/* Receive records with the receive callback for OpenSSL, 0 if some arrived */
+inline int SimTlsReceive(mbedtls_ssl_context *ssl)
+{
+   unsigned char buffer[4096];
+   int           size = ssl->recvTimeout ? ssl->recvTimeout(ssl->bio, buffer, sizeof(buffer), ssl->conf->readTimeout)
+                                         : ssl->recv(ssl->bio, buffer, sizeof(buffer));
+
+   if (size == 0) {
+      return MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY;
+   }
+   if (size < 0) {
+      return size;
+   }
+   BIO_write(ssl->in, buffer, size);
+   return 0;
+}
+
+/* Map the OpenSSL result of an operation, receive more records if it waits for them */
+inline int SimTlsResult(mbedtls_ssl_context *ssl, int result)
+{
+   int ret = SimTlsFlush(ssl);
+
+   if (result > 0 || ret) {
+      return ret;
+   }
+   switch (SSL_get_error(ssl->ssl, result)) {
+      case SSL_ERROR_WANT_READ:   return (ret = SimTlsReceive(ssl)) ? ret : MBEDTLS_ERR_SSL_WANT_READ;
+      case SSL_ERROR_WANT_WRITE:  return MBEDTLS_ERR_SSL_WANT_WRITE;
+      case SSL_ERROR_ZERO_RETURN: return MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY;
+      default:                    return SSL_get_verify_result(ssl->ssl) != X509_V_OK ? MBEDTLS_ERR_X509_CERT_VERIFY_FAILED
+                                                                                     : MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE;
+   }
+}
+
+/*
+ *  One step of the handshake like the non-blocking mbedtls: WANT_READ after new records.
+ *  A full handshake verifies the certificate with the callback, a resumed one has none.
+ */
+inline int mbedtls_ssl_handshake(mbedtls_ssl_context *ssl)
+{
+   int ret = SimTlsResult(ssl, SSL_do_handshake(ssl->ssl));
+
+   if (ret || !SSL_is_init_finished(ssl->ssl)) {
+      return ret;
+   }
+   if (SSL_session_reused(ssl->ssl)) {
+      SimAdvanceUs(SIM_TLS_RESUME_US);
+   } else {
+      uint32_t         flags = 0;
+      mbedtls_x509_crt peer  = { SSL_get0_peer_certificate(ssl->ssl) };
+
+      SimAdvanceUs(SIM_TLS_FULL_US);
+      if (ssl->conf->verify) {
+         ssl->conf->verify(ssl->conf->verifyContext, &peer, 0, &flags);
+      }
+   }
+   return 0;
+}
+
+/* Blocks like mbedtls with a receive timeout until there is data, the closure or the timeout */
+inline int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len)
+{
+   unsigned char none;
+   int           size;
+   int           ret;
+
+   if (!len) { // process the next record only, like the available() of the ESP32 client
+      ret = SimTlsResult(ssl, SSL_peek(ssl->ssl, &none, 1));
+      return ret == MBEDTLS_ERR_SSL_WANT_READ ? 0 : ret;
+   }
+   do {
+      size = SSL_read(ssl->ssl, buf, len);
+      ret  = SimTlsResult(ssl, size);
+   } while (ret == MBEDTLS_ERR_SSL_WANT_READ);
+   return size > 0 && !ret ? size : ret;
+}
+
+inline size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *ssl)
+{
+   return SSL_pending(ssl->ssl);
+}
+
+inline int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len)
+{
+   int size = SSL_write(ssl->ssl, buf, len);
+   int ret  = SimTlsResult(ssl, size);
+
+   return size > 0 && !ret ? size : ret;
+}
+
+inline int mbedtls_ssl_close_notify(mbedtls_ssl_context *ssl)
+{
+   SSL_shutdown(ssl->ssl);
+   return SimTlsFlush(ssl);
+}
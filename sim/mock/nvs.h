@@ -0,0 +1,164 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file nvs.h
+  *
+  * Host stand-in of the ESP32 nvs: the entries are kept in the simulation state.
+  */
+#pragma once
+#include <string.h>
+#include "../Sim.h"
+
+typedef uint32_t nvs_handle;
+typedef int      esp_err_t;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode;
+
+#define ESP_OK                 0
+#define ESP_FAIL              -1
+#define ESP_ERR_NVS_NOT_FOUND  0x1102
+#define SIM_NVS_NAMESPACES     8
+
+/**
+  * Header of an entry in the nvs memory, followed by the value.
+  * A changed size leaves the old entry without a key.
+  */
+struct SimNvsEntry
+{
+   char     ns[16];   //!< Namespace
+   char     key[16];  //!< Key, empty = deleted
+   uint16_t length;   //!< Size of the value, 0 = end of the entries
+};
+
+/* Names of the opened namespaces, the handle is the index + 1 */
+inline char (*SimNvsNamespaces())[16]
+{
+   static char names[SIM_NVS_NAMESPACES][16];
+
+   return names;
+}
+
+/* Find the entry of the key, optional a new entry of the length */
+inline uint8_t *SimNvsFind(nvs_handle handle, const char *key, bool create, uint16_t length)
+{
+   if (handle < 1 || handle > SIM_NVS_NAMESPACES) {
+      return NULL;
+   }
+   const char *ns    = SimNvsNamespaces()[handle - 1];
+   uint8_t    *entry = sim->nvs;
+
+   while (entry < sim->nvs + SIM_NVS_SIZE - sizeof(SimNvsEntry)) {
+      SimNvsEntry *header = (SimNvsEntry *) entry;
+
+      if (!header->length) {
+         break;
+      }
+      if (!strncmp(header->ns, ns, 15) && !strncmp(header->key, key, 15)) {
+         if (!create || header->length == length) {
+            return entry;
+         }
+         header->key[0] = 0;
+      }
+      entry += sizeof(SimNvsEntry) + header->length;
+   }
+   if (!create || entry + sizeof(SimNvsEntry) + length > sim->nvs + SIM_NVS_SIZE) {
+      return NULL;
+   }
+
+   SimNvsEntry *header = (SimNvsEntry *) entry;
+
+   strlcpy(header->ns,  ns,  sizeof(header->ns));
+   strlcpy(header->key, key, sizeof(header->key));
+   header->length = length;
+   return entry;
+}
+
+inline esp_err_t nvs_open(const char *name, nvs_open_mode, nvs_handle *handle)
+{
+   char (*names)[16] = SimNvsNamespaces();
+
+   for (int i = 0; i < SIM_NVS_NAMESPACES; i++) {
+      if (!names[i][0]) {
+         strlcpy(names[i], name, sizeof(names[i]));
+      }
+      if (!strcmp(names[i], name)) {
+         *handle = i + 1;
+         return ESP_OK;
+      }
+   }
+   *handle = 0;  // invalid, every access fails
+   return ESP_FAIL;
+}
+
+inline void nvs_close(nvs_handle)
+{
+}
+
+inline esp_err_t nvs_commit(nvs_handle)
+{
+   SimAdvanceUs(15000);
+   return ESP_OK;
+}
+
+inline esp_err_t nvs_set_blob(nvs_handle handle, const char *key, const void *value, size_t length)
+{
+   SimCheckTimerContext("nvs write");
+
+   uint8_t *entry = SimNvsFind(handle, key, true, length);
+
+   if (!entry) {
+      return ESP_FAIL;
+   }
+   memcpy(entry + sizeof(SimNvsEntry), value, length);
+   return ESP_OK;
+}
+
+inline esp_err_t nvs_get_blob(nvs_handle handle, const char *key, void *value, size_t *length)
+{
+   uint8_t *entry = SimNvsFind(handle, key, false, 0);
+
+   if (!entry) {
+      return ESP_ERR_NVS_NOT_FOUND;
+   }
+
+   SimNvsEntry *header = (SimNvsEntry *) entry;
+
+   if (value) {
+      memcpy(value, entry + sizeof(SimNvsEntry), *length < header->length ? *length : header->length);
+   }
+   *length = header->length;
+   return ESP_OK;
+}
+
+inline esp_err_t nvs_erase_key(nvs_handle handle, const char *key)
+{
+   uint8_t *entry = SimNvsFind(handle, key, false, 0);
+
+   if (entry) {
+      ((SimNvsEntry *) entry)->key[0] = 0;
+   }
+   return ESP_OK;
+}
+
+#define SIM_NVS_INT(suffix, type) \
+   inline esp_err_t nvs_set_##suffix(nvs_handle h, const char *k, type v)  { return nvs_set_blob(h, k, &v, sizeof(v)); } \
+   inline esp_err_t nvs_get_##suffix(nvs_handle h, const char *k, type *v) { size_t n = sizeof(*v); return nvs_get_blob(h, k, v, &n); }
+
+SIM_NVS_INT(u8,  uint8_t)
+SIM_NVS_INT(u16, uint16_t)
+SIM_NVS_INT(i16, int16_t)
+SIM_NVS_INT(u32, uint32_t)
+SIM_NVS_INT(i32, int32_t)
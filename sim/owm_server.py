@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+#
+#  Copyright (C) 2021 SFini
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""Local stand-in of the openweathermap One Call 3.0 api.
+
+Answers /data/3.0/onecall with a recorded payload (--fixture) or with the
+synthesized forecast of fixtures/onecall.py for the current time. The answer
+can be shaped with a latency, a throughput, chunked encoding, a truncated
+body and http errors. Every request is logged with its timing:
+
+    time status mode bytes first-byte-ms total-ms path
+
+Point OPENWEATHER_SRV/OPENWEATHER_PORT of the config.h at this server, or
+start the simulation with --server localhost:<port>. The simulation sends
+its virtual UTC time in the X-Sim-Time header, the generated forecast uses it.
+
+With --tls the server speaks https with a self-signed certificate (or --cert
+and --key) for a simulation built with -DSIM_TLS=1, the mode of the log shows
+if the tls session of the client was resumed.
+"""
+import argparse
+import itertools
+import json
+import os
+import random
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "fixtures"))
+import onecall  # noqa: E402
+
+PATH = "/data/3.0/onecall"
+
+
+class OneCallHandler(BaseHTTPRequestHandler):
+    """Answers one request with the shaping of the server options."""
+
+    protocol_version = "HTTP/1.1"
+    requests = itertools.count(1)
+
+    def log_message(self, format, *args):
+        pass  # replaced by the timing log
+
+    def do_GET(self):
+        options = self.server.options
+        number = next(OneCallHandler.requests)
+        start = time.monotonic()
+        status = 200
+        body = b""
+
+        if self.path.split("?")[0] != PATH:
+            status = 404
+        elif options.error and (options.error_every <= 1 or number % options.error_every == 0):
+            status = options.error
+        elif random.random() < options.error_rate:
+            status = 500
+        if status == 200:
+            body = self.payload()
+        else:
+            body = json.dumps({"cod": status, "message": "simulated error"}).encode()
+
+        if options.latency or options.jitter:
+            time.sleep(max(0, options.latency + random.uniform(-options.jitter, options.jitter)) / 1000)
+        if options.hang:
+            time.sleep(options.hang / 1000)
+            self.close_connection = True
+            self.log(status, "hang", 0, None, start)
+            return
+
+        # chunked transfer needs http 1.1, a http 1.0 client always gets the content length
+        chunked = options.chunked and self.request_version == "HTTP/1.1"
+        sent = len(body) if not options.truncate else min(options.truncate, len(body))
+
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json; charset=utf-8")
+        if chunked:
+            self.send_header("Transfer-Encoding", "chunked")
+        else:
+            self.send_header("Content-Length", str(len(body)))
+        self.send_header("Connection", "close")
+        self.end_headers()
+        self.close_connection = True
+        first = time.monotonic()
+
+        try:
+            self.send_body(body[:sent], chunked, sent == len(body))
+        except (BrokenPipeError, ConnectionResetError):
+            self.log(status, "reset", sent, first, start)
+            return
+        mode = "chunked" if chunked else "length"
+        if sent < len(body):
+            mode += " truncated"
+        if options.tls:
+            mode += " resumed" if self.connection.session_reused else " full"
+        self.log(status, mode, sent, first, start)
+
+    def payload(self):
+        """Recorded or synthesized One Call answer"""
+        options = self.server.options
+        if options.fixture:
+            with open(options.fixture, "rb") as file:
+                return file.read()
+        utc = int(self.headers.get("X-Sim-Time", time.time()))
+        return json.dumps(onecall.onecall(utc)).encode()
+
+    def send_body(self, body, chunked, complete):
+        """Write the body with the throughput limit, chunks of --chunk-size"""
+        options = self.server.options
+        step = options.chunk_size if chunked else 1460
+        for offset in range(0, len(body), step):
+            part = body[offset:offset + step]
+            if chunked:
+                part = b"%x\r\n%s\r\n" % (len(part), part)
+            self.wfile.write(part)
+            self.wfile.flush()
+            if options.rate:
+                time.sleep(len(part) / options.rate)
+        if chunked and complete:
+            self.wfile.write(b"0\r\n\r\n")
+        self.wfile.flush()
+
+    def log(self, status, mode, size, first, start):
+        end = time.monotonic()
+        first_ms = "-" if first is None else "%.0f" % ((first - start) * 1000)
+        line = "%s %d %s %d %s %.0f %s" % (time.strftime("%H:%M:%S"), status, mode.replace(" ", "+"),
+                                          size, first_ms, (end - start) * 1000, self.path.split("?")[0])
+        print(line, flush=True)
+        if self.server.options.log:
+            with open(self.server.options.log, "a") as file:
+                file.write(line + "\n")
+
+
+def tls_context(options, folder):
+    """Server context of --tls, a self-signed certificate without --cert"""
+    cert, key = options.cert, options.key or options.cert
+    if not cert:
+        cert, key = os.path.join(folder, "cert.pem"), os.path.join(folder, "key.pem")
+        subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1",
+                        "-subj", "/CN=localhost", "-keyout", key, "-out", cert],
+                       check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.load_cert_chain(cert, key)
+    return context
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0", help="address to listen on (default all)")
+    parser.add_argument("--port", type=int, default=8080, help="port to listen on (default 8080)")
+    parser.add_argument("--fixture", help="recorded json answer instead of the synthesized one")
+    parser.add_argument("--latency", type=float, default=0, help="ms until the answer starts")
+    parser.add_argument("--jitter", type=float, default=0, help="random +- ms of the latency")
+    parser.add_argument("--rate", type=float, default=0, help="throughput in bytes/s (0 = unlimited)")
+    parser.add_argument("--chunked", action="store_true", help="chunked transfer encoding for http 1.1 clients")
+    parser.add_argument("--chunk-size", type=int, default=1024, help="bytes per chunk (default 1024)")
+    parser.add_argument("--truncate", type=int, default=0, help="close the connection after this many body bytes")
+    parser.add_argument("--error", type=int, default=0, help="answer with this http status, e.g. 429")
+    parser.add_argument("--error-every", type=int, default=1, help="only every n-th request gets --error")
+    parser.add_argument("--error-rate", type=float, default=0, help="probability of a 500 answer")
+    parser.add_argument("--hang", type=float, default=0, help="ms to hold the connection without an answer")
+    parser.add_argument("--seed", type=int, help="seed of the jitter and the random errors")
+    parser.add_argument("--log", help="append the timing log to this file")
+    parser.add_argument("--tls", action="store_true", help="https, the sessions of the clients can be resumed")
+    parser.add_argument("--cert", help="PEM certificate of --tls instead of a self-signed one")
+    parser.add_argument("--key", help="PEM key of --cert if it is not in the same file")
+    options = parser.parse_args()
+
+    random.seed(options.seed)
+    server = ThreadingHTTPServer((options.host, options.port), OneCallHandler)
+    server.options = options
+    with tempfile.TemporaryDirectory() as folder:
+        if options.tls:
+            server.socket = tls_context(options, folder).wrap_socket(server.socket, server_side=True)
+        print("owm_server: listening on %s:%d%s" % (options.host, options.port, " (tls)" if options.tls else ""),
+              flush=True)
+        try:
+            server.serve_forever()
+        except KeyboardInterrupt:
+            pass
+
+
+if __name__ == "__main__":
+    main()
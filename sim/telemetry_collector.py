@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+#  Copyright (C) 2021 SFini
+#
+#  This program is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 3 of the License, or
+#  (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+"""Reference collector of the telemetry batches of the M5Paper weather displays.
+
+Accepts the binary POST /telemetry of Telemetry.h and appends one CSV row
+per wake record to --csv. The header of a batch:
+
+    uint32 magic "TLM1", uint8 version, uint8 record size, uint16 count,
+    uint8[6] wifi mac, uint16 records left on the device
+
+followed by count records of the record size, all little endian. Point
+TELEMETRY_SRV/TELEMETRY_PORT of the ConfigOverride.h at this collector, or
+start the simulation with --collector localhost:<port>.
+"""
+import argparse
+import csv
+import struct
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+PATH = "/telemetry"
+MAGIC = 0x314D4C54
+BATCH = struct.Struct("<IBBH6sH")
+RECORD = struct.Struct("<IHHHHHbBBBH")
+CSV_LOCK = threading.Lock()  # the handler threads append to the same file
+
+REASONS = {0: "power_on", 1: "alarm", 2: "button", 3: "usb"}
+POLICIES = {0: "normal", 1: "stretch", 2: "sensor", 3: "minimal"}
+FLAGS = ((0x01, "fetched"), (0x02, "fetch_failed"), (0x04, "usb"))
+
+COLUMNS = ["received", "device", "time", "local_time", "wake_ms", "radio_ms", "fetch_ms", "render_ms",
+           "millivolt", "rssi", "reason", "flags", "policy", "min_free_kb"]
+
+
+def parse(body):
+    """Device and the records of a batch, ValueError if malformed"""
+    if len(body) < BATCH.size:
+        raise ValueError("short batch")
+    magic, version, size, count, mac, pending = BATCH.unpack_from(body)
+    if magic != MAGIC or version != 1:
+        raise ValueError("unknown batch %08x version %d" % (magic, version))
+    if size < RECORD.size or len(body) != BATCH.size + count * size:
+        raise ValueError("batch of %d bytes for %d records of %d bytes" % (len(body), count, size))
+    device = ":".join("%02x" % b for b in mac)
+    records = [RECORD.unpack_from(body, BATCH.size + i * size) for i in range(count)]
+    return device, pending, records
+
+
+def row(received, device, record):
+    """CSV row of one record, the device time is the local time of the RTC"""
+    when, wake, radio, fetch, render, millivolt, rssi, reason, flags, policy, min_free = record
+    names = "|".join(name for bit, name in FLAGS if flags & bit)
+    return [received, device, when, time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(when)), wake, radio, fetch,
+            render, millivolt, rssi, REASONS.get(reason, reason), names, POLICIES.get(policy, policy), min_free]
+
+
+class TelemetryHandler(BaseHTTPRequestHandler):
+    """Stores one batch"""
+
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, format, *args):
+        pass  # replaced by the batch log
+
+    def do_POST(self):
+        options = self.server.options
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        status = 204
+
+        if self.path.split("?")[0] != PATH:
+            status, message = 404, "unknown path %s" % self.path
+        else:
+            try:
+                device, pending, records = parse(body)
+            except ValueError as error:
+                status, message = 400, str(error)
+        if status == 204:
+            received = int(time.time())
+            with CSV_LOCK, open(options.csv, "a", newline="") as file:
+                writer = csv.writer(file)
+                if file.tell() == 0:
+                    writer.writerow(COLUMNS)
+                for record in records:
+                    writer.writerow(row(received, device, record))
+            message = "%s %d records, %d pending" % (device, len(records), pending)
+        print("%s %d %s" % (time.strftime("%H:%M:%S"), status, message), flush=True)
+
+        self.send_response(status)
+        self.send_header("Content-Length", "0")
+        self.send_header("Connection", "close")
+        self.end_headers()
+        self.close_connection = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="0.0.0.0", help="address to listen on (default all)")
+    parser.add_argument("--port", type=int, default=8081, help="port to listen on (default 8081)")
+    parser.add_argument("--csv", default="telemetry.csv", help="CSV file the records are appended to")
+    options = parser.parse_args()
+
+    server = ThreadingHTTPServer((options.host, options.port), TelemetryHandler)
+    server.options = options
+    print("telemetry_collector: listening on %s:%d, writing %s" % (options.host, options.port, options.csv), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    sys.exit(main())
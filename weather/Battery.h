@@ -22,9 +22,35 @@
 #pragma once
 
 #include "Data.h"
+#include "EPD.h"
+#include "Log.h"
+
+/* Energy saving steps of the battery policy */
+enum BatteryPolicy
+{
+   POLICY_NORMAL  = 0,  //!< Full cadence
+   POLICY_STRETCH = 1,  //!< Longer wake interval
+   POLICY_SENSOR  = 2,  //!< Only the M5Paper information, no weather
+   POLICY_MINIMAL = 3   //!< Low battery screen
+};
+
+/* Map the battery voltage linear between 3300 and 4350 mV to the capacity in % */
+int GetBatteryCapacity(uint32_t millivolt)
+{
+   float battery = (float)(millivolt - 3300) / (float)(4350 - 3300);
+
+   if (battery <= 0.01) {
+      battery = 0.01;
+   }
+   if (battery > 1) {
+      battery = 1;
+   }
+   return (int) (battery * 100);
+}
 
 /**
-  * Read the battery voltage
+  * Read the battery voltage and estimate the remaining days
+  * from the fit of the last wakes
   */
 bool GetBatteryValues(MyData &myData)
 {
@@ -36,19 +62,77 @@ bool GetBatteryValues(MyData &myData)
       vol = 4350;
    }
   
-   float battery = (float)(vol - 3300) / (float)(4350 - 3300);
-
-   myData.batteryVolt = vol / 1000.0f;
-   Serial.println("batteryVolt: " + String(myData.batteryVolt));
+   myData.batteryMillivolt = vol;
+   myData.batteryVolt      = vol / 1000.0f;
+   LOG_I("batteryVolt: %.2f", myData.batteryVolt);
    
-   if (battery <= 0.01) {
-      battery = 0.01;
-   }
-   if (battery > 1) {
-      battery = 1;
-   }
-   myData.batteryCapacity = (int) (battery * 100);
-   Serial.println("batteryCapacity: " + String(myData.batteryCapacity));
+   myData.batteryCapacity = GetBatteryCapacity(vol);
+   LOG_I("batteryCapacity: %d", myData.batteryCapacity);
    
+   myData.batteryDays = BatteryHistory::GetRemainingDays(myData.state.battery, GetRTCTime());
    return true;
 }
+
+/* Store the battery sample of the wake, called at the end of the wake */
+void StoreBatteryValues(MyData &myData)
+{
+   if (!myData.batteryMillivolt) {
+      GetBatteryValues(myData);
+   }
+   myData.batteryHistory.Add(GetRTCTime(), myData.batteryMillivolt, millis(), myData.radioMillis, myData.state.battery);
+}
+
+/* Name of the policy for the log output */
+const char *GetPolicyName(int policy)
+{
+   switch (policy) {
+      case POLICY_NORMAL:  return "normal";
+      case POLICY_STRETCH: return "stretch";
+      case POLICY_SENSOR:  return "sensor";
+      case POLICY_MINIMAL: return "minimal";
+      default:             return "unknown";
+   }
+}
+
+/* 
+ *  Select the policy of the battery capacity. A better policy than the last one
+ *  needs BATTERY_HYSTERESIS more capacity, on usb power the policy is normal.
+ */
+BatteryPolicy GetBatteryPolicy(MyData &myData)
+{
+   const int thresholds[] = { 101, BATTERY_STRETCH_CAPACITY, BATTERY_SENSOR_CAPACITY, BATTERY_MINIMAL_CAPACITY };
+   int       capacity     = myData.batteryCapacity;
+   int       last         = min((int) myData.state.policy, (int) POLICY_MINIMAL);
+   int       policy       = POLICY_NORMAL;
+
+   for (int i = POLICY_STRETCH; i <= POLICY_MINIMAL; i++) {
+      if (capacity < thresholds[i]) {
+         policy = i;
+      }
+   }
+   if (policy < last && capacity < thresholds[last] + BATTERY_HYSTERESIS) {
+      policy = last;
+   }
+   if (IsUSBPowered()) {
+      policy = POLICY_NORMAL;
+   }
+   LOG_I("Policy: capacity %d %% (stretch < %d %%, sensor < %d %%, minimal < %d %%, usb %s) -> %s",
+      capacity, BATTERY_STRETCH_CAPACITY, BATTERY_SENSOR_CAPACITY, BATTERY_MINIMAL_CAPACITY,
+      IsUSBPowered() ? "yes" : "no", GetPolicyName(policy));
+   if (policy != last) {
+      LOG_W("Policy: changed from %s to %s", GetPolicyName(last), GetPolicyName(policy));
+   }
+   myData.state.policy = policy;
+   return (BatteryPolicy) policy;
+}
+
+/* Interval of the policy for the normal interval in seconds */
+uint32_t GetPolicyInterval(BatteryPolicy policy, uint32_t interval)
+{
+   switch (policy) {
+      case POLICY_STRETCH: return interval * BATTERY_STRETCH_FACTOR;
+      case POLICY_SENSOR:  return max(interval, (uint32_t) BATTERY_SENSOR_INTERVAL);
+      case POLICY_MINIMAL: return BATTERY_MINIMAL_INTERVAL;
+      default:             return interval;
+   }
+}
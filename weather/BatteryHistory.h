@@ -0,0 +1,159 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file BatteryHistory.h
+  *
+  * History of the battery voltage per wake and the remaining runtime.
+  */
+#pragma once
+#include "FlashRing.h"
+
+#define BATTERY_CHARGE_MV     100  // voltage step that marks a charge
+#define BATTERY_MIN_SAMPLES    12  // samples needed for an estimate
+#define BATTERY_MIN_HOURS       6  // time span needed for an estimate
+
+/**
+  * One wake in the battery ring.
+  */
+struct BatterySample
+{
+   uint32_t minute;     //!< local time in minutes
+   uint16_t millivolt;  //!< battery voltage at the start of the wake
+   uint16_t wakeMs;     //!< duration of the wake
+   uint16_t radioMs;    //!< wifi on time of the wake
+   uint16_t capacity;   //!< state of charge in %
+};
+
+/**
+  * Least squares fit of the state of charge over the time since the last
+  * charge, part of the state. The sums are updated with every wake.
+  */
+struct BatteryFit
+{
+   uint32_t start;          //!< local time of the first sample after the charge
+   uint32_t last;           //!< local time of the last sample
+   uint16_t lastMillivolt;  //!< voltage of the last sample
+   uint16_t count;          //!< number of the samples
+   double   sumT;           //!< sum of the hours since start
+   double   sumC;           //!< sum of the capacities
+   double   sumTT;          //!< sum of the squared hours
+   double   sumTC;          //!< sum of hours * capacity
+   uint32_t sumWakeMs;      //!< sum of the wake durations
+   uint32_t sumRadioMs;     //!< sum of the wifi on times
+};
+
+/*
+ *  State of charge of the battery voltage with the discharge curve of a LiPo cell,
+ *  only for the fit of the remaining days. The display shows the linear capacity.
+ */
+int GetChargeState(uint32_t millivolt)
+{
+   static const uint16_t curve[][2] = {
+      { 4200, 100 }, { 4150, 95 }, { 4110, 90 }, { 4080, 85 }, { 4020, 80 }, { 3980, 75 },
+      { 3950,  70 }, { 3910, 65 }, { 3870, 60 }, { 3850, 55 }, { 3840, 50 }, { 3820, 45 },
+      { 3800,  40 }, { 3790, 35 }, { 3770, 30 }, { 3750, 25 }, { 3730, 20 }, { 3710, 15 },
+      { 3690,  10 }, { 3610,  5 }, { 3300,  0 }
+   };
+   const int count = sizeof(curve) / sizeof(curve[0]);
+
+   if (millivolt >= curve[0][0]) {
+      return 100;
+   }
+   for (int i = 1; i < count; i++) {
+      if (millivolt >= curve[i][0]) {
+         return curve[i][1] + (millivolt - curve[i][0]) * (curve[i - 1][1] - curve[i][1]) / (curve[i - 1][0] - curve[i][0]);
+      }
+   }
+   return 0;
+}
+
+/**
+  * Stores one sample per wake in the "battery" partition and fits the
+  * discharge of this device since the last charge.
+  */
+class BatteryHistory
+{
+protected:
+   FlashRing samples;  //!< Ring of the samples
+
+public:
+   BatteryHistory()
+      : samples("battery", sizeof(BatterySample))
+   {
+   }
+
+   /* Store the sample of the wake and add it to the fit, a voltage step up restarts the fit */
+   void Add(time_t time, uint32_t millivolt, uint32_t wakeMs, uint32_t radioMs, BatteryFit &fit)
+   {
+      BatterySample sample;
+
+      sample.minute    = time / SECS_PER_MIN;
+      sample.millivolt = millivolt;
+      sample.wakeMs    = min(wakeMs,  (uint32_t) 0xFFFF);
+      sample.radioMs   = min(radioMs, (uint32_t) 0xFFFF);
+      sample.capacity  = GetChargeState(millivolt);
+      if (!samples.Append(&sample)) {
+         samples.NewSector(NULL);
+         samples.Append(&sample);
+      }
+
+      if (!fit.count || millivolt > fit.lastMillivolt + (uint32_t) BATTERY_CHARGE_MV || time < (time_t) fit.start) {
+         memset(&fit, 0, sizeof(fit));
+         fit.start = time;
+      }
+      double hours = (time - fit.start) / 3600.0;
+
+      fit.last           = time;
+      fit.lastMillivolt  = millivolt;
+      fit.count++;
+      fit.sumT          += hours;
+      fit.sumC          += sample.capacity;
+      fit.sumTT         += hours * hours;
+      fit.sumTC         += hours * sample.capacity;
+      fit.sumWakeMs     += wakeMs;
+      fit.sumRadioMs    += radioMs;
+   }
+
+   /* Fitted discharge in % per day, 0 if there are not enough samples */
+   static float GetDischarge(const BatteryFit &fit)
+   {
+      double n           = fit.count;
+      double denominator = n * fit.sumTT - fit.sumT * fit.sumT;
+      double span        = (fit.last - fit.start) / 3600.0;
+
+      if (fit.count < BATTERY_MIN_SAMPLES || span < BATTERY_MIN_HOURS || denominator <= 0) {
+         return 0;
+      }
+      return -(n * fit.sumTC - fit.sumT * fit.sumC) / denominator * 24;
+   }
+
+   /* Remaining days until the fitted capacity reaches 0 at the time, -1 if unknown */
+   static float GetRemainingDays(const BatteryFit &fit, time_t time)
+   {
+      float discharge = GetDischarge(fit);
+
+      if (discharge <= 0) {
+         return -1;
+      }
+      double hours    = (time - fit.start) / 3600.0;
+      double slope    = -discharge / 24;
+      double offset   = (fit.sumC - slope * fit.sumT) / fit.count;
+      double capacity = offset + slope * hours;
+
+      return capacity > 0 ? capacity / discharge : 0;
+   }
+};
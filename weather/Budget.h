@@ -0,0 +1,258 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Budget.h
+  *
+  * Time budgets of the wake: a deadline per phase, a total budget of the wake
+  * and a watchdog timer that switches the M5Paper off if the wake still runs.
+  */
+#pragma once
+#include <esp_timer.h>
+#include "Log.h"
+
+RTC_DATA_ATTR uint16_t budgetWatchdogStops = 0; // Stops of the watchdog callback, lost by the power off on battery
+
+/* The phases of a wake with a deadline */
+enum BudgetPhase
+{
+   BUDGET_CONNECT = 0,  //!< Wifi association
+   BUDGET_FETCH   = 1,  //!< Http request until the answer header
+   BUDGET_PARSE   = 2,  //!< Body of the answer and the json parser
+   BUDGET_RENDER  = 3,  //!< Drawing of the display and the pre-rendering
+   BUDGET_PUSH    = 4,  //!< Waveform of the e-paper after a push
+   BUDGET_PHASES  = 5
+};
+
+/* Overruns of all the wakes, part of the state */
+struct BudgetStats
+{
+   uint16_t overruns[BUDGET_PHASES];  //!< Aborted phases
+   uint16_t wakeOverruns;             //!< Wakes that used up BUDGET_WAKE_MS
+   uint16_t watchdogStops;            //!< Wakes switched off by the watchdog
+};
+
+/**
+  * Deadline of the running phase, limited by the end of the wake budget.
+  * The phases check Expired() and give up, the caller falls back to the
+  * stored data. The overruns of the wake are added to the state at its end.
+  */
+class WakeBudget
+{
+protected:
+   BudgetPhase        phase;      //!< Running phase
+   uint32_t           deadline;   //!< End of the running phase
+   uint32_t           wakeEnd;    //!< End of the wake budget, 0 = none (always on mode)
+   uint8_t            overruns;   //!< Bit per overrun phase of this wake
+   bool               wakeOver;   //!< The wake budget is used up
+   esp_timer_handle_t watchdog;   //!< Timer of the last resort
+
+public:
+   WakeBudget()
+      : phase(BUDGET_CONNECT)
+      , deadline(0)
+      , wakeEnd(0)
+      , overruns(0)
+      , wakeOver(false)
+      , watchdog(NULL)
+   {
+   }
+
+   /* Name of the phase for the log output */
+   static const char *GetPhaseName(int phase)
+   {
+      switch (phase) {
+         case BUDGET_CONNECT: return "connect";
+         case BUDGET_FETCH:   return "fetch";
+         case BUDGET_PARSE:   return "parse";
+         case BUDGET_RENDER:  return "render";
+         case BUDGET_PUSH:    return "push";
+         default:             return "unknown";
+      }
+   }
+
+   /* Deadline of the phase from the config.h */
+   static uint32_t GetPhaseMs(BudgetPhase phase)
+   {
+      switch (phase) {
+         case BUDGET_CONNECT: return BUDGET_CONNECT_MS;
+         case BUDGET_FETCH:   return BUDGET_FETCH_MS;
+         case BUDGET_PARSE:   return BUDGET_PARSE_MS;
+         case BUDGET_RENDER:  return BUDGET_RENDER_MS;
+         default:             return BUDGET_PUSH_MS;
+      }
+   }
+
+   /* 
+    *  RTC alarm of a wake stopped by the watchdog: the retry after the latest stop,
+    *  one minute more for the seconds the alarm ignores.
+    */
+   static time_t GetWatchdogWake(time_t now)
+   {
+      return now + (BUDGET_WAKE_MS + BUDGET_WATCHDOG_MS) / 1000 + 60 + SCHEDULE_RETRY;
+   }
+
+   /* 
+    *  Add the stops of the last wake to the state. The RTC counter survives the deep sleep 
+    *  on usb power, on battery a wake by the watchdog alarm after the planned wake shows the stop.
+    */
+   static void CountWatchdogStops(BudgetStats &stats, bool missedWake)
+   {
+      uint16_t stops = max(budgetWatchdogStops, (uint16_t) missedWake);
+
+      if (stops) {
+         LOG_W("Budget: the watchdog stopped %u wakes", (unsigned) stops);
+         stats.watchdogStops += stops;
+      }
+      budgetWatchdogStops = 0;
+   }
+
+   /* Start the wake budget and arm the watchdog, it calls the shutdown BUDGET_WATCHDOG_MS after the budget */
+   void Begin(void (*shutdown)(void *))
+   {
+      esp_timer_create_args_t args = {};
+
+      wakeEnd = max((uint32_t) millis() + BUDGET_WAKE_MS, (uint32_t) 1);
+      args.callback = shutdown;
+      args.name     = "budget";
+      if (!watchdog && esp_timer_create(&args, &watchdog) != ESP_OK) {
+         watchdog = NULL;
+      }
+      if (watchdog) {
+         esp_timer_start_once(watchdog, (uint64_t) (BUDGET_WAKE_MS + BUDGET_WATCHDOG_MS) * 1000);
+      }
+   }
+
+   /* The wake ends regularly, or the always on mode starts without a wake budget */
+   void Disarm()
+   {
+      wakeEnd = 0;
+      if (watchdog) {
+         esp_timer_stop(watchdog);
+      }
+   }
+
+   /* Milliseconds left of the wake budget */
+   uint32_t WakeLeft()
+   {
+      int32_t left = wakeEnd - millis();
+
+      if (!wakeEnd) {
+         return UINT32_MAX;
+      }
+      return left > 0 ? left : 0;
+   }
+
+   /* Start the phase, its deadline is cut by the end of the wake budget */
+   void Start(BudgetPhase p)
+   {
+      phase    = p;
+      deadline = millis() + min(GetPhaseMs(p), WakeLeft());
+   }
+
+   /* Milliseconds left of the running phase */
+   uint32_t Remaining()
+   {
+      int32_t left = deadline - millis();
+
+      return left > 0 ? left : 0;
+   }
+
+   /* Is the deadline of the running phase reached? The first check records the overrun. */
+   bool Expired()
+   {
+      if ((int32_t) (millis() - deadline) < 0) {
+         return false;
+      }
+      Overrun(phase);
+      return true;
+   }
+
+   /* Record an overrun of the phase, once per wake */
+   void Overrun(BudgetPhase p)
+   {
+      if (overruns & (1 << p)) {
+         return;
+      }
+      overruns |= 1 << p;
+      wakeOver  = wakeOver || !WakeLeft();
+      LOG_W("Budget: %s aborted at %lu ms of the wake%s", GetPhaseName(p), (unsigned long) millis(),
+         WakeLeft() ? "" : ", wake budget used up");
+   }
+
+   /* Add the overruns of the wake to the statistics of the state */
+   void Store(BudgetStats &stats)
+   {
+      for (int p = 0; p < BUDGET_PHASES; p++) {
+         if (overruns & (1 << p)) {
+            stats.overruns[p]++;
+         }
+      }
+      if (wakeOver) {
+         stats.wakeOverruns++;
+      }
+      overruns = 0;
+      wakeOver = false;
+   }
+
+   /* Print the overruns of all the wakes */
+   static void Print(const BudgetStats &stats)
+   {
+      LOG_I("Budget: overruns connect %u, fetch %u, parse %u, render %u, push %u, wake %u, watchdog %u",
+         stats.overruns[BUDGET_CONNECT], stats.overruns[BUDGET_FETCH], stats.overruns[BUDGET_PARSE],
+         stats.overruns[BUDGET_RENDER], stats.overruns[BUDGET_PUSH], stats.wakeOverruns, stats.watchdogStops);
+   }
+};
+
+WakeBudget myBudget; // Deadlines of the running wake
+
+/**
+  * Stream that ends at the deadline of the running phase, so a slow or
+  * stalled body cannot keep the parser waiting beyond the budget.
+  */
+class DeadlineStream : public Stream
+{
+protected:
+   Stream &stream;  //!< The body of the answer
+
+public:
+   DeadlineStream(Stream &s)
+      : stream(s)
+   {
+   }
+
+   /* A blocking read of the body ends at the deadline */
+   int read() override
+   {
+      if (myBudget.Expired()) {
+         return -1;
+      }
+      stream.setTimeout(myBudget.Remaining());
+      return stream.read();
+   }
+
+   /* The timed read of the parser ends at the deadline */
+   size_t readBytes(char *buffer, size_t length)
+   {
+      setTimeout(myBudget.Remaining());
+      return Stream::readBytes(buffer, length);
+   }
+
+   int    available() override    { return myBudget.Expired() ? 0 : stream.available(); }
+   int    peek() override         { return myBudget.Expired() ? -1 : stream.peek(); }
+   void   flush() override        {}
+   size_t write(uint8_t) override { return 0; }
+};
@@ -29,8 +29,88 @@
 #define LONGITUDE         8.63493
 
 #define OPENWEATHER_SRV  "api.openweathermap.org"
-#define OPENWEATHER_PORT 80
+#define OPENWEATHER_TLS  0   // 1 = https, the tls session of the last fetch is resumed (saves the full handshake)
+#define OPENWEATHER_PORT (OPENWEATHER_TLS ? 443 : 80)
+#define OPENWEATHER_CA   ""  // PEM of the root CA of the server, required for https
+#define OPENWEATHER_TLS_INSECURE 0 // 1 = https without a CA, the certificate is not verified (only for a test server)
 #define OPENWEATHER_API  "your openweathermap api key"
 
+// fetch the weather only every n hours, the wakes between render the stored forecast
+#define WEATHER_FETCH_HOURS 3
+
+// default periods of the refresh tasks in seconds (0 = off), changeable at runtime 
+// with the serial command "sched <task> <seconds>" (e.g. the former REFRESH_PARTLY: sensor 600, clock 600)
+#define SCHEDULE_SENSOR     0                              // SHT30 values of the M5Paper information
+#define SCHEDULE_CLOCK      0                              // update time of the M5Paper information
+#define SCHEDULE_WEATHER    (WEATHER_FETCH_HOURS * 60 * 60) // fetch of the weather
+#define SCHEDULE_RENDER     (60 * 60)                      // full refresh from the stored forecast
+#define SCHEDULE_GHOST      (6 * 60 * 60)                  // clear of the e-paper before the full refresh
+#define SCHEDULE_RETRY      (15 * 60)                      // retry of a failed fetch
+#define SCHEDULE_CONSOLE_MS 2000                           // wait for serial commands on usb power
+
+// quiet time without refreshes: 0 = off, 1 = between QUIET_START and QUIET_END, 2 = between sunset and sunrise
+#define QUIET_MODE          0
+#define QUIET_START         23                             // hour of the start of the quiet hours
+#define QUIET_END           6                              // hour of the end of the quiet hours
+#define QUIET_CATCHUP       (20 * 60)                      // fetch and refresh this many seconds before the end
+
+// pre-render the hours until the next fetch, these wakes only push the stored frame (0 = off)
+#define PRERENDER_FRAMES    (WEATHER_FETCH_HOURS - 1)
+
+// refresh only the M5Paper information if the visible weather data is unchanged (0 = skip completely),
+// the stored forecast moves the hourly strip in its column steps (HOURLY_STEP in weather.h)
+#define UNCHANGED_TIME_UPDATE 1
+
+// hours of the indoor history page, shown after a wake by the button
+#define HISTORY_HOURS       (7 * 24)
+
+// on usb power the M5Paper stays on: clock every minute, SHT30 values on a change, the tasks on schedule (0 = deep sleep)
+#define ALWAYS_ON_USB       1
+#define ALWAYS_ON_SENSOR    30                             // seconds between the SHT30 readings
+#define ALWAYS_ON_STATS     (10 * 60)                      // seconds between the latency and cpu statistics
+
+// target of a button wake from the start to the first display update
+#define FIRST_PIXEL_TARGET_MS 1000
+
+// the touch screen flips the pages: swipe or tap on the right half for the next page, on the left half for the previous one
+#define PAGE_TOUCH_SECS     10                             // seconds the pages stay touchable after a button wake on battery (0 = off)
+#define PAGE_TOUCH_SWIPE    100                            // min. pixels of a swipe, shorter moves are taps
+
+// battery policy: below these capacities (%) the wakes save energy, on usb power the full cadence is used
+#define BATTERY_STRETCH_CAPACITY 30                 // wake interval multiplied by BATTERY_STRETCH_FACTOR
+#define BATTERY_STRETCH_FACTOR    2
+#define BATTERY_SENSOR_CAPACITY  15                 // no weather anymore, only the M5Paper information
+#define BATTERY_SENSOR_INTERVAL  (3 * 60 * 60)
+#define BATTERY_MINIMAL_CAPACITY  5                 // low battery screen, then only rare checks for a charge
+#define BATTERY_MINIMAL_INTERVAL (24 * 60 * 60)
+#define BATTERY_HYSTERESIS        5                 // capacity above the threshold to return to a better policy
+
+// telemetry: one binary record per wake, uploaded in batches with the next weather fetch (sim/telemetry_collector.py)
+#define TELEMETRY_SRV       ""                             // host of the collector, "" = off
+#define TELEMETRY_PORT      8081
+#define TELEMETRY_BATCH     64                             // max. records of one upload
+#define TELEMETRY_TIMEOUT_MS 1500                          // connect and answer timeout, keeps the radio time short
+
+// quota of the openweathermap calls: a token bucket spreads the calls left of the UTC day over its remaining hours
+// and raises the fetch interval when they run low (the 3.0 API is free up to 1000 calls per day)
+#define QUOTA_DAILY         1000                           // calls per UTC day, keep it at the limit of the account
+#define QUOTA_BURST         4                              // max. saved calls, e.g. for the retries after a failed fetch
+
+// time budgets of a wake in ms: an overrun phase is aborted and the stored forecast is shown,
+// the watchdog switches the M5Paper off if the wake still runs BUDGET_WATCHDOG_MS after BUDGET_WAKE_MS
+#define BUDGET_CONNECT_MS   15000                          // wifi association
+#define BUDGET_FETCH_MS     8000                           // http request until the answer header
+#define BUDGET_PARSE_MS     10000                          // body of the answer with the json parser
+#define BUDGET_RENDER_MS    20000                          // drawing of the pages and the pre-rendered frames
+#define BUDGET_PUSH_MS      3000                           // waveform of the e-paper after a push
+#define BUDGET_WAKE_MS      60000                          // total of a wake, cuts the phase deadlines
+#define BUDGET_WATCHDOG_MS  10000                          // grace after BUDGET_WAKE_MS for the regular end
+
+// log: the records above LOG_LEVEL are removed at compile time (LOG_NONE .. LOG_DEBUG), the others wait in a RAM
+// ring and are printed at the end of the wake, on battery without a host only up to LOG_BATTERY_LEVEL
+#define LOG_LEVEL           LOG_INFO
+#define LOG_BATTERY_LEVEL   LOG_WARN
+#define LOG_BUFFER_SIZE     8192                           // bytes of the ring, the oldest records are dropped
+
 #define WIFI_SSID        "your wifi ssid"
 #define WIFI_PW          "your wifi password"
@@ -21,8 +21,64 @@
   */
 #pragma once
 
+#include "Budget.h"
+#include "Heap.h"
 #include "Weather.h"
-#include <nvs.h>
+#include "BatteryHistory.h"
+#include "SensorHistory.h"
+#include "StateJournal.h"
+#include "Telemetry.h"
+
+#define STATE_VERSION  2
+
+/* The tasks of the scheduler (Schedule.h), the state keeps their last runs */
+enum ScheduleTask
+{
+   TASK_SENSOR  = 0,  //!< SHT30 values of the M5Paper information
+   TASK_CLOCK   = 1,  //!< Update time of the M5Paper information
+   TASK_WEATHER = 2,  //!< Fetch of the weather
+   TASK_RENDER  = 3,  //!< Full refresh of the display from the stored forecast
+   TASK_GHOST   = 4,  //!< Clear of the e-paper before the full refresh against ghosting
+   TASK_COUNT   = 5
+};
+
+/**
+  * The state that must survive the power off between the wakes.
+  * It is saved as one journal entry per wake. New members must be appended,
+  * other changes need a new STATE_VERSION, which drops the old state.
+  */
+struct StateData
+{
+   uint32_t displayHash;     //!< Hash of the visible data of the last refresh
+   uint32_t displayWakes;    //!< Number of wakes that could refresh the display
+   uint32_t displaySkips;    //!< Number of skipped refreshes with unchanged data
+   uint32_t shownTime;       //!< RTC time of the M5Paper information on the display
+   int32_t  shownTemperatur; //!< SHT30 temperature on the display
+   int32_t  shownHumidity;   //!< SHT30 humidity on the display
+   
+   SensorAggregate sensor;   //!< SHT30 values of the running hour
+   BatteryFit      battery;  //!< Discharge since the last charge
+   uint8_t         policy;   //!< Battery policy of the last wake
+   uint32_t        lastRun[TASK_COUNT]; //!< RTC time of the last run of the schedule tasks
+   uint32_t        providerTime;    //!< Data time of the last fetch
+   uint32_t        providerCadence; //!< Update cadence of the provider, 0 = unknown, 1 = live data
+   uint32_t        staleFetches;    //!< Number of fetches without new data
+   uint32_t        quietWake;       //!< Planned catch-up wake at the end of the quiet time
+   uint32_t        quietSkips;      //!< Number of wakes skipped in the quiet times
+   uint32_t        quietSavedMs;    //!< Estimated awake time saved by the skipped wakes
+   uint32_t        buttonWakes;     //!< Number of wakes by the button
+   uint32_t        buttonMissed;    //!< Number of button wakes slower than FIRST_PIXEL_TARGET_MS
+   uint16_t        firstPixelMs;    //!< Time to the first pixel of the last button wake
+   uint16_t        maxFirstPixelMs; //!< Slowest time to the first pixel of a button wake
+   uint8_t         page;            //!< The page on the display, see DisplayPage
+   HeapWorst       heap;            //!< Worst heap of all the wakes
+   uint32_t        telemetrySent;   //!< Time of the last uploaded telemetry record
+   BudgetStats     budget;          //!< Overruns of the time budgets
+   QuotaState      quota;           //!< Calls of the provider
+   uint32_t        plannedWake;     //!< Alarm time of the last saved wake
+};
+
+static_assert(sizeof(StateData) <= STATE_ENTRY_SIZE - sizeof(StateEntryHeader), "StateData too big for a journal entry");
 
 
 /**
@@ -31,68 +87,109 @@
 class MyData
 {
 public:
-   uint16_t nvsCounter;      //!< Non volatile counter
+   StateData      state;            //!< State of the last wake
+   StateJournal   journal;          //!< Flash journal of the state
+   SensorHistory  history;          //!< History of the SHT30 values
+   BatteryHistory batteryHistory;   //!< History of the battery per wake
+   Telemetry      telemetry;        //!< Records of the wakes for the collector
 
-   int     wifiRSSI;         //!< The wifi signal strength
-   float   batteryVolt;      //!< The current battery voltage
-   int     batteryCapacity;  //!< The current battery capacity
-   int     sht30Temperatur;  //!< SHT30 temperature
-   int     sht30Humidity;    //!< SHT30 humidity
+   int      wifiRSSI;               //!< The wifi signal strength
+   uint32_t radioMillis;            //!< Wifi on time of the wake
+   uint32_t fetchMillis;            //!< Request until the parsed forecast, 0 = no fetch
+   uint32_t renderMillis;           //!< Drawing of the pushed canvases of the wake
+   uint8_t  telemetryFlags;         //!< TELEMETRY_FETCHED, ... of the wake
+   float    batteryVolt;            //!< The current battery voltage
+   uint32_t batteryMillivolt;       //!< The current battery voltage in mV, 0 = not read
+   int      batteryCapacity;        //!< The current battery capacity
+   float    batteryDays;            //!< Estimated remaining days, -1 = unknown
+   int      sht30Temperatur;        //!< SHT30 temperature
+   int      sht30Humidity;          //!< SHT30 humidity
+   uint32_t firstPixelMillis;       //!< Start of the first display update of the wake, 0 = none
 
-   time_t  moonRise;         //!< Calculated moon rise
-   time_t  moonSet;          //!< Calculated moon set
+   time_t   moonRise;               //!< Calculated moon rise
+   time_t   moonSet;                //!< Calculated moon set
    
-   Weather weather;          //!< All the openweathermap data
+   Weather  weather;                //!< All the openweathermap data
 
 public:
    MyData()
-      : wifiRSSI(0)
+      : journal("state")
+      , wifiRSSI(0)
+      , radioMillis(0)
+      , fetchMillis(0)
+      , renderMillis(0)
+      , telemetryFlags(0)
       , batteryVolt(0.0)
+      , batteryMillivolt(0)
       , batteryCapacity(0)
+      , batteryDays(-1)
       , sht30Temperatur(0)
       , sht30Humidity(0)
+      , firstPixelMillis(0)
       , moonRise(0)
       , moonSet(0)
    {
+      memset(&state, 0, sizeof(state));
    }
 
    /* helper function to dump all the collected data */
    void Dump()
    {
-      Serial.println("DateTime: "        + getRTCDateTimeString());
+      uint16_t wakes = state.battery.count;
+
+      LOG_I("DateTime: %s",        getRTCDateTimeString().c_str());
+      
+      LOG_I("Latitude: %.5f",      (double) LATITUDE);
+      LOG_I("Longitude: %.5f",     (double) LONGITUDE);
+      LOG_I("WifiRSSI: %d",        wifiRSSI);
+      LOG_I("BatteryVolt: %.2f",   batteryVolt);
+      LOG_I("BatteryCapacity: %d", batteryCapacity);
+      LOG_I("BatteryDays: %.1f (%.2f %%/day, %u wakes, avg %lu ms awake, %lu ms wifi)", batteryDays,
+         BatteryHistory::GetDischarge(state.battery), (unsigned) wakes,
+         (unsigned long) (wakes ? state.battery.sumWakeMs / wakes : 0), (unsigned long) (wakes ? state.battery.sumRadioMs / wakes : 0));
+      LOG_I("Sht30Temperatur: %d", sht30Temperatur);
+      LOG_I("Sht30Humidity: %d",   sht30Humidity);
+      LOG_I("MoonRise: %s",        getDateTimeString(moonRise).c_str());
+      LOG_I("MoonSet: %s",         getDateTimeString(moonSet).c_str());
       
-      Serial.println("Latitude: "        + String(LATITUDE));
-      Serial.println("Longitude: "       + String(LONGITUDE));
-      Serial.println("WifiRSSI: "        + String(wifiRSSI));
-      Serial.println("BatteryVolt: "     + String(batteryVolt));
-      Serial.println("BatteryCapacity: " + String(batteryCapacity));
-      Serial.println("Sht30Temperatur: " + String(sht30Temperatur));
-      Serial.println("Sht30Humidity: "   + String(sht30Humidity));
-      Serial.println("MoonRise: "        + getDateTimeString(moonRise));
-      Serial.println("MoonSet: "         + getDateTimeString(moonSet));
+      LOG_I("Sunrise: %s",         getDateTimeString(weather.sunrise).c_str());
+      LOG_I("Sunset: %s",          getDateTimeString(weather.sunset).c_str());
+      LOG_I("Winddir: %.2f",       weather.winddir);
+      LOG_I("Windspeed: %.2f",     weather.windspeed);
       
-      Serial.println("Sunrise: "         + getDateTimeString(weather.sunrise));
-      Serial.println("Sunset: "          + getDateTimeString(weather.sunset));
-      Serial.println("Winddir: "         + String(weather.winddir));
-      Serial.println("Windspeed: "       + String(weather.windspeed));
+      LOG_I("Provider: %lu s cadence, %lu fetches without new data", 
+         (unsigned long) state.providerCadence, (unsigned long) state.staleFetches);
+      LOG_I("Quiet: %lu wakes skipped, %lu s awake saved", 
+         (unsigned long) state.quietSkips, (unsigned long) (state.quietSavedMs / 1000));
+      LOG_I("FirstPixel: %u ms, max %u ms, %lu of %lu button wakes slower than %d ms", (unsigned) state.firstPixelMs, 
+         (unsigned) state.maxFirstPixelMs, (unsigned long) state.buttonMissed, (unsigned long) state.buttonWakes, FIRST_PIXEL_TARGET_MS);
+      LOG_I("DisplaySkips: %lu of %lu (%lu%%)", (unsigned long) state.displaySkips, (unsigned long) state.displayWakes,
+         (unsigned long) (state.displayWakes ? state.displaySkips * 100 / state.displayWakes : 0));
+      myHeap.Print(state.heap);
+      WakeBudget::Print(state.budget);
+      ApiQuota::Print(state.quota);
    }
 
-   /* Load the NVS data from the non volatile memory */
-   void LoadNVS()
+   /* Load the state of the last wake from the journal */
+   void LoadState()
    {
-      nvs_handle nvs_arg;
-      nvs_open("Setting", NVS_READONLY, &nvs_arg);
-      nvs_get_u16(nvs_arg, "nvsCounter", &nvsCounter);
-      nvs_close(nvs_arg);
+      uint16_t version = 0;
+      
+      if (!journal.Load(&state, sizeof(state), version)) {
+         memset(&state, 0, sizeof(state));
+      } else if (version != STATE_VERSION) {
+         LOG_W("State: version %u discarded, now %u", version, STATE_VERSION);
+         memset(&state, 0, sizeof(state));
+      }
    }
    
-   /* Store the NVS data to the non volatile memory */
-   void SaveNVS()
+   /* Append the state to the journal, once at the end of the wake */
+   void SaveState()
    {
-      nvs_handle nvs_arg;
-      nvs_open("Setting", NVS_READWRITE, &nvs_arg);
-      nvs_set_u16(nvs_arg, "nvsCounter", nvsCounter);
-      nvs_commit(nvs_arg);
-      nvs_close(nvs_arg);
+      myHeap.Store(state.heap);
+      myBudget.Store(state.budget);
+      if (!journal.Save(&state, sizeof(state), STATE_VERSION)) {
+         LOG_E("State: save failed");
+      }
    }
 };
@@ -21,18 +21,43 @@
   */
 #pragma once
 #include "Data.h"
+#include "EPD.h"
+#include "FrameStore.h"
 #include "Icons.h"
 
 
 M5EPD_Canvas canvas(&M5.EPD); // Main canvas of the e-paper
 
+/* Parts of the M5Paper information */
+enum M5PaperParts
+{
+   M5PAPER_STATIC = 1,  //!< Title, frame and icons
+   M5PAPER_DATE   = 2,  //!< RTC date
+   M5PAPER_TIME   = 4,  //!< RTC time of the update
+   M5PAPER_VALUES = 8,  //!< SHT30 temperature and humidity
+   M5PAPER_ALL    = 15
+};
+
+/* The pages of the display, the weather page is the main page */
+enum DisplayPage
+{
+   PAGE_WEATHER = 0,  //!< Main page with the current weather
+   PAGE_HOURLY  = 1,  //!< Forecast of the next 48 hours
+   PAGE_DAILY   = 2,  //!< Details of the 8 days forecast
+   PAGE_HISTORY = 3,  //!< Indoor history of the SHT30
+   PAGE_COUNT   = 4
+};
+
 /* Main class for drawing the content to the e-paper display. */
 class WeatherDisplay
 {
 protected:
-   MyData &myData; //!< Reference to the global data
-   int     maxX;   //!< Max width of the e-paper
-   int     maxY;   //!< Max height of the e-paper
+   MyData    &myData; //!< Reference to the global data
+   int        maxX;   //!< Max width of the e-paper
+   int        maxY;   //!< Max height of the e-paper
+   FrameStore frames; //!< Pre-rendered frames of the next hours
+   FrameStore pages;  //!< Pre-rendered pages, the slot of a page is its number
+   uint32_t   renderStart; //!< Start of the drawing of the canvas, 0 = pushed
 
 protected:
    void DrawCircle(int32_t x, int32_t y, int32_t r, uint32_t color, int32_t degFrom = 0, int32_t degTo = 360);
@@ -49,23 +74,52 @@ protected:
    void DrawSunInfo(int x, int y, int dx, int dy);
    void DrawMoonInfo(int x, int y, int dx, int dy);
    void DrawWindInfo(int x, int y, int dx, int dy);
-   void DrawM5PaperInfo(int x, int y, int dx, int dy);
+   void DrawM5PaperInfo(int x, int y, int dx, int dy, int parts = M5PAPER_ALL);
+   void PushM5PaperPart(int part, int top, int height, m5epd_update_mode_t mode = UPDATE_MODE_DU);
+   void SetM5PaperShown(int parts = M5PAPER_ALL);
 
+   void DrawWeatherIcon(int x, int y, const char *icon);
    void DrawHourly(int x, int y, int dx, int dy, Weather &weather, int index);
    
-   void DrawGraph(int x, int y, int dx, int dy, String title, int xMin, int xMax, int yMin, int yMax, float values[]);
+   static int GetGraphY(int y, int dy, int yMin, int yMax, float value);
+   void DrawGraph(int x, int y, int dx, int dy, const char *title, int xMin, int xMax, int yMin, int yMax, float values[]);
+   void DrawSensorGraph(int x, int y, int dx, int dy, const char *title, SensorHour hours[], int count, time_t time, bool humidity);
+   void DrawTimeGraph(int x, int y, int dx, int dy, const char *title, const float values[], int count, time_t first, int step, const float lower[] = NULL);
+
+   void PushCanvas(int x, int y, m5epd_update_mode_t mode);
+
+   void CreateCanvas(int dx = 960, int dy = 540);
+   void DrawWeather();
+
+   uint32_t GetPageSource(int page);
+   void DrawHourlyPage();
+   void DrawDailyPage();
+   void DrawHistoryPage();
+   bool RenderPage(int page);
 
 public:
    WeatherDisplay(MyData &md, int x = 960, int y = 540)
       : myData(md)
       , maxX(x)
       , maxY(y)
+      , frames("frames")
+      , pages("pages")
+      , renderStart(0)
    {
    }
 
-   void Show();
+   uint32_t GetHash();
+   
+   void Show(bool clear = true);
+
+   bool RenderFrame(time_t time);
+   bool ShowFrame(time_t time, bool clear = true);
 
-   void ShowM5PaperInfo();
+   void ShowM5PaperInfo(int parts = M5PAPER_ALL, m5epd_update_mode_t mode = UPDATE_MODE_DU);
+   
+   void RenderPages();
+   void ShowPage(int page);
+   void ShowLowBattery();
 };
 
 /* Draw a circle with optional start and end point */
@@ -105,14 +159,19 @@ void WeatherDisplay::DrawBattery(int x, int y)
    }
 }
 
-/* Draw a the head with version, city, rssi and battery */
+/* Draw a the head with version, city, rssi (only if connected), battery and the remaining days (if known) */
 void WeatherDisplay::DrawHead()
 {
    canvas.drawString(VERSION, 20, 10);
    canvas.drawCentreString(CITY_NAME, maxX / 2, 10, 1);
-   canvas.drawString(WifiGetRssiAsQuality(myData.wifiRSSI) + "%", maxX - 200, 10);
-   DrawRSSI(maxX - 155, 25);
-   canvas.drawString(String(myData.batteryCapacity) + "%", maxX - 110, 10);
+   if (myData.wifiRSSI != 0) {
+      canvas.drawString(WifiGetRssiAsQuality(myData.wifiRSSI).Append('%'), maxX - 200, 10);
+      DrawRSSI(maxX - 155, 25);
+   }
+   if (myData.batteryDays >= 0) {
+      canvas.drawString(SmallString().AppendNumber((int) (myData.batteryDays + 0.5)).Append('d'), maxX - 280, 10);
+   }
+   canvas.drawString(SmallString().AppendNumber(myData.batteryCapacity).Append('%'), maxX - 110, 10);
    DrawBattery(maxX - 65, 10);
 }
 
@@ -188,13 +247,12 @@ void WeatherDisplay::DrawMoon(int x, int y, int dd, int mm, int yy)
    canvas.drawCircle(x + diameter - 1, y + diameter, diameter / 2, M5EPD_Canvas::G15);
 }
 
-/* Draw the moon information with moonrise, moonset and moon phase */
+/* Draw the moon information with moonrise, moonset and moon phase of the weather time */
 void WeatherDisplay::DrawMoonInfo(int x, int y, int dx, int dy)
 {
-   rtc_date_t date_struct;
-   
-   M5.RTC.getDate(&date_struct);
+   tmElements_t tm;
    
+   breakTime(myData.weather.currentTime, tm);
    canvas.setTextSize(3);
    canvas.drawCentreString("Moon", x + dx / 2, y + 7, 1);
    canvas.drawLine(x, y + 35, x + dx, y + 35, M5EPD_Canvas::G15);
@@ -206,7 +264,7 @@ void WeatherDisplay::DrawMoonInfo(int x, int y, int dx, int dy)
    DrawIcon(x + 30, y + 105, (uint16_t *) MOONSET64x64);
    canvas.drawString(getHourMinString(myData.moonSet), x + 110, y + 130, 1);
 
-   DrawMoon(x + dx / 2 - 45, y + 160, date_struct.day, date_struct.mon, date_struct.year);
+   DrawMoon(x + dx / 2 - 45, y + 160, tm.Day, tm.Month, tm.Year + 1970);
 }
 
 /* Draw the in the wind section
@@ -267,7 +325,7 @@ void WeatherDisplay::DisplayDisplayWindSection(int x, int y, float angle, float
    canvas.drawCentreString("S", x, y + cradius + 5, 1);
    canvas.drawCentreString("W", x - cradius - 15, y - 3, 1);
    canvas.drawCentreString("E", x + cradius + 15,  y - 3, 1);
-   canvas.drawCentreString(String(windspeed, 1), x, y - 20, 1);
+   canvas.drawCentreString(SmallString().AppendFloat(windspeed, 1), x, y - 20, 1);
    canvas.drawCentreString("m/s", x, y, 1);
 
    Arrow(x, y, cradius - 17, angle, 15, 27);
@@ -283,80 +341,97 @@ void WeatherDisplay::DrawWindInfo(int x, int y, int dx, int dy)
    DisplayDisplayWindSection(x + dx / 2, y + dy / 2 + 20, myData.weather.winddir, myData.weather.windspeed, 75);
 }
 
-/* Draw the M5Paper environment and RTC information */
-void WeatherDisplay::DrawM5PaperInfo(int x, int y, int dx, int dy)
+/* Draw the M5Paper environment and RTC information or only some parts of it */
+void WeatherDisplay::DrawM5PaperInfo(int x, int y, int dx, int dy, int parts /* = M5PAPER_ALL */)
 {
-   canvas.setTextSize(3);
-   canvas.drawCentreString("M5Paper", x + dx / 2, y + 7, 1);
-   canvas.drawLine(x, y + 35, x + dx, y + 35, M5EPD_Canvas::G15);
+   if (parts & M5PAPER_STATIC) {
+      canvas.setTextSize(3);
+      canvas.drawCentreString("M5Paper", x + dx / 2, y + 7, 1);
+      canvas.drawLine(x, y + 35, x + dx, y + 35, M5EPD_Canvas::G15);
+      canvas.setTextSize(2);
+      canvas.drawCentreString("updated", x + dx / 2, y + 120, 1);
+      DrawIcon(x + 35, y + 140, (uint16_t *) TEMPERATURE64x64);
+      DrawIcon(x + 145, y + 140, (uint16_t *) HUMIDITY64x64);
+   }
 
    canvas.setTextSize(3);
-   canvas.drawCentreString(getRTCDateString(), x + dx / 2, y + 55, 1);
-   canvas.drawCentreString(getRTCTimeString(), x + dx / 2, y + 95, 1);
-   canvas.setTextSize(2);
-   canvas.drawCentreString("updated", x + dx / 2, y + 120, 1);
+   if (parts & M5PAPER_DATE) {
+      canvas.drawCentreString(getRTCDateString(), x + dx / 2, y + 55, 1);
+   }
+   if (parts & M5PAPER_TIME) {
+      canvas.drawCentreString(getRTCTimeString(), x + dx / 2, y + 95, 1);
+   }
+   if (parts & M5PAPER_VALUES) {
+      canvas.drawString(SmallString().AppendNumber(myData.sht30Temperatur).Append(" C"), x + 35, y + 210, 1);
+      canvas.drawString(SmallString().AppendNumber(myData.sht30Humidity).Append('%'), x + 150, y + 210, 1);
+   }
+}
 
-   canvas.setTextSize(3);
-   DrawIcon(x + 35, y + 140, (uint16_t *) TEMPERATURE64x64);
-   canvas.drawString(String(myData.sht30Temperatur) + " C", x + 35, y + 210, 1);
-   DrawIcon(x + 145, y + 140, (uint16_t *) HUMIDITY64x64);
-   canvas.drawString(String(myData.sht30Humidity) + "%", x + 150, y + 210, 1);
-   
+/* Draw the 64x64 icon of the openweathermap icon name */
+void WeatherDisplay::DrawWeatherIcon(int x, int y, const char *icon)
+{
+        if (!strcmp(icon, "01d")) DrawIcon(x, y, (uint16_t *) image_data_01d, 64, 64, true);
+   else if (!strcmp(icon, "01n")) DrawIcon(x, y, (uint16_t *) image_data_03n, 64, 64, true);
+   else if (!strcmp(icon, "02d")) DrawIcon(x, y, (uint16_t *) image_data_02d, 64, 64, true);
+   else if (!strcmp(icon, "02n")) DrawIcon(x, y, (uint16_t *) image_data_02n, 64, 64, true);
+   else if (!strcmp(icon, "03d")) DrawIcon(x, y, (uint16_t *) image_data_03d, 64, 64, true);
+   else if (!strcmp(icon, "03n")) DrawIcon(x, y, (uint16_t *) image_data_03n, 64, 64, true);
+   else if (!strcmp(icon, "04d")) DrawIcon(x, y, (uint16_t *) image_data_04d, 64, 64, true);
+   else if (!strcmp(icon, "04n")) DrawIcon(x, y, (uint16_t *) image_data_03n, 64, 64, true);
+   else if (!strcmp(icon, "09d")) DrawIcon(x, y, (uint16_t *) image_data_09d, 64, 64, true);
+   else if (!strcmp(icon, "09n")) DrawIcon(x, y, (uint16_t *) image_data_09n, 64, 64, true);
+   else if (!strcmp(icon, "10d")) DrawIcon(x, y, (uint16_t *) image_data_10d, 64, 64, true);
+   else if (!strcmp(icon, "10n")) DrawIcon(x, y, (uint16_t *) image_data_03n, 64, 64, true);
+   else if (!strcmp(icon, "11d")) DrawIcon(x, y, (uint16_t *) image_data_11d, 64, 64, true);
+   else if (!strcmp(icon, "11n")) DrawIcon(x, y, (uint16_t *) image_data_11n, 64, 64, true);
+   else if (!strcmp(icon, "13d")) DrawIcon(x, y, (uint16_t *) image_data_13d, 64, 64, true);
+   else if (!strcmp(icon, "13n")) DrawIcon(x, y, (uint16_t *) image_data_13n, 64, 64, true);
+   else if (!strcmp(icon, "50d")) DrawIcon(x, y, (uint16_t *) image_data_50d, 64, 64, true);
+   else if (!strcmp(icon, "50n")) DrawIcon(x, y, (uint16_t *) image_data_50n, 64, 64, true);
+   else DrawIcon(x, y, (uint16_t *) image_data_unknown, 64, 64, true);
 }
 
 /* Draw one hourly weather information */
 void WeatherDisplay::DrawHourly(int x, int y, int dx, int dy, Weather &weather, int index)
 {
-   time_t time = weather.hourlyTime[index];
-   int    temp = weather.hourlyMaxTemp[index];
-   String main = weather.hourlyMain[index];
-   String icon = weather.hourlyIcon[index];
+   time_t        time = weather.hourlyTime[index];
+   int           temp = weather.hourlyMaxTemp[index];
+   const String &main = weather.hourlyMain[index];
+   const String &icon = weather.hourlyIcon[index];
    
    canvas.setTextSize(2);
-   canvas.drawCentreString(getHourString(time) + ":00", x + dx / 2, y + 10, 1);
-   canvas.drawCentreString(String(temp) + " C",         x + dx / 2, y + 30, 1);
-   // canvas.drawCentreString(main,                        x + dx / 2, y + 70, 1);
+   canvas.drawCentreString(getHourString(time).Append(":00"),             x + dx / 2, y + 10, 1);
+   canvas.drawCentreString(SmallString().AppendNumber(temp).Append(" C"), x + dx / 2, y + 30, 1);
+   // canvas.drawCentreString(main,                                       x + dx / 2, y + 70, 1);
 
-   int iconX = x + dx / 2 - 32;
-   int iconY = y + 50;
-   
-   // DrawIcon(x + dx / 2 - 32, y + 50, (uint16_t *) image_data_03d, 64, 64, true);
-   
-        if (icon == "01d") DrawIcon(iconX, iconY, (uint16_t *) image_data_01d, 64, 64, true);
-   else if (icon == "01n") DrawIcon(iconX, iconY, (uint16_t *) image_data_03n, 64, 64, true);
-   else if (icon == "02d") DrawIcon(iconX, iconY, (uint16_t *) image_data_02d, 64, 64, true);
-   else if (icon == "02n") DrawIcon(iconX, iconY, (uint16_t *) image_data_02n, 64, 64, true);
-   else if (icon == "03d") DrawIcon(iconX, iconY, (uint16_t *) image_data_03d, 64, 64, true);
-   else if (icon == "03n") DrawIcon(iconX, iconY, (uint16_t *) image_data_03n, 64, 64, true);
-   else if (icon == "04d") DrawIcon(iconX, iconY, (uint16_t *) image_data_04d, 64, 64, true);
-   else if (icon == "04n") DrawIcon(iconX, iconY, (uint16_t *) image_data_03n, 64, 64, true);
-   else if (icon == "09d") DrawIcon(iconX, iconY, (uint16_t *) image_data_09d, 64, 64, true);
-   else if (icon == "09n") DrawIcon(iconX, iconY, (uint16_t *) image_data_09n, 64, 64, true);
-   else if (icon == "10d") DrawIcon(iconX, iconY, (uint16_t *) image_data_10d, 64, 64, true);
-   else if (icon == "10n") DrawIcon(iconX, iconY, (uint16_t *) image_data_03n, 64, 64, true);
-   else if (icon == "11d") DrawIcon(iconX, iconY, (uint16_t *) image_data_11d, 64, 64, true);
-   else if (icon == "11n") DrawIcon(iconX, iconY, (uint16_t *) image_data_11n, 64, 64, true);
-   else if (icon == "13d") DrawIcon(iconX, iconY, (uint16_t *) image_data_13d, 64, 64, true);
-   else if (icon == "13n") DrawIcon(iconX, iconY, (uint16_t *) image_data_13n, 64, 64, true);
-   else if (icon == "50d") DrawIcon(iconX, iconY, (uint16_t *) image_data_50d, 64, 64, true);
-   else if (icon == "50n") DrawIcon(iconX, iconY, (uint16_t *) image_data_50n, 64, 64, true);
-   else DrawIcon(iconX, iconY, (uint16_t *) image_data_unknown, 64, 64, true);
+   DrawWeatherIcon(x + dx / 2 - 32, y + 50, icon.c_str());
+}
+
+/* Plotted y position of the value in the graph of DrawGraph() */
+int WeatherDisplay::GetGraphY(int y, int dy, int yMin, int yMax, float value)
+{
+   int   graphY   = y + 35;
+   int   graphDY  = dy - 35 - 20;
+   float yValueDY = (float) graphDY / (yMax - yMin);
+   int   yPos     = graphY + graphDY - (value - yMin) * yValueDY;
+
+   return constrain(yPos, graphY, graphY + graphDY);
 }
 
 /* Draw a graph with x- and y-axis and values */
-void WeatherDisplay::DrawGraph(int x, int y, int dx, int dy, String title, int xMin, int xMax, int yMin, int yMax, float values[])
-{
-   String yMinString = String(yMin);
-   String yMaxString = String(yMax);
-   int    textWidth  = 5 + max(yMinString.length() * 3.5, yMaxString.length() * 3.5);
-   int    graphX     = x + 5 + textWidth + 5;
-   int    graphY     = y + 35;
-   int    graphDX    = dx - textWidth - 20;
-   int    graphDY    = dy - 35 - 20;
-   float  xStep      = graphDX / (xMax - xMin);
-   float  yStep      = graphDY / (yMax - yMin);
-   int    iOldX      = 0;
-   int    iOldY      = 0;
+void WeatherDisplay::DrawGraph(int x, int y, int dx, int dy, const char *title, int xMin, int xMax, int yMin, int yMax, float values[])
+{
+   SmallString yMinString = SmallString().AppendNumber(yMin);
+   SmallString yMaxString = SmallString().AppendNumber(yMax);
+   int         textWidth  = 5 + max(yMinString.length() * 3.5, yMaxString.length() * 3.5);
+   int         graphX     = x + 5 + textWidth + 5;
+   int         graphY     = y + 35;
+   int         graphDX    = dx - textWidth - 20;
+   int         graphDY    = dy - 35 - 20;
+   float       xStep      = graphDX / (xMax - xMin);
+   float       yStep      = graphDY / (yMax - yMin);
+   int         iOldX      = 0;
+   int         iOldY      = 0;
 
    canvas.setTextSize(2);
    canvas.drawCentreString(title, x + dx / 2, y + 10, 1);
@@ -364,7 +439,7 @@ void WeatherDisplay::DrawGraph(int x, int y, int dx, int dy, String title, int x
    canvas.drawString(yMaxString, x + 5, graphY - 5);   
    canvas.drawString(yMinString, x + 5, graphY + graphDY - 3);   
    for (int i = 0; i <= (xMax - xMin); i++) {
-      canvas.drawString(String(i), graphX + i * xStep, graphY + graphDY + 5);   
+      canvas.drawString(SmallString().AppendNumber(i), graphX + i * xStep, graphY + graphDY + 5);   
    }
    
    canvas.drawRect(graphX, graphY, graphDX, graphDY, M5EPD_Canvas::G15);   
@@ -381,13 +456,8 @@ void WeatherDisplay::DrawGraph(int x, int y, int dx, int dy, String title, int x
       }
    }
    for (int i = xMin; i <= xMax; i++) {
-      float yValue   = values[i - xMin];
-      float yValueDY = (float) graphDY / (yMax - yMin);
-      int   xPos     = graphX + graphDX / (xMax - xMin) * i;
-      int   yPos     = graphY + graphDY - (yValue - yMin) * yValueDY;
-
-      if (yPos > graphY + graphDY) yPos = graphY + graphDY;
-      if (yPos < graphY)           yPos = graphY;
+      int xPos = graphX + graphDX / (xMax - xMin) * i;
+      int yPos = GetGraphY(y, dy, yMin, yMax, values[i - xMin]);
 
       canvas.fillCircle(xPos, yPos, 2, M5EPD_Canvas::G15);
       if (i > xMin) {
@@ -398,19 +468,164 @@ void WeatherDisplay::DrawGraph(int x, int y, int dx, int dy, String title, int x
    }
 }
 
-/* Main function to show all the data to the e-paper */
-void WeatherDisplay::Show()
+/* Draw the hourly min/max range and the average of the SHT30 temperature or humidity of the hours until the time */
+void WeatherDisplay::DrawSensorGraph(int x, int y, int dx, int dy, const char *title, SensorHour hours[], int count, time_t time, bool humidity)
 {
-   Serial.println("WeatherDisplay::Show");
+   time_t first   = (time / SECS_PER_HOUR - count + 1) * SECS_PER_HOUR;
+   int    graphX  = x + 50;
+   int    graphY  = y + 35;
+   int    graphDX = dx - 70;
+   int    graphDY = dy - 35 - 25;
+   int    yMin    = INT16_MAX;
+   int    yMax    = INT16_MIN;
+
+   for (int i = 0; i < count; i++) {
+      if (hours[i].hour) {
+         yMin = min(yMin, (int) (humidity ? hours[i].minHumidity : hours[i].minTemp));
+         yMax = max(yMax, (int) (humidity ? hours[i].maxHumidity : hours[i].maxTemp));
+      }
+   }
+   canvas.setTextSize(2);
+   canvas.drawCentreString(title, x + dx / 2, y + 10, 1);
+   canvas.drawRect(graphX, graphY, graphDX, graphDY, M5EPD_Canvas::G15);
+   if (yMin > yMax) {
+      canvas.drawCentreString("no values", x + dx / 2, graphY + graphDY / 2, 1);
+      return;
+   }
+   // whole 5 units in 0.1 units
+   yMin = (int) floor(yMin / 50.0) * 50;
+   yMax = max((int) ceil(yMax / 50.0) * 50, yMin + 50);
+   canvas.drawString(SmallString().AppendNumber(yMax / 10), x + 5, graphY - 5);
+   canvas.drawString(SmallString().AppendNumber(yMin / 10), x + 5, graphY + graphDY - 10);
+
+   float xStep = (float) graphDX / count;
+   float yStep = (float) graphDY / (yMax - yMin);
+   int   iOldX = -1;
+   int   iOldY = 0;
+
+   for (int i = 0; i < count; i++) {
+      time_t start = first + i * SECS_PER_HOUR;
+      int    xPos  = graphX + (i + 0.5) * xStep;
+
+      if (hour(start) == 0) { // day separator
+         for (int yDash = graphY; yDash < graphY + graphDY - 5; yDash += 10) {
+            canvas.drawLine(xPos, yDash, xPos, yDash + 5, M5EPD_Canvas::G15);
+         }
+         if (xPos + 60 < graphX + graphDX) {
+            canvas.drawString(getDayMonthString(start), xPos + 3, graphY + graphDY + 5);
+         }
+      }
+      if (!hours[i].hour) {
+         iOldX = -1;
+         continue;
+      }
+      int minY = graphY + graphDY - ((humidity ? hours[i].minHumidity : hours[i].minTemp) - yMin) * yStep;
+      int maxY = graphY + graphDY - ((humidity ? hours[i].maxHumidity : hours[i].maxTemp) - yMin) * yStep;
+      int avgY = graphY + graphDY - ((humidity ? hours[i].avgHumidity : hours[i].avgTemp) - yMin) * yStep;
 
-   canvas.createCanvas(960, 540);
+      canvas.drawLine(xPos, minY, xPos, maxY, M5EPD_Canvas::G6);
+      if (iOldX >= 0) {
+         canvas.drawLine(iOldX, iOldY, xPos, avgY, M5EPD_Canvas::G15);
+      }
+      iOldX = xPos;
+      iOldY = avgY;
+   }
+}
+
+/* Draw the values starting at the time of the first value with day separators, the optional lower values as a range */
+void WeatherDisplay::DrawTimeGraph(int x, int y, int dx, int dy, const char *title, const float values[], int count, time_t first, int step, const float lower[] /* = NULL */)
+{
+   int   graphX  = x + 50;
+   int   graphY  = y + 35;
+   int   graphDX = dx - 70;
+   int   graphDY = dy - 35 - 25;
+   float yMin    = values[0];
+   float yMax    = values[0];
+
+   for (int i = 0; i < count; i++) {
+      yMin = min(yMin, lower ? lower[i] : values[i]);
+      yMax = max(yMax, values[i]);
+   }
+   // whole 5 units
+   yMin = floor(yMin / 5) * 5;
+   yMax = max(ceil(yMax / 5) * 5, yMin + 5);
+
+   canvas.setTextSize(2);
+   canvas.drawCentreString(title, x + dx / 2, y + 10, 1);
+   canvas.drawRect(graphX, graphY, graphDX, graphDY, M5EPD_Canvas::G15);
+   canvas.drawString(SmallString().AppendNumber((int) yMax), x + 5, graphY - 5);
+   canvas.drawString(SmallString().AppendNumber((int) yMin), x + 5, graphY + graphDY - 10);
+
+   float xStep = (float) graphDX / count;
+   float yStep = graphDY / (yMax - yMin);
+   bool  days  = step >= (int) SECS_PER_DAY;
+   int   iOldX = 0;
+   int   iOldY = 0;
+
+   for (int i = 0; i < count; i++) {
+      time_t time = first + i * step;
+      int    xPos = graphX + (i + 0.5) * xStep;
+      int    yPos = graphY + graphDY - (values[i] - yMin) * yStep;
+
+      if (days || hour(time) == 0) { // day separator
+         if (i > 0) {
+            for (int yDash = graphY; yDash < graphY + graphDY - 5; yDash += 10) {
+               canvas.drawLine(graphX + i * xStep, yDash, graphX + i * xStep, yDash + 5, M5EPD_Canvas::G15);
+            }
+         }
+         if (days || graphX + i * xStep + 60 < graphX + graphDX) {
+            canvas.drawString(getDayMonthString(time), graphX + i * xStep + 3, graphY + graphDY + 5);
+         }
+      }
+      if (lower) {
+         canvas.drawLine(xPos, graphY + graphDY - (lower[i] - yMin) * yStep, xPos, yPos, M5EPD_Canvas::G6);
+      }
+      canvas.fillCircle(xPos, yPos, 2, M5EPD_Canvas::G15);
+      if (i > 0) {
+         canvas.drawLine(iOldX, iOldY, xPos, yPos, M5EPD_Canvas::G15);
+      }
+      iOldX = xPos;
+      iOldY = yPos;
+   }
+}
+
+/* Push the canvas and wait until the e-paper has finished the refresh */
+void WeatherDisplay::PushCanvas(int x, int y, m5epd_update_mode_t mode)
+{
+   uint32_t start = millis();
+   
+   if (!myData.firstPixelMillis) {
+      myData.firstPixelMillis = start;
+   }
+   if (renderStart) {
+      myData.renderMillis += start - renderStart;
+      renderStart = 0;
+   }
+   myHeap.Sample(HEAP_RENDER);
+   canvas.pushCanvas(x, y, mode);
+   if (!WaitEPDReady(mode, start, min((uint32_t) BUDGET_PUSH_MS, myBudget.WakeLeft()))) {
+      myBudget.Overrun(BUDGET_PUSH);
+   }
+}
+
+/* Create an empty canvas, default is the full screen */
+void WeatherDisplay::CreateCanvas(int dx /* = 960 */, int dy /* = 540 */)
+{
+   if (canvas.width() != dx || canvas.height() != dy) {
+      canvas.deleteCanvas();
+   }
+   renderStart = millis();
+   canvas.createCanvas(dx, dy);
+   canvas.fillCanvas(0);
 
    canvas.setTextSize(2);
    canvas.setTextColor(WHITE, BLACK);
    canvas.setTextDatum(TL_DATUM);
+}
 
-   DrawHead();
-
+/* Draw all the weather parts without the head and the M5Paper information */
+void WeatherDisplay::DrawWeather()
+{
    // x = 960 y = 540
    // 540 - oben 35 - unten 10 = 495
    
@@ -423,10 +638,9 @@ void WeatherDisplay::Show()
    DrawSunInfo    ( 15, 35, 232, 251);
    DrawMoonInfo   (232, 35, 232, 251);
    DrawWindInfo   (465, 35, 232, 251);
-   DrawM5PaperInfo(697, 35, 245, 251);
 
    canvas.drawRect(15, 286, maxX - 30, 122, M5EPD_Canvas::G15);
-   for (int x = 15, i = 0; x <= 930; x += 116, i += 3) {
+   for (int x = 15, i = 0; x <= 930; x += 116, i += HOURLY_STEP) {
       canvas.drawLine(x, 286, x, 408, M5EPD_Canvas::G15);
       DrawHourly(x, 286, 116, 122, myData.weather, i);
    }
@@ -437,25 +651,310 @@ void WeatherDisplay::Show()
    DrawGraph(247, 408, 232, 122, "Rain (mm)",       0, 7,   0,   myData.weather.maxRain, myData.weather.forecastRain);
    DrawGraph(479, 408, 232, 122, "Humidity (%)",    0, 7,   0,  100, myData.weather.forecastHumidity);
    DrawGraph(711, 408, 232, 122, "Pressure (hPa)",  0, 7, 800, 1400, myData.weather.forecastPressure);
+}
+
+/* 
+ *  Hash of the drawn values without the time of the update: the rounded numbers, the hour labels,
+ *  the icons and the plotted positions of the graphs. The time update redraws the M5Paper information.
+ */
+uint32_t WeatherDisplay::GetHash()
+{
+   Weather &weather  = myData.weather;
+   int      values[] = {
+      myData.wifiRSSI ? WifiGetRssiAsQualityInt(myData.wifiRSSI) : -1,
+      myData.batteryCapacity,
+      myData.batteryDays >= 0 ? (int) (myData.batteryDays + 0.5) : -1,
+      UNCHANGED_TIME_UPDATE ? 0 : myData.sht30Temperatur,
+      UNCHANGED_TIME_UPDATE ? 0 : myData.sht30Humidity,
+      UNCHANGED_TIME_UPDATE ? 0 : (int) (GetRTCTime() / SECS_PER_DAY),
+      (int) (weather.sunrise / 60),
+      (int) (weather.sunset / 60),
+      (int) (myData.moonRise / 60),
+      (int) (myData.moonSet / 60),
+      (int) (weather.currentTime / SECS_PER_DAY),
+      (int) lroundf(weather.winddir),
+      (int) lroundf(weather.windspeed * 10),
+      weather.maxRain
+   };
+   uint32_t hash = Fnv1a(values, sizeof(values));
+
+   for (int i = 0; i < MAX_HOURLY; i += HOURLY_STEP) {
+      int hourly[] = { hour(weather.hourlyTime[i]), (int) weather.hourlyMaxTemp[i] };
+      
+      hash = Fnv1a(hourly, sizeof(hourly), hash);
+      hash = Fnv1a(weather.hourlyIcon[i].c_str(), weather.hourlyIcon[i].length(), hash);
+   }
+   // the ranges of the graphs of DrawWeather()
+   for (int i = 0; i < MAX_FORECAST; i++) {
+      int graphs[] = {
+         GetGraphY(408, 122, -20,   30, weather.forecastMaxTemp[i]),
+         GetGraphY(408, 122, -20,   30, weather.forecastMinTemp[i]),
+         GetGraphY(408, 122,   0, weather.maxRain, weather.forecastRain[i]),
+         GetGraphY(408, 122,   0,  100, weather.forecastHumidity[i]),
+         GetGraphY(408, 122, 800, 1400, weather.forecastPressure[i])
+      };
+      
+      hash = Fnv1a(graphs, sizeof(graphs), hash);
+   }
+   return hash;
+}
+
+/* Main function to show all the data to the e-paper, optional with a clear against ghosting */
+void WeatherDisplay::Show(bool clear /* = true */)
+{
+   LOG_I("WeatherDisplay::Show");
+
+   if (clear) {
+      M5.EPD.Clear(true);
+   }
+   CreateCanvas();
+   DrawHead();
+   DrawWeather();
+   DrawM5PaperInfo(697, 35, 245, 251);
    
-   canvas.pushCanvas(0, 0, UPDATE_MODE_GC16);
-   delay(1000);
+   PushCanvas(0, 0, UPDATE_MODE_GC16);
+   SetM5PaperShown();
+   myData.state.page = PAGE_WEATHER;
 }
 
-/* Update only the M5Paper part of the global data */
-void WeatherDisplay::ShowM5PaperInfo()
+/* 
+ *  Render the weather parts of the current data into the frame store. 
+ *  The head and the M5Paper information are drawn at the push.
+ */
+bool WeatherDisplay::RenderFrame(time_t time)
 {
-   Serial.println("WeatherDisplay::ShowM5PaperInfo");
+   LOG_I("WeatherDisplay::RenderFrame %s", getHourMinString(time).c_str());
 
-   canvas.createCanvas(245, 251);
+   CreateCanvas();
+   DrawWeather();
+   return frames.Write(time, myData.weather.cache.current.time, (uint8_t *) canvas.frameBuffer(), 960 * 540 / 2) > 0;
+}
 
-   canvas.setTextSize(2);
-   canvas.setTextColor(WHITE, BLACK);
-   canvas.setTextDatum(TL_DATUM);
+/* Push the pre-rendered frame of the hour with the current head and M5Paper information */
+bool WeatherDisplay::ShowFrame(time_t time, bool clear /* = true */)
+{
+   CreateCanvas();
+   if (!frames.Read(time, myData.weather.cache.current.time, (uint8_t *) canvas.frameBuffer(), 960 * 540 / 2)) {
+      return false;
+   }
+   LOG_I("WeatherDisplay::ShowFrame %s", getHourMinString(time).c_str());
+   if (clear) {
+      M5.EPD.Clear(true);
+   }
+   DrawHead();
+   DrawM5PaperInfo(697, 35, 245, 251);
+   
+   PushCanvas(0, 0, UPDATE_MODE_GC16);
+   SetM5PaperShown();
+   myData.state.page = PAGE_WEATHER;
+   return true;
+}
+
+/* Remember the M5Paper values on the display for the next partial update */
+void WeatherDisplay::SetM5PaperShown(int parts /* = M5PAPER_ALL */)
+{
+   if (parts & M5PAPER_TIME) {
+      myData.state.shownTime = GetRTCTime();
+   }
+   if (parts & M5PAPER_VALUES) {
+      myData.state.shownTemperatur = myData.sht30Temperatur;
+      myData.state.shownHumidity   = myData.sht30Humidity;
+   }
+}
+
+/* Redraw one line of the M5Paper information inside its frame with a fast waveform */
+void WeatherDisplay::PushM5PaperPart(int part, int top, int height, m5epd_update_mode_t mode /* = UPDATE_MODE_DU */)
+{
+   CreateCanvas(243, height);
+   DrawM5PaperInfo(-1, -top, 245, 251, part);
+   PushCanvas(698, 35 + top, mode);
+}
+
+/* 
+ *  Update only the M5Paper part of the global data.
+ *  If the panel is already on the display only the changed lines of the parts are drawn,
+ *  the date follows the time on a day change.
+ */
+void WeatherDisplay::ShowM5PaperInfo(int parts /* = M5PAPER_ALL */, m5epd_update_mode_t mode /* = UPDATE_MODE_DU */)
+{
+   LOG_I("WeatherDisplay::ShowM5PaperInfo");
+
+   if (myData.state.shownTime == 0) {
+      CreateCanvas(245, 251);
+      canvas.drawRect(0, 0, 245, 251, M5EPD_Canvas::G15);
+      DrawM5PaperInfo(0, 0, 245, 251);
+      
+      PushCanvas(697, 35, UPDATE_MODE_GC16);
+   } else {
+      if ((parts & M5PAPER_TIME) && myData.state.shownTime / SECS_PER_DAY != GetRTCTime() / SECS_PER_DAY) {
+         PushM5PaperPart(M5PAPER_DATE, 50, 30, mode);
+      }
+      if (parts & M5PAPER_TIME) {
+         PushM5PaperPart(M5PAPER_TIME, 90, 30, mode);
+      }
+      if ((parts & M5PAPER_VALUES) && (myData.state.shownTemperatur != myData.sht30Temperatur || myData.state.shownHumidity != myData.sht30Humidity)) {
+         PushM5PaperPart(M5PAPER_VALUES, 205, 35, mode);
+      }
+   }
+   SetM5PaperShown(parts);
+}
+
+/* Source of the data of a stored page, a page of another source must be rendered again */
+uint32_t WeatherDisplay::GetPageSource(int page)
+{
+   return page == PAGE_HISTORY ? myData.state.sensor.hour.hour : myData.weather.cache.current.time;
+}
+
+/* Draw the icons and the graphs of the hourly forecast of the next 48 hours */
+void WeatherDisplay::DrawHourlyPage()
+{
+   const WeatherCache &cache = myData.weather.cache;
+   float               temp[MAX_HOURLY_CACHE];
+   float               wind[MAX_HOURLY_CACHE];
 
-   canvas.drawRect(0, 0, 245, 251, M5EPD_Canvas::G15);
-   DrawM5PaperInfo(0, 0, 245, 251);
+   canvas.drawRect(14, 34, maxX - 28, maxY - 43, M5EPD_Canvas::G15);
+   canvas.drawRect(15, 35, maxX - 30, 140, M5EPD_Canvas::G15);
+   for (int i = 0; i < MAX_HOURLY_CACHE / 4; i++) {
+      const WeatherHour &hour = cache.hourly[i * 4];
+      int                x    = 15 + i * 77;
+
+      if (i > 0) {
+         canvas.drawLine(x, 35, x, 175, M5EPD_Canvas::G15);
+      }
+      canvas.setTextSize(2);
+      canvas.drawCentreString(getHourString(hour.time).Append(":00"), x + 38, 45, 1);
+      canvas.drawCentreString(SmallString().AppendNumber((int) roundf(hour.temp)).Append(" C"), x + 38, 65, 1);
+      DrawWeatherIcon(x + 6, 95, hour.icon);
+   }
+   for (int i = 0; i < MAX_HOURLY_CACHE; i++) {
+      temp[i] = cache.hourly[i].temp;
+      wind[i] = cache.hourly[i].windspeed;
+   }
+   canvas.drawLine(15, 355, maxX - 15, 355, M5EPD_Canvas::G15);
+   DrawTimeGraph(15, 175, maxX - 30, 180, "Temperature (C)", temp, MAX_HOURLY_CACHE, cache.hourly[0].time, SECS_PER_HOUR);
+   DrawTimeGraph(15, 355, maxX - 30, 176, "Wind (m/s)",      wind, MAX_HOURLY_CACHE, cache.hourly[0].time, SECS_PER_HOUR);
+}
+
+/* Draw the details and the temperature range of the 8 days forecast */
+void WeatherDisplay::DrawDailyPage()
+{
+   static const char  *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+   const WeatherCache &cache  = myData.weather.cache;
+   time_t              first  = cache.current.time / SECS_PER_DAY * SECS_PER_DAY;
+   float               maxTemp[MAX_FORECAST];
+   float               minTemp[MAX_FORECAST];
+
+   canvas.drawRect(14, 34, maxX - 28, maxY - 43, M5EPD_Canvas::G15);
+   canvas.drawRect(15, 35, maxX - 30, 300, M5EPD_Canvas::G15);
+   for (int i = 0; i < MAX_FORECAST; i++) {
+      const WeatherDay &daily = cache.daily[i];
+      time_t            time  = first + i * SECS_PER_DAY;
+      int               x     = 15 + i * 116;
+      tmElements_t      tm;
+
+      if (i > 0) {
+         canvas.drawLine(x, 35, x, 335, M5EPD_Canvas::G15);
+      }
+      breakTime(time, tm);
+      canvas.setTextSize(2);
+      canvas.drawCentreString(SmallString(days[tm.Wday - 1]).Append(' ').AppendNumber(tm.Day).Append('.'), x + 58,  45, 1);
+      canvas.drawLine(x, 70, x + 116, 70, M5EPD_Canvas::G15);
+      canvas.drawCentreString(SmallString().AppendNumber((int) roundf(daily.maxTemp)).Append(" C"),    x + 58,  85, 1);
+      canvas.drawCentreString(SmallString().AppendNumber((int) roundf(daily.minTemp)).Append(" C"),    x + 58, 115, 1);
+      canvas.drawCentreString(SmallString().AppendFloat(daily.rain, 1).Append(" mm"),                  x + 58, 155, 1);
+      canvas.drawCentreString(SmallString().AppendNumber((int) roundf(daily.humidity)).Append(" %"),   x + 58, 185, 1);
+      canvas.drawCentreString(SmallString().AppendNumber((int) roundf(daily.pressure)).Append(" hPa"), x + 58, 215, 1);
+      canvas.drawCentreString("Sunrise",                                                               x + 58, 250, 1);
+      canvas.drawCentreString(getHourMinString(daily.sunrise),                                         x + 58, 270, 1);
+      canvas.drawCentreString("Sunset",                                                                x + 58, 295, 1);
+      canvas.drawCentreString(getHourMinString(daily.sunset),                                          x + 58, 315, 1);
+      maxTemp[i] = daily.maxTemp;
+      minTemp[i] = daily.minTemp;
+   }
+   DrawTimeGraph(15, 335, maxX - 30, 196, "Temperature max/min (C)", maxTemp, MAX_FORECAST, first, SECS_PER_DAY, minTemp);
+}
+
+/* Draw the indoor history of the last HISTORY_HOURS */
+void WeatherDisplay::DrawHistoryPage()
+{
+   static SensorHour hours[HISTORY_HOURS]; // too big for the stack
+   time_t            now   = GetRTCTime();
+   int               found = myData.history.GetHours(hours, HISTORY_HOURS, now, myData.state.sensor);
+
+   LOG_I("WeatherDisplay::DrawHistoryPage %d hours", found);
+
+   canvas.drawRect(14, 34, maxX - 28, maxY - 43, M5EPD_Canvas::G15);
+   canvas.drawLine(15, 283, maxX - 15, 283, M5EPD_Canvas::G15);
+   DrawSensorGraph(15,  35, maxX - 30, 248, "Indoor temperature (C)", hours, HISTORY_HOURS, now, false);
+   DrawSensorGraph(15, 283, maxX - 30, 248, "Indoor humidity (%)",    hours, HISTORY_HOURS, now, true);
+}
+
+/* Render one page without the head into the canvas and the page store */
+bool WeatherDisplay::RenderPage(int page)
+{
+   LOG_I("WeatherDisplay::RenderPage %d", page);
+
+   CreateCanvas();
+   if (page == PAGE_HOURLY) {
+      DrawHourlyPage();
+   } else if (page == PAGE_DAILY) {
+      DrawDailyPage();
+   } else {
+      DrawHistoryPage();
+   }
+   return pages.Write((page - 1) * SECS_PER_HOUR, GetPageSource(page), (uint8_t *) canvas.frameBuffer(), 960 * 540 / 2) > 0;
+}
+
+/* 
+ *  Render the pages of a new forecast or a new sensor hour into the page store,
+ *  so a flip to the page is only a decompression and a push.
+ *  The end of the render budget stops it, a missing page is rendered by the flip.
+ */
+void WeatherDisplay::RenderPages()
+{
+   for (int page = PAGE_HOURLY; page < PAGE_COUNT && !myBudget.Expired(); page++) {
+      if (!pages.IsStored((page - 1) * SECS_PER_HOUR, GetPageSource(page))) {
+         RenderPage(page);
+      }
+   }
+}
+
+/* 
+ *  Show one of the pages, the weather page is shown by the caller.
+ *  Without a clear, so the page of a button or a touch appears fast.
+ */
+void WeatherDisplay::ShowPage(int page)
+{
+   LOG_I("WeatherDisplay::ShowPage %d", page);
+
+   CreateCanvas();
+   if (!pages.Read((page - 1) * SECS_PER_HOUR, GetPageSource(page), (uint8_t *) canvas.frameBuffer(), 960 * 540 / 2)) {
+      RenderPage(page);
+   }
+   DrawHead();
+   
+   PushCanvas(0, 0, UPDATE_MODE_GC16);
+   myData.state.page        = page;
+   myData.state.displayHash = 0;
+   myData.state.shownTime   = 0;
+}
+
+/* Show the low battery screen, it stays on the e-paper until the next charge */
+void WeatherDisplay::ShowLowBattery()
+{
+   LOG_I("WeatherDisplay::ShowLowBattery");
+
+   M5.EPD.Clear(true);
+   CreateCanvas();
+   DrawHead();
+   canvas.drawRect(14, 34, maxX - 28, maxY - 43, M5EPD_Canvas::G15);
+   canvas.setTextSize(5);
+   canvas.drawCentreString("Battery low", maxX / 2, 200, 1);
+   canvas.setTextSize(3);
+   canvas.drawCentreString("Please charge the M5Paper", maxX / 2, 280, 1);
+   canvas.drawCentreString(getRTCDateString().Append(' ').Append(getHourMinString(GetRTCTime())), maxX / 2, 330, 1);
    
-   canvas.pushCanvas(697, 35, UPDATE_MODE_GC16);
-   delay(1000);
+   PushCanvas(0, 0, UPDATE_MODE_GC16);
+   myData.state.displayHash = 0;
+   myData.state.shownTime   = 0;
 }
@@ -20,6 +20,16 @@
   * Helper functions for initialisizing and shutdown of the M5Paper.
   */
 #pragma once
+#include "Log.h"
+
+
+RTC_DATA_ATTR bool usbPowered = false; // The last shutdown could not switch off
+
+/* Is the M5Paper on usb power? Known after the first shutdown on usb. */
+bool IsUSBPowered()
+{
+   return usbPowered;
+}
 
 /* Initialize the M5Paper */
 void InitEPD(bool clearDisplay = true)
@@ -36,20 +46,103 @@ void InitEPD(bool clearDisplay = true)
 //   disableCore0WDT();
 }
 
+/* Start the GT911 touch controller, it is only needed for the pages */
+void StartTouch()
+{
+   static bool started = false;
+
+   if (!started) {
+      started = M5.TP.begin(21, 22, 36) == ESP_OK;
+      M5.TP.SetRotation(0);
+   }
+}
+
+/* Name of the update mode for the log output */
+const char *GetUpdateModeName(m5epd_update_mode_t mode)
+{
+   switch (mode) {
+      case UPDATE_MODE_INIT:  return "INIT";
+      case UPDATE_MODE_DU:    return "DU";
+      case UPDATE_MODE_GC16:  return "GC16";
+      case UPDATE_MODE_GL16:  return "GL16";
+      case UPDATE_MODE_GLR16: return "GLR16";
+      case UPDATE_MODE_GLD16: return "GLD16";
+      case UPDATE_MODE_DU4:   return "DU4";
+      case UPDATE_MODE_A2:    return "A2";
+      default:                return "NONE";
+   }
+}
+
 /* 
- *  Shutdown the M5Paper 
+ *  Wait until the IT8951 has finished the waveform of the last update.
+ *  startMillis is the time of the push, so the log shows the whole refresh time.
+ */
+bool WaitEPDReady(m5epd_update_mode_t mode, uint32_t startMillis, uint32_t timeout = BUDGET_PUSH_MS)
+{
+   m5epd_err_t err = M5.EPD.CheckAFSR();
+
+   while (err != M5EPD_OK && millis() - startMillis < timeout) {
+      err = M5.EPD.CheckAFSR();
+   }
+   LOG_I("EPD refresh %s: %lu ms%s", GetUpdateModeName(mode), 
+      (unsigned long) (millis() - startMillis), err == M5EPD_OK ? "" : " (timeout)");
+   return err == M5EPD_OK;
+}
+
+/* The BM8563 alarm of the absolute wake time, it matches day, hour and minute, the seconds are ignored */
+void GetRTCAlarm(time_t wakeTime, rtc_date_t &date, rtc_time_t &time)
+{
+   date.year = year(wakeTime);
+   date.mon  = month(wakeTime);
+   date.day  = day(wakeTime);
+   date.week = -1; // no weekday alarm
+   time.hour = hour(wakeTime);
+   time.min  = minute(wakeTime);
+   time.sec  = 0;
+}
+
+/* Set the RTC alarm without the power off, it wakes the M5Paper if the wake ends otherwise */
+void SetRTCAlarm(time_t wakeTime)
+{
+   rtc_date_t date;
+   rtc_time_t time;
+
+   GetRTCAlarm(wakeTime, date, time);
+   M5.RTC.SetAlarmIRQ(date, time);
+}
+
+/* 
+ *  Set the RTC alarm to the absolute wake time and switch off the M5Paper.
+ *  Returns only on usb power, then the alarm wakes the M5Paper after unplugging.
+ */
+void PowerOffEPD(time_t wakeTime)
+{
+   rtc_date_t date;
+   rtc_time_t time;
+
+   GetRTCAlarm(wakeTime, date, time);
+   LOG_I("Shutdown until %s", getDateTimeString(wakeTime).c_str());
+   FlushLog(); // end of the wake on battery
+   M5.shutdown(date, time);
+   usbPowered = true;
+}
+
+/* 
+ *  Shutdown the M5Paper until the absolute wake time of the RTC.
  *  NOTE: the M5Paper could not shutdown while on usb connection.
- *        In this case use the esp_deep_sleep_start() function.
+ *        In this case the esp_deep_sleep_start() function is used
+ *        and the usb power is remembered in the rtc memory.
 */
-void ShutdownEPD(int sec)
+void ShutdownEPD(time_t wakeTime)
 {
-   Serial.println("Shutdown");
-/*
+   PowerOffEPD(wakeTime);
+
+   int sec = max((int) (wakeTime - GetRTCTime()), 1);
+
+   LOG_I("Shutdown on usb power, deep sleep");
    M5.disableEPDPower();
    M5.disableEXTPower();
-   M5.disableMainPower();
-   esp_sleep_enable_timer_wakeup(sec * 1000000);
+   esp_sleep_enable_timer_wakeup((uint64_t) sec * 1000000);
+   FlushLog();
    esp_deep_sleep_start();   
-*/   
-   M5.shutdown(sec);
 }
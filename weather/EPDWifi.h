@@ -21,35 +21,42 @@
   */
 #pragma once
 #include <WiFi.h>
+#include "Budget.h"
+#include "Log.h"
 
-/* Start and connect to the wifi */
+/* Start and connect to the wifi, an existing connection of the always on mode is used */
 bool StartWiFi(int &rssi) 
 {
    IPAddress dns(8, 8, 8, 8); // Google DNS
    
+   if (WiFi.status() == WL_CONNECTED) {
+      WiFi.setSleep(false);
+      rssi = WiFi.RSSI();
+      LOG_I("WiFi still connected");
+      return true;
+   }
    WiFi.mode(WIFI_STA);
    WiFi.disconnect();
    WiFi.setAutoConnect(true);
    WiFi.setAutoReconnect(true);
 
-   Serial.print("Connecting to ");
-   Serial.println(WIFI_SSID);
+   LOG_I("Connecting to %s", WIFI_SSID);
    delay(100);
    
    WiFi.begin(WIFI_SSID, WIFI_PW);
 
-   for (int retry = 0; WiFi.status() != WL_CONNECTED && retry < 30; retry++) {
-      delay(500);
-      Serial.print(".");
+   myBudget.Start(BUDGET_CONNECT);
+   while (WiFi.status() != WL_CONNECTED && !myBudget.Expired()) {
+      delay(min(myBudget.Remaining(), (uint32_t) 500));
    }
 
    rssi = 0;
    if (WiFi.status() == WL_CONNECTED) {
       rssi = WiFi.RSSI();
-      Serial.println("WiFi connected at: " + WiFi.localIP().toString());
+      LOG_I("WiFi connected at: %s", WiFi.localIP().toString().c_str());
       return true;
    } else {
-      Serial.println("WiFi connection *** FAILED ***");
+      LOG_E("WiFi connection *** FAILED ***");
       return false;
    }
 }
@@ -57,7 +64,14 @@ bool StartWiFi(int &rssi)
 /* Stop the wifi connection */
 void StopWiFi() 
 {
-   Serial.println("Stop WiFi");
+   LOG_I("Stop WiFi");
    WiFi.disconnect();
    WiFi.mode(WIFI_OFF);
 }
+
+/* Keep the connection in the modem sleep until the next fetch of the always on mode */
+void SleepWiFi() 
+{
+   LOG_I("WiFi modem sleep");
+   WiFi.setSleep(true);
+}
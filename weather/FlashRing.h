@@ -0,0 +1,208 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file FlashRing.h
+  *
+  * Ring of fixed size records in the sectors of a flash partition.
+  */
+#pragma once
+#include <esp_partition.h>
+#include "FrameStore.h"
+
+#define RING_MAGIC  0x474E4952  // "RING"
+
+/**
+  * Header at the start of every used sector.
+  */
+struct RingHeader
+{
+   uint32_t magic;     //!< RING_MAGIC
+   uint32_t sequence;  //!< Increasing number of the sector
+   uint8_t  base[8];   //!< Base values of the records, defined by the user of the ring
+};
+
+/**
+  * Appends fixed size records to the sectors of a partition. A full sector is
+  * continued with the next one, which is erased first, so the oldest sector
+  * is dropped. An erased record (all bytes 0xFF) marks the end of a sector,
+  * so the records must never consist of 0xFF only.
+  */
+class FlashRing
+{
+protected:
+   const char            *label;       //!< Name of the partition
+   const esp_partition_t *partition;   //!< The partition or NULL
+   size_t                 recordSize;  //!< Size of one record
+   uint32_t               sector;      //!< Current sector
+   uint32_t               sequence;    //!< Sequence of the current sector
+   int                    used;        //!< Used records of the current sector
+   bool                   found;       //!< The current sector is valid
+
+protected:
+   /* Partition offset of the sector that is age sectors older than the current */
+   uint32_t SectorOffset(int age)
+   {
+      return ((sector + Sectors() - age) % Sectors()) * FLASH_SECTOR_SIZE;
+   }
+
+   /* Is the record unused since the last erase? */
+   bool IsBlank(const uint8_t *record)
+   {
+      for (size_t i = 0; i < recordSize; i++) {
+         if (record[i] != 0xFF) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+public:
+   FlashRing(const char *l, size_t size)
+      : label(l)
+      , partition(NULL)
+      , recordSize(size)
+      , sector(0)
+      , sequence(0)
+      , used(0)
+      , found(false)
+   {
+   }
+
+   /* Find the partition, the newest sector and its first free record */
+   bool Begin()
+   {
+      if (partition) {
+         return true;
+      }
+      partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+      if (!partition) {
+         LOG_E("FlashRing: partition %s not found", label);
+         return false;
+      }
+      for (int i = 0; i < Sectors(); i++) {
+         RingHeader header;
+
+         if (esp_partition_read(partition, i * FLASH_SECTOR_SIZE, &header, sizeof(header)) == ESP_OK
+            && header.magic == RING_MAGIC && (!found || header.sequence > sequence)) {
+            found    = true;
+            sector   = i;
+            sequence = header.sequence;
+         }
+      }
+      used = 0;
+      if (found) {
+         uint8_t records[256];
+         int     count = sizeof(records) / recordSize;
+         int     read  = count;
+
+         while (read == count && used < Capacity()) {
+            read  = Read(0, used, records, count);
+            used += read;
+         }
+      }
+      return true;
+   }
+
+   /* Number of sectors of the partition */
+   int Sectors()
+   {
+      return partition ? partition->size / FLASH_SECTOR_SIZE : 0;
+   }
+
+   /* Number of records of one sector */
+   int Capacity()
+   {
+      return (FLASH_SECTOR_SIZE - sizeof(RingHeader)) / recordSize;
+   }
+
+   /* Start the next sector with the base values (8 bytes or NULL) */
+   bool NewSector(const void *base)
+   {
+      if (!Begin() || Sectors() < 2) {
+         return false;
+      }
+      uint32_t next = found ? (sector + 1) % Sectors() : 0;
+
+      if (esp_partition_erase_range(partition, next * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE) != ESP_OK) {
+         return false;
+      }
+
+      RingHeader header;
+
+      header.magic    = RING_MAGIC;
+      header.sequence = found ? sequence + 1 : 1;
+      memset(header.base, 0, sizeof(header.base));
+      if (base) {
+         memcpy(header.base, base, sizeof(header.base));
+      }
+      if (esp_partition_write(partition, next * FLASH_SECTOR_SIZE, &header, sizeof(header)) != ESP_OK) {
+         found = false;
+         return false;
+      }
+      found    = true;
+      sector   = next;
+      sequence = header.sequence;
+      used     = 0;
+      return true;
+   }
+
+   /* Append a record to the current sector. Fails if the sector is full or missing. */
+   bool Append(const void *record)
+   {
+      if (!Begin() || !found || used >= Capacity()) {
+         return false;
+      }
+      if (esp_partition_write(partition, SectorOffset(0) + sizeof(RingHeader) + used * recordSize, record, recordSize) != ESP_OK) {
+         return false;
+      }
+      used++;
+      return true;
+   }
+
+   /* Header of the sector that is age sectors older than the current */
+   bool Header(int age, RingHeader &header)
+   {
+      if (!Begin() || !found || age >= Sectors()) {
+         return false;
+      }
+      return esp_partition_read(partition, SectorOffset(age), &header, sizeof(header)) == ESP_OK
+         && header.magic == RING_MAGIC && header.sequence == sequence - age;
+   }
+
+   /*
+    *  Read up to count records starting with the index of the sector that is age
+    *  sectors older than the current. Returns the number of the used records read.
+    */
+   int Read(int age, int index, void *records, int count)
+   {
+      RingHeader header;
+
+      if (index >= Capacity() || !Header(age, header)) {
+         return 0;
+      }
+      count = min(count, Capacity() - index);
+      if (esp_partition_read(partition, SectorOffset(age) + sizeof(RingHeader) + index * recordSize, records, count * recordSize) != ESP_OK) {
+         return 0;
+      }
+      for (int i = 0; i < count; i++) {
+         if (IsBlank((const uint8_t *) records + i * recordSize)) {
+            return i;
+         }
+      }
+      return count;
+   }
+};
@@ -0,0 +1,274 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file FrameStore.h
+  *
+  * Ring of compressed frame buffers in a flash partition.
+  */
+#pragma once
+#include <esp_partition.h>
+#include "Utils.h"
+
+#define FRAME_MAGIC        0x314D5246  // "FRM1"
+#define FRAME_SLOT_SIZE    (128 * 1024)
+#define FLASH_SECTOR_SIZE  4096
+
+/**
+  * Header in front of every stored frame.
+  */
+struct FrameHeader
+{
+   uint32_t magic;    //!< FRAME_MAGIC
+   uint32_t time;     //!< local start time of the hour of the frame
+   uint32_t source;   //!< fetch time of the forecast the frame was rendered from
+   uint32_t rawSize;  //!< size of the frame buffer
+   uint32_t size;     //!< size of the compressed data
+   uint32_t crc;      //!< crc32 of the compressed data
+};
+
+/**
+  * Stores PackBits compressed frame buffers in the slots of a flash partition.
+  * The slot of a frame is selected by its hour, so the store is a ring of the
+  * next hours. The header is written last, so an interrupted write leaves an
+  * invalid slot.
+  */
+class FrameStore
+{
+protected:
+   const char            *label;             //!< Name of the partition
+   const esp_partition_t *partition;         //!< The partition or NULL
+
+   uint32_t               slotStart;         //!< Partition offset of the slot in progress
+   uint32_t               writeOffset;       //!< Write position in the slot
+   uint32_t               erasedOffset;      //!< Erased part of the slot
+   uint32_t               crc;               //!< crc of the written data
+   bool                   writeFailed;       //!< Flash error or slot overflow
+   uint8_t                writeBuffer[512];  //!< Buffer for the flash writes
+   size_t                 writeUsed;         //!< Used part of the write buffer
+
+protected:
+   /* Write the buffered compressed data to the flash */
+   void Flush()
+   {
+      if (!writeUsed || writeFailed) {
+         writeUsed = 0;
+         return;
+      }
+      if (writeOffset + writeUsed > FRAME_SLOT_SIZE) {
+         writeFailed = true;
+         return;
+      }
+      while (erasedOffset < writeOffset + writeUsed) {
+         if (esp_partition_erase_range(partition, slotStart + erasedOffset, FLASH_SECTOR_SIZE) != ESP_OK) {
+            writeFailed = true;
+            return;
+         }
+         erasedOffset += FLASH_SECTOR_SIZE;
+      }
+      if (esp_partition_write(partition, slotStart + writeOffset, writeBuffer, writeUsed) != ESP_OK) {
+         writeFailed = true;
+      }
+      crc          = Crc32(writeBuffer, writeUsed, crc);
+      writeOffset += writeUsed;
+      writeUsed    = 0;
+   }
+
+   /* Add one byte of compressed data */
+   void Put(uint8_t value)
+   {
+      writeBuffer[writeUsed++] = value;
+      if (writeUsed == sizeof(writeBuffer)) {
+         Flush();
+      }
+   }
+
+   /* Add a PackBits literal block */
+   void PutLiteral(const uint8_t *data, size_t count)
+   {
+      Put((uint8_t) (count - 1));
+      for (size_t i = 0; i < count; i++) {
+         Put(data[i]);
+      }
+   }
+
+   /* Slot number of the hour */
+   uint32_t SlotOffset(uint32_t time)
+   {
+      return ((time / 3600) % Slots()) * FRAME_SLOT_SIZE;
+   }
+
+public:
+   FrameStore(const char *l)
+      : label(l)
+      , partition(NULL)
+      , slotStart(0)
+      , writeOffset(0)
+      , erasedOffset(0)
+      , crc(0)
+      , writeFailed(false)
+      , writeUsed(0)
+   {
+   }
+
+   /* Find the partition */
+   bool Begin()
+   {
+      if (!partition) {
+         partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+         if (!partition) {
+            LOG_E("FrameStore: partition %s not found", label);
+         }
+      }
+      return partition != NULL;
+   }
+
+   /* Number of frame slots of the partition */
+   int Slots()
+   {
+      return partition ? partition->size / FRAME_SLOT_SIZE : 0;
+   }
+
+   /* Compress the frame buffer and store it for the hour of the time. Returns the compressed size. */
+   size_t Write(uint32_t time, uint32_t source, const uint8_t *data, size_t size)
+   {
+      if (!Begin() || !Slots()) {
+         return 0;
+      }
+      uint32_t start = millis();
+
+      slotStart    = SlotOffset(time);
+      writeOffset  = sizeof(FrameHeader);
+      erasedOffset = 0;
+      crc          = 0;
+      writeFailed  = false;
+      writeUsed    = 0;
+
+      // PackBits: n = 0..127 copies n + 1 literal bytes, n = -1..-127 repeats the next byte 1 - n times
+      size_t literal = 0;
+      size_t i       = 0;
+
+      while (i < size) {
+         size_t run = 1;
+
+         while (i + run < size && run < 128 && data[i + run] == data[i]) {
+            run++;
+         }
+         if (run >= 3) {
+            if (literal) {
+               PutLiteral(data + i - literal, literal);
+               literal = 0;
+            }
+            Put((uint8_t) (1 - (int) run));
+            Put(data[i]);
+            i += run;
+         } else {
+            literal++;
+            i++;
+            if (literal == 128) {
+               PutLiteral(data + i - literal, literal);
+               literal = 0;
+            }
+         }
+      }
+      if (literal) {
+         PutLiteral(data + i - literal, literal);
+      }
+      Flush();
+      if (writeFailed) {
+         LOG_W("FrameStore: frame %s not stored", getHourMinString(time).c_str());
+         return 0;
+      }
+
+      FrameHeader header;
+
+      header.magic   = FRAME_MAGIC;
+      header.time    = time;
+      header.source  = source;
+      header.rawSize = size;
+      header.size    = writeOffset - sizeof(FrameHeader);
+      header.crc     = crc;
+      if (esp_partition_write(partition, slotStart, &header, sizeof(header)) != ESP_OK) {
+         return 0;
+      }
+      LOG_I("FrameStore: frame %s stored: %u -> %u bytes (%.1f %%) in %lu ms",
+         getHourMinString(time).c_str(), (unsigned) size, (unsigned) header.size,
+         header.size * 100.0 / size, (unsigned long) (millis() - start));
+      return header.size;
+   }
+
+   /* Check only the header of the slot, the frame of the hour of the time is stored from the source */
+   bool IsStored(uint32_t time, uint32_t source)
+   {
+      FrameHeader header;
+
+      return Begin() && Slots()
+         && esp_partition_read(partition, SlotOffset(time), &header, sizeof(header)) == ESP_OK
+         && header.magic == FRAME_MAGIC && header.time == time && header.source == source;
+   }
+
+   /* Load the frame of the hour of the time if it was rendered from the source forecast */
+   bool Read(uint32_t time, uint32_t source, uint8_t *data, size_t size)
+   {
+      if (!Begin() || !Slots()) {
+         return false;
+      }
+      uint32_t    start  = millis();
+      uint32_t    offset = SlotOffset(time);
+      FrameHeader header;
+
+      if (esp_partition_read(partition, offset, &header, sizeof(header)) != ESP_OK
+         || header.magic != FRAME_MAGIC || header.time != time || header.source != source
+         || header.rawSize != size || header.size > FRAME_SLOT_SIZE - sizeof(header)) {
+         return false;
+      }
+
+      const void             *mapped = NULL;
+      spi_flash_mmap_handle_t handle;
+
+      if (esp_partition_mmap(partition, offset, FRAME_SLOT_SIZE, SPI_FLASH_MMAP_DATA, &mapped, &handle) != ESP_OK) {
+         return false;
+      }
+      const uint8_t *src = (const uint8_t *) mapped + sizeof(header);
+      const uint8_t *end = src + header.size;
+      size_t         pos = 0;
+      bool           ok  = Crc32(src, header.size) == header.crc;
+
+      while (ok && src < end) {
+         int n = (int8_t) *src++;
+
+         if (n >= 0) {
+            ok = pos + n + 1 <= size && src + n + 1 <= end;
+            if (ok) {
+               memcpy(data + pos, src, n + 1);
+               pos += n + 1;
+               src += n + 1;
+            }
+         } else if (n != -128) {
+            ok = pos + 1 - n <= size && src < end;
+            if (ok) {
+               memset(data + pos, *src++, 1 - n);
+               pos += 1 - n;
+            }
+         }
+      }
+      spi_flash_munmap(handle);
+      ok = ok && pos == size;
+      LOG_I("FrameStore: frame %s %s: %u bytes in %lu ms", getHourMinString(time).c_str(),
+         ok ? "loaded" : "invalid", (unsigned) header.size, (unsigned long) (millis() - start));
+      return ok;
+   }
+};
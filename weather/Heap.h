@@ -0,0 +1,161 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Heap.h
+  * 
+  * Free heap, largest block, allocated blocks and PSRAM at the phases of a wake
+  * with the worst case of all the wakes.
+  */
+#pragma once
+#include <esp_heap_caps.h>
+#include "Log.h"
+
+/* The phases of a wake with a heap sample */
+enum HeapPhase
+{
+   HEAP_BOOT   = 0,  //!< Start of the wake
+   HEAP_WIFI   = 1,  //!< Wifi connected
+   HEAP_PARSE  = 2,  //!< Json document of the forecast parsed
+   HEAP_RENDER = 3,  //!< Canvas drawn before the push
+   HEAP_END    = 4,  //!< End of the wake
+   HEAP_PHASES = 5
+};
+
+/* One sample of the heap */
+struct HeapSample
+{
+   uint32_t freeHeap;   //!< Free internal heap
+   uint32_t largest;    //!< Largest free block of the internal heap
+   uint32_t blocks;     //!< Allocated blocks of the internal heap
+   uint32_t psramUsed;  //!< Used PSRAM
+};
+
+/* The worst case of all the wakes, part of the state */
+struct HeapWorst
+{
+   uint32_t minFree;       //!< Lowest free internal heap of a sample, 0 = unknown
+   uint32_t minLargest;    //!< Smallest largest free block of a sample
+   uint32_t lowWater;      //!< Lowest free internal heap of a wake, also between the samples
+   uint16_t maxBlocks;     //!< Most allocated internal blocks
+   uint16_t maxPsramKb;    //!< Most used PSRAM in KB
+   uint8_t  freePhase;     //!< Phase of minFree
+   uint8_t  largestPhase;  //!< Phase of minLargest
+   uint8_t  blocksPhase;   //!< Phase of maxBlocks
+   uint8_t  psramPhase;    //!< Phase of maxPsramKb
+};
+
+/**
+  * Samples of the heap of the running wake. A phase that runs more than
+  * once in a wake (e.g. the rendering) keeps its worst sample.
+  */
+class HeapMonitor
+{
+protected:
+   HeapSample samples[HEAP_PHASES];  //!< Worst sample of every phase
+   uint8_t    sampled;               //!< Bit mask of the sampled phases
+
+public:
+   HeapMonitor()
+      : sampled(0)
+   {
+      memset(samples, 0, sizeof(samples));
+   }
+
+   /* Name of the phase for the output */
+   static const char *GetPhaseName(int phase)
+   {
+      switch (phase) {
+         case HEAP_BOOT:   return "boot";
+         case HEAP_WIFI:   return "wifi";
+         case HEAP_PARSE:  return "parse";
+         case HEAP_RENDER: return "render";
+         case HEAP_END:    return "end";
+         default:          return "unknown";
+      }
+   }
+
+   /* Take a sample of the heap in the phase */
+   void Sample(HeapPhase phase)
+   {
+      multi_heap_info_t internal;
+      multi_heap_info_t psram;
+      HeapSample       &sample = samples[phase];
+      bool              first  = !(sampled & (1 << phase));
+
+      heap_caps_get_info(&internal, MALLOC_CAP_INTERNAL);
+      heap_caps_get_info(&psram,    MALLOC_CAP_SPIRAM);
+      sample.freeHeap  = first ? internal.total_free_bytes      : min(sample.freeHeap,  (uint32_t) internal.total_free_bytes);
+      sample.largest   = first ? internal.largest_free_block    : min(sample.largest,   (uint32_t) internal.largest_free_block);
+      sample.blocks    = first ? internal.allocated_blocks      : max(sample.blocks,    (uint32_t) internal.allocated_blocks);
+      sample.psramUsed = first ? psram.total_allocated_bytes    : max(sample.psramUsed, (uint32_t) psram.total_allocated_bytes);
+      sampled |= 1 << phase;
+   }
+
+   /* Merge the samples of the wake into the worst case */
+   void Store(HeapWorst &worst)
+   {
+      uint32_t lowWater = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+
+      worst.lowWater = worst.lowWater ? min(worst.lowWater, lowWater) : lowWater;
+      for (int phase = 0; phase < HEAP_PHASES; phase++) {
+         const HeapSample &sample = samples[phase];
+
+         if (!(sampled & (1 << phase))) {
+            continue;
+         }
+         if (!worst.minFree || sample.freeHeap < worst.minFree) {
+            worst.minFree   = sample.freeHeap;
+            worst.freePhase = phase;
+         }
+         if (!worst.minLargest || sample.largest < worst.minLargest) {
+            worst.minLargest   = sample.largest;
+            worst.largestPhase = phase;
+         }
+         if (sample.blocks > worst.maxBlocks) {
+            worst.maxBlocks   = min(sample.blocks, (uint32_t) 0xFFFF);
+            worst.blocksPhase = phase;
+         }
+         if (sample.psramUsed / 1024 > worst.maxPsramKb) {
+            worst.maxPsramKb = min(sample.psramUsed / 1024, (uint32_t) 0xFFFF);
+            worst.psramPhase = phase;
+         }
+      }
+   }
+
+   /* Print the samples of the wake and the worst case of all the wakes */
+   void Print(const HeapWorst &worst)
+   {
+      for (int phase = 0; phase < HEAP_PHASES; phase++) {
+         const HeapSample &sample = samples[phase];
+
+         if (sampled & (1 << phase)) {
+            LOG_I("Heap: %-6s free %3lu KB, largest %3lu KB (%2lu %% fragmented), %4lu blocks, psram %4lu KB", 
+               GetPhaseName(phase), (unsigned long) (sample.freeHeap / 1024), (unsigned long) (sample.largest / 1024),
+               (unsigned long) (sample.freeHeap ? 100 - sample.largest * 100ULL / sample.freeHeap : 0),
+               (unsigned long) sample.blocks, (unsigned long) (sample.psramUsed / 1024));
+         }
+      }
+      if (worst.minFree) {
+         LOG_I("HeapWorst: free %lu KB (%s), low water %lu KB, largest %lu KB (%s), %u blocks (%s), psram %u KB (%s)",
+            (unsigned long) (worst.minFree / 1024), GetPhaseName(worst.freePhase), (unsigned long) (worst.lowWater / 1024),
+            (unsigned long) (worst.minLargest / 1024), GetPhaseName(worst.largestPhase), 
+            (unsigned) worst.maxBlocks, GetPhaseName(worst.blocksPhase), (unsigned) worst.maxPsramKb, GetPhaseName(worst.psramPhase));
+      }
+   }
+};
+
+HeapMonitor myHeap; // Samples of the running wake, the fetch and the display add to it
@@ -0,0 +1,395 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Log.h
+  *
+  * Deferred log output: LOG_E/W/I/D store the format pointer and the binary
+  * arguments in a RAM ring, the text is only formatted and printed by FlushLog().
+  * Levels above LOG_LEVEL are removed by the compiler, the formats are still checked.
+  */
+#pragma once
+#include <type_traits>
+
+#define LOG_NONE   0
+#define LOG_ERROR  1
+#define LOG_WARN   2
+#define LOG_INFO   3
+#define LOG_DEBUG  4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL          LOG_INFO
+#endif
+#ifndef LOG_BATTERY_LEVEL
+#define LOG_BATTERY_LEVEL  LOG_WARN
+#endif
+#ifndef LOG_BUFFER_SIZE
+#define LOG_BUFFER_SIZE    8192
+#endif
+
+#define LOG_MAX_RECORD     256  // bytes of one record with the header
+#define LOG_MAX_STRING     160  // bytes of a string argument, longer ones are cut
+
+/* Only for the format check of the compiler, never called */
+inline void LogCheckFormat(const char *, ...) __attribute__((format(printf, 1, 2)));
+inline void LogCheckFormat(const char *, ...) {}
+
+#define LOG_RECORD(level, ...) do { if (false) LogCheckFormat(__VA_ARGS__); myLog.Add(level, __VA_ARGS__); } while (0)
+#define LOG_SKIP(...)          do { if (false) LogCheckFormat(__VA_ARGS__); } while (0)
+
+#if LOG_LEVEL >= LOG_ERROR
+#define LOG_E(...) LOG_RECORD(LOG_ERROR, __VA_ARGS__)
+#else
+#define LOG_E(...) LOG_SKIP(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_WARN
+#define LOG_W(...) LOG_RECORD(LOG_WARN, __VA_ARGS__)
+#else
+#define LOG_W(...) LOG_SKIP(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_INFO
+#define LOG_I(...) LOG_RECORD(LOG_INFO, __VA_ARGS__)
+#else
+#define LOG_I(...) LOG_SKIP(__VA_ARGS__)
+#endif
+#if LOG_LEVEL >= LOG_DEBUG
+#define LOG_D(...) LOG_RECORD(LOG_DEBUG, __VA_ARGS__)
+#else
+#define LOG_D(...) LOG_SKIP(__VA_ARGS__)
+#endif
+
+/* Header of a record in the ring, the packed arguments follow */
+struct LogHeader
+{
+   uint16_t    size;    //!< Bytes of the record with the header, 0 = wrap to the start of the ring
+   uint8_t     level;   //!< LOG_ERROR .. LOG_DEBUG
+   uint32_t    millis;  //!< Time of the record
+   const char *format;  //!< printf format in the flash, the newline is added by the output
+};
+
+/**
+  * Ring of the binary log records. A record costs a memcpy of the arguments
+  * instead of the formatting and the 87 us per byte of the serial port at 115200 baud.
+  * When the ring is full the oldest records are dropped and counted.
+  */
+class LogRing
+{
+protected:
+   uint8_t  ring[LOG_BUFFER_SIZE] __attribute__((aligned(8)));  //!< Records, aligned like the header
+   size_t   head;                   //!< Offset of the oldest record
+   size_t   tail;                   //!< Offset of the next record
+   size_t   used;                   //!< Bytes of the records including the skipped end before a wrap
+   uint32_t dropped;                //!< Records lost because of a full ring
+   bool     hostAttached;           //!< Somebody reads the serial output
+
+   uint8_t  record[LOG_MAX_RECORD] __attribute__((aligned(8))); //!< Record in the making
+   size_t   recordSize;             //!< Bytes of the record in the making
+   bool     recordCut;              //!< Not all arguments fitted into the record
+
+protected:
+   /* Append raw bytes to the record in the making */
+   void Put(const void *data, size_t size)
+   {
+      if (recordCut || recordSize + size > sizeof(record)) {
+         recordCut = true;
+         return;
+      }
+      memcpy(record + recordSize, data, size);
+      recordSize += size;
+   }
+
+   /* Integers and enums with 4 bytes, long long with 8 bytes */
+   template <typename T>
+   typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type PutArg(T value)
+   {
+      if (sizeof(T) <= sizeof(uint32_t)) {
+         uint32_t v = (uint32_t) value;
+
+         Put(&v, sizeof(v));
+      } else {
+         uint64_t v = (uint64_t) value;
+
+         Put(&v, sizeof(v));
+      }
+   }
+
+   /* Floats are promoted to double like by printf */
+   void PutArg(double value)
+   {
+      Put(&value, sizeof(value));
+   }
+
+   /* Strings are copied with a length byte, they may be temporaries */
+   void PutArg(const char *text)
+   {
+      size_t length = 0;
+
+      while (text && text[length] && length < LOG_MAX_STRING) {
+         length++;
+      }
+
+      uint8_t size = length;
+
+      Put(&size, sizeof(size));
+      Put(text, length);
+   }
+
+   void PutArg(const void *pointer)
+   {
+      uint64_t v = (uintptr_t) pointer;
+
+      Put(&v, sizeof(v));
+   }
+
+   void PutArgs() {}
+
+   template <typename T, typename... Args>
+   void PutArgs(T value, Args... args)
+   {
+      PutArg(value);
+      PutArgs(args...);
+   }
+
+   /* Copy the record in the making into the ring, drop the oldest records for the space */
+   void Commit()
+   {
+      size_t size = (recordSize + alignof(LogHeader) - 1) & ~(alignof(LogHeader) - 1);
+
+      ((LogHeader *) record)->size = size;
+      if (!used) {
+         head = tail = 0;
+      }
+      if (tail + size > sizeof(ring)) {
+         // the rest of the ring is skipped, a zero size marks the wrap
+         size_t skipped = sizeof(ring) - tail;
+
+         while (used && used + skipped > sizeof(ring)) {
+            Drop();
+         }
+         if (used) {
+            if (skipped >= sizeof(uint16_t)) {
+               *(uint16_t *) (ring + tail) = 0;
+            }
+            used += skipped;
+         } else {
+            head = 0;
+         }
+         tail = 0;
+      }
+      while (used && used + size > sizeof(ring)) {
+         Drop();
+      }
+      memcpy(ring + tail, record, size);
+      tail  = (tail + size) % sizeof(ring);
+      used += size;
+   }
+
+   /* Remove the oldest record */
+   void Drop()
+   {
+      Skip();
+      dropped++;
+   }
+
+   /* Advance the head over the oldest record and a wrap behind it */
+   void Skip()
+   {
+      size_t size = ((LogHeader *) (ring + head))->size;
+
+      head  = (head + size) % sizeof(ring);
+      used -= size;
+      if (used && (sizeof(ring) - head < sizeof(LogHeader) || ((LogHeader *) (ring + head))->size == 0)) {
+         used -= sizeof(ring) - head;
+         head  = 0;
+      }
+   }
+
+   /* Read the next raw argument of a record, false if the record has no more */
+   static bool Get(const uint8_t *&data, const uint8_t *end, void *value, size_t size)
+   {
+      if (data + size > end) {
+         return false;
+      }
+      memcpy(value, data, size);
+      data += size;
+      return true;
+   }
+
+   /*
+    * Format one record with the format of the record and the packed arguments.
+    * Every conversion is printed by itself with snprintf and the argument type of its spec.
+    */
+   static void Format(const LogHeader *header, char *text, size_t size)
+   {
+      const uint8_t *data   = (const uint8_t *) (header + 1);
+      const uint8_t *end    = (const uint8_t *) header + header->size;
+      const char    *format = header->format;
+      size_t         length = 0;
+
+      while (*format && length + 1 < size) {
+         if (*format != '%' || format[1] == '%') {
+            text[length++] = *format;
+            format += *format == '%' ? 2 : 1;
+            continue;
+         }
+
+         char   spec[16];
+         size_t specLength = 0;
+         int    longs      = 0;
+         bool   sized      = false;
+         char   conversion;
+
+         // flags, width, precision and length up to the conversion character
+         while ((conversion = *format) && !strchr("diouxXcsfFeEgGaAp", conversion) && specLength < sizeof(spec) - 2) {
+            longs += conversion == 'l' || conversion == 'j' || conversion == 'q';
+            sized |= conversion == 'z' || conversion == 't';
+            if (conversion == 'j' || conversion == 'q') {
+               longs++;  // 64 bit like ll
+            }
+            spec[specLength++] = *format++;
+         }
+         if (!conversion) {
+            break;
+         }
+         spec[specLength++] = *format++;
+         spec[specLength]   = 0;
+
+         char  *out  = text + length;
+         size_t rest = size - length;
+         int    printed;
+
+         if (conversion == 's') {
+            uint8_t textLength;
+            char    string[LOG_MAX_STRING + 1];
+
+            if (!Get(data, end, &textLength, sizeof(textLength)) || !Get(data, end, string, textLength)) {
+               break;
+            }
+            string[textLength] = 0;
+            printed = snprintf(out, rest, spec, string);
+         } else if (strchr("fFeEgGaA", conversion)) {
+            double value;
+
+            if (!Get(data, end, &value, sizeof(value))) {
+               break;
+            }
+            printed = snprintf(out, rest, spec, value);
+         } else if (conversion == 'p') {
+            uint64_t value;
+
+            if (!Get(data, end, &value, sizeof(value))) {
+               break;
+            }
+            printed = snprintf(out, rest, spec, (void *) (uintptr_t) value);
+         } else if (longs >= 2 || (longs == 1 && sizeof(long) > sizeof(uint32_t)) || (sized && sizeof(size_t) > sizeof(uint32_t))) {
+            uint64_t value;
+
+            if (!Get(data, end, &value, sizeof(value))) {
+               break;
+            }
+            printed = longs == 1 ? snprintf(out, rest, spec, (long) value) : snprintf(out, rest, spec, (long long) value);
+         } else {
+            uint32_t value;
+
+            if (!Get(data, end, &value, sizeof(value))) {
+               break;
+            }
+            printed = longs == 1 ? snprintf(out, rest, spec, (long) value) : snprintf(out, rest, spec, (int) value);
+         }
+         length += min((size_t) max(printed, 0), rest - 1);
+      }
+      text[length] = 0;
+   }
+
+public:
+   LogRing()
+      : head(0)
+      , tail(0)
+      , used(0)
+      , dropped(0)
+      , hostAttached(false)
+      , recordSize(0)
+      , recordCut(false)
+   {
+   }
+
+   /* Store a record with the binary arguments, a pure copy without formatting */
+   template <typename... Args>
+   void Add(uint8_t level, const char *format, Args... args)
+   {
+      LogHeader *header = (LogHeader *) record;
+
+      header->level  = level;
+      header->millis = millis();
+      header->format = format;
+      recordSize = sizeof(LogHeader);
+      recordCut  = false;
+      PutArgs(args...);
+      Commit();
+   }
+
+   /* A host reads the serial port, the output is not restricted to LOG_BATTERY_LEVEL */
+   void SetHost(bool attached)
+   {
+      hostAttached = attached;
+   }
+
+   bool IsHostAttached()
+   {
+      return hostAttached;
+   }
+
+   /* Bytes of the stored records */
+   size_t Used()
+   {
+      return used;
+   }
+
+   /* Print the records up to the level with their time and empty the ring */
+   void Drain(int level)
+   {
+      static const char levelNames[] = "-EWID";
+      char              text[256];
+
+      if (dropped) {
+         Serial.printf("%7s W Log: %u records dropped\n", "", (unsigned) dropped);
+         dropped = 0;
+      }
+      while (used) {
+         const LogHeader *header = (const LogHeader *) (ring + head);
+
+         if (header->level <= level) {
+            Format(header, text, sizeof(text));
+            Serial.printf("%3lu.%03lu %c %s\n", (unsigned long) (header->millis / 1000),
+               (unsigned long) (header->millis % 1000), levelNames[header->level], text);
+         }
+         Skip();
+      }
+      head = tail = 0;
+      Serial.flush();
+   }
+};
+
+LogRing myLog;
+
+/*
+ *  Print the stored records: all of them if a host is attached,
+ *  otherwise only the ones up to LOG_BATTERY_LEVEL.
+ */
+void FlushLog()
+{
+   myLog.Drain(myLog.IsHostAttached() ? LOG_LEVEL : LOG_BATTERY_LEVEL);
+}
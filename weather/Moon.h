@@ -22,11 +22,14 @@
 #pragma once
 #include <MoonRise.h>
 
-/* Calculate the moon rise and set with the MoonRise library */
-bool GetMoonValues(MyData &myData)
+/* Calculate the moon rise and set with the MoonRise library (default for the RTC time) */
+bool GetMoonValues(MyData &myData, time_t time = 0)
 {
    MoonRise mr;
-   time_t   time = GetRTCTime();
+
+   if (time == 0) {
+      time = GetRTCTime();
+   }
 
    mr.calculate(LATITUDE, LONGITUDE, time);
 
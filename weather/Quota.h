@@ -0,0 +1,154 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Quota.h
+  *
+  * Quota of the openweathermap calls: a token bucket in the state that
+  * spreads the calls left of the UTC day over its remaining hours.
+  */
+#pragma once
+#include <TimeLib.h>
+#include "Log.h"
+
+#define QUOTA_TOKEN  1000  // fixed point of the tokens
+
+static_assert(QUOTA_BURST * QUOTA_TOKEN <= UINT16_MAX, "QUOTA_BURST too big for the token count");
+
+/* Calls of the day and the token bucket, part of the state */
+struct QuotaState
+{
+   uint32_t refillTime;  //!< RTC time of the last refill, 0 = full bucket
+   uint16_t day;         //!< UTC day of the counted calls
+   uint16_t calls;       //!< Calls of the day
+   uint16_t tokens;      //!< Tokens of the bucket in 1/QUOTA_TOKEN
+   uint16_t denied;      //!< Calls refused by the empty bucket or the used up day
+   int16_t  offsetMin;   //!< UTC offset of the RTC in minutes from the last fetch
+};
+
+/**
+  * Every call of the provider takes a token. The tokens flow in at the rate
+  * of the calls left divided by the seconds left of the UTC day, up to
+  * QUOTA_BURST tokens for the retries in a row. So the daily limit holds
+  * even with retries, and the calls are spread over the day instead of
+  * running out before its end.
+  */
+class ApiQuota
+{
+protected:
+   /* UTC day of the RTC time */
+   static uint16_t GetDay(const QuotaState &quota, time_t time)
+   {
+      return (time - quota.offsetMin * SECS_PER_MIN) / SECS_PER_DAY;
+   }
+
+   /* Seconds until the end of the UTC day */
+   static uint32_t GetDayLeft(const QuotaState &quota, time_t time)
+   {
+      return SECS_PER_DAY - (time - quota.offsetMin * SECS_PER_MIN) % SECS_PER_DAY;
+   }
+
+   /* Start a new day and add the tokens since the last refill */
+   static void Refill(QuotaState &quota, time_t time)
+   {
+      uint16_t day = GetDay(quota, time);
+
+      if (day != quota.day) {
+         quota.day   = day;
+         quota.calls = 0;
+      }
+      if (!quota.refillTime || time < (time_t) quota.refillTime) { // first call or the clock was set back
+         quota.tokens = QUOTA_BURST * QUOTA_TOKEN;
+      } else {
+         uint64_t tokens = quota.tokens + (uint64_t) (time - quota.refillTime) * GetLeft(quota) * QUOTA_TOKEN / GetDayLeft(quota, time);
+
+         quota.tokens = min(tokens, (uint64_t) QUOTA_BURST * QUOTA_TOKEN);
+      }
+      quota.refillTime = time;
+   }
+
+public:
+   /* Calls left of the day */
+   static uint32_t GetLeft(const QuotaState &quota)
+   {
+      return quota.calls < QUOTA_DAILY ? QUOTA_DAILY - quota.calls : 0;
+   }
+
+   /* Seconds until the bucket has a token for a call, 0 = now, the end of the UTC day if the calls are used up */
+   static uint32_t GetWait(const QuotaState &quota, time_t time)
+   {
+      QuotaState next = quota;
+
+      Refill(next, time);
+      if (!GetLeft(next)) {
+         return GetDayLeft(next, time);
+      }
+      if (next.tokens >= QUOTA_TOKEN) {
+         return 0;
+      }
+      uint64_t rate = (uint64_t) GetLeft(next) * QUOTA_TOKEN; // tokens per rest of the day
+
+      return ((uint64_t) (QUOTA_TOKEN - next.tokens) * GetDayLeft(next, time) + rate - 1) / rate;
+   }
+
+   /* Is a call possible now? Checked before the wifi starts, it takes no token */
+   static bool Available(const QuotaState &quota, time_t time)
+   {
+      return !GetWait(quota, time);
+   }
+
+   /* Count a call that must wait */
+   static void Deny(QuotaState &quota)
+   {
+      quota.denied++;
+      LOG_W("Quota: call denied, %u of %u calls today, %u.%02u tokens", (unsigned) quota.calls, QUOTA_DAILY,
+         (unsigned) (quota.tokens / QUOTA_TOKEN), (unsigned) (quota.tokens % QUOTA_TOKEN / 10));
+   }
+
+   /* Take a token for a call of the provider, false if the call must wait */
+   static bool Acquire(QuotaState &quota, time_t time)
+   {
+      Refill(quota, time);
+      if (quota.tokens < QUOTA_TOKEN || !GetLeft(quota)) {
+         Deny(quota);
+         return false;
+      }
+      quota.tokens -= QUOTA_TOKEN;
+      quota.calls++;
+      return true;
+   }
+
+   /* The UTC offset of the provider, the days of the quota are UTC days */
+   static void SetOffset(QuotaState &quota, int32_t offset)
+   {
+      quota.offsetMin = offset / SECS_PER_MIN;
+   }
+
+   /* Shortest fetch interval that lasts with the calls left until the end of the UTC day */
+   static uint32_t GetInterval(const QuotaState &quota, time_t time)
+   {
+      uint32_t left = GetDay(quota, time) == quota.day ? GetLeft(quota) : QUOTA_DAILY;
+
+      return GetDayLeft(quota, time) / max(left, (uint32_t) 1);
+   }
+
+   /* Print the calls of the day */
+   static void Print(const QuotaState &quota)
+   {
+      LOG_I("Quota: %u of %u calls today, %u.%02u tokens, %u denied", (unsigned) quota.calls, QUOTA_DAILY,
+         (unsigned) (quota.tokens / QUOTA_TOKEN), (unsigned) (quota.tokens % QUOTA_TOKEN / 10), (unsigned) quota.denied);
+   }
+};
@@ -22,13 +22,19 @@
 #pragma once
 #include "Data.h"
 
-/* Read the SHT30 environment chip data */
-bool GetSHT30Values(MyData &myData)
+/* Read the SHT30 environment chip data and add it to the history if requested */
+bool GetSHT30Values(MyData &myData, bool store = true)
 {
    M5.SHT30.UpdateData();
    if(M5.SHT30.GetError() == 0) {
-      myData.sht30Temperatur = (int) M5.SHT30.GetTemperature();
-      myData.sht30Humidity   = (int) M5.SHT30.GetRelHumidity();
+      float temp     = M5.SHT30.GetTemperature();
+      float humidity = M5.SHT30.GetRelHumidity();
+      
+      myData.sht30Temperatur = (int) temp;
+      myData.sht30Humidity   = (int) humidity;
+      if (store) {
+         myData.history.Add(GetRTCTime(), (int16_t) roundf(temp * 10), (int16_t) roundf(humidity * 10), myData.state.sensor);
+      }
       return true;
    }
    return false;
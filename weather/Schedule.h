@@ -0,0 +1,350 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Schedule.h
+  *
+  * Scheduler of the refresh tasks with runtime periods.
+  */
+#pragma once
+#include <nvs.h>
+#include "Battery.h"
+
+#define SCHEDULE_EARLY        30  // a task is due this many seconds before its time
+#define SCHEDULE_MIN_SLEEP    60  // minimum sleep between two wakes
+#define SCHEDULE_ALIGN        60  // the wakes are aligned to the period plus this offset (e.g. hh:01)
+#define SCHEDULE_FRESH        60  // fetch this many seconds after the expected update of the provider
+#define SCHEDULE_MIN_CADENCE  60  // a learned update cadence down to this restarts, data younger than its half is live
+#define SCHEDULE_MAX_CADENCE  3600 // a longer cadence is not known yet (too few fetches)
+
+/**
+  * Periods of the tasks in seconds (0 = off), stored in the NVS and changeable
+  * with the serial commands "sched", "sched <task> <seconds>" and "sched reset".
+  * The last runs of the tasks are part of the state, so every wake runs the due
+  * tasks and sleeps until the next one. The runs are aligned to absolute times,
+  * the wall clock boundaries of the period or for the fetch the next update of
+  * the provider, so the wakes do not drift with the length of the wakes.
+  * In the quiet time of the QUIET_MODE the tasks are skipped until one
+  * catch-up wake with a fetch shortly before its end. The fetch interval
+  * is raised if the calls left of the quota would not last until the end of the day,
+  * and it is not due before the token bucket of the quota has a call.
+  */
+class Schedule
+{
+public:
+   uint32_t periods[TASK_COUNT];  //!< Configured periods
+   time_t   quietStart;           //!< Start of the current or next quiet time
+   time_t   quietEnd;             //!< End of the quiet time, 0 = none
+   uint32_t quotaInterval;        //!< Shortest fetch interval of the quota
+   time_t   quotaWake;            //!< First time with a call of the quota, 0 = now
+
+public:
+   Schedule()
+      : quietStart(0)
+      , quietEnd(0)
+      , quotaInterval(0)
+      , quotaWake(0)
+   {
+      Reset();
+   }
+
+   /* Name of the task for the log output and the commands */
+   static const char *GetTaskName(int task)
+   {
+      switch (task) {
+         case TASK_SENSOR:  return "sensor";
+         case TASK_CLOCK:   return "clock";
+         case TASK_WEATHER: return "weather";
+         case TASK_RENDER:  return "render";
+         case TASK_GHOST:   return "ghost";
+         default:           return "unknown";
+      }
+   }
+
+   /* Set the default periods of the Config.h */
+   void Reset()
+   {
+      periods[TASK_SENSOR]  = SCHEDULE_SENSOR;
+      periods[TASK_CLOCK]   = SCHEDULE_CLOCK;
+      periods[TASK_WEATHER] = SCHEDULE_WEATHER;
+      periods[TASK_RENDER]  = SCHEDULE_RENDER;
+      periods[TASK_GHOST]   = SCHEDULE_GHOST;
+   }
+
+   /* Load the periods from the NVS, the defaults are used if they are not stored */
+   void Load()
+   {
+      nvs_handle nvs_arg;
+      size_t     size = sizeof(periods);
+
+      if (nvs_open("Schedule", NVS_READONLY, &nvs_arg) == ESP_OK) {
+         if (nvs_get_blob(nvs_arg, "periods", periods, &size) != ESP_OK || size != sizeof(periods)) {
+            Reset();
+         }
+         nvs_close(nvs_arg);
+      }
+   }
+
+   /* Store the periods to the NVS */
+   void Save()
+   {
+      nvs_handle nvs_arg;
+
+      nvs_open("Schedule", NVS_READWRITE, &nvs_arg);
+      nvs_set_blob(nvs_arg, "periods", periods, sizeof(periods));
+      nvs_commit(nvs_arg);
+      nvs_close(nvs_arg);
+   }
+
+   /* Period of the task with the battery policy, 0 = off */
+   uint32_t GetPeriod(int task, BatteryPolicy policy)
+   {
+      if (policy == POLICY_MINIMAL || (policy == POLICY_SENSOR && task >= TASK_WEATHER)) {
+         return 0;
+      }
+      if (!periods[task] && !(policy == POLICY_SENSOR && task == TASK_SENSOR)) {
+         return 0;
+      }
+      uint32_t period = GetPolicyInterval(policy, periods[task]);
+
+      return task == TASK_WEATHER ? max(period, quotaInterval) : period;
+   }
+
+   /* Take the fetch interval that the calls left of the quota allow and the time of its next call */
+   void SetQuota(const QuotaState &quota, time_t time)
+   {
+      uint32_t wait = ApiQuota::GetWait(quota, time);
+
+      quotaInterval = ApiQuota::GetInterval(quota, time);
+      quotaWake     = wait ? time + wait : 0;
+   }
+
+   /* Find the quiet time of the QUIET_MODE that contains the time or comes next */
+   void SetQuietTime(MyData &myData, time_t time)
+   {
+      quietStart = quietEnd = 0;
+      if (QUIET_MODE == 1) {
+         time_t length = ((QUIET_END - QUIET_START + 24) % 24) * SECS_PER_HOUR;
+         time_t start  = time - time % SECS_PER_DAY + QUIET_START * SECS_PER_HOUR - SECS_PER_DAY;
+
+         while (length && start + length <= time) {
+            start += SECS_PER_DAY;
+         }
+         if (length) {
+            quietStart = start;
+            quietEnd   = start + length;
+         }
+      } else if (QUIET_MODE == 2) {
+         if (!myData.weather.Load() || !myData.weather.GetNight(time, quietStart, quietEnd)) {
+            quietStart = quietEnd = 0;
+         }
+      }
+      if (quietEnd) {
+         LOG_I("Schedule: quiet from %s to %s", getDateTimeString(quietStart).c_str(), getDateTimeString(quietEnd).c_str());
+      }
+   }
+
+   /* The catch-up wake before the end of the quiet time on a whole minute */
+   time_t GetCatchUp()
+   {
+      time_t catchUp = quietEnd - QUIET_CATCHUP;
+
+      return catchUp - catchUp % SECS_PER_MIN;
+   }
+
+   /* Is the time in the quiet time before the catch-up wake? */
+   bool IsQuiet(time_t time)
+   {
+      return quietEnd && time >= quietStart && time + SCHEDULE_EARLY < GetCatchUp();
+   }
+
+   /* 
+    *  Absolute time of the next run of the task, 0 = off. The fetch follows the update cadence
+    *  of the provider, the other tasks the nearest wall clock boundary of their period.
+    *  The BM8563 alarm has a resolution of one minute, so the time is a whole minute.
+    */
+   time_t GetNextRun(int task, const StateData &state, BatteryPolicy policy)
+   {
+      uint32_t period = GetPeriod(task, policy);
+      time_t   next   = state.lastRun[task] + period;
+
+      if (!period) {
+         return 0;
+      }
+      if (task == TASK_WEATHER && state.providerCadence > 1 && state.providerCadence <= SCHEDULE_MAX_CADENCE) {
+         time_t cadence = state.providerCadence;
+         time_t updates = (next - cadence / 2 - SCHEDULE_FRESH - (time_t) state.providerTime + cadence - 1) / cadence;
+
+         next = state.providerTime + max(updates, (time_t) 1) * cadence + SCHEDULE_FRESH;
+      } else if (period >= SCHEDULE_ALIGN) {
+         next = (next - SCHEDULE_ALIGN + period / 2) / period * period + SCHEDULE_ALIGN;
+      }
+      if (task == TASK_WEATHER) { // a denied call of the quota would only cost the wifi
+         next = max(next, quotaWake);
+      }
+      return (next + SECS_PER_MIN - 1) / SECS_PER_MIN * SECS_PER_MIN;
+   }
+
+   /* 
+    *  Bit mask of the tasks that are due at the time. The catch-up wake fetches and
+    *  refreshes and also runs the tasks that are due until the end of the quiet time.
+    */
+   int GetDueTasks(const StateData &state, time_t time, BatteryPolicy policy)
+   {
+      time_t until = time + SCHEDULE_EARLY;
+      int    due   = 0;
+
+      if (IsQuiet(time)) {
+         LOG_I("Schedule: quiet");
+         return 0;
+      }
+      if (quietEnd && time >= quietStart) {
+         until = max(until, quietEnd + SCHEDULE_ALIGN);
+         if ((time_t) state.lastRun[TASK_RENDER] < GetCatchUp() - SCHEDULE_EARLY) {
+            due |= (GetPeriod(TASK_WEATHER, policy) ? 1 << TASK_WEATHER : 0) | (GetPeriod(TASK_RENDER, policy) ? 1 << TASK_RENDER : 0);
+         }
+      }
+      for (int task = 0; task < TASK_COUNT; task++) {
+         time_t next = GetNextRun(task, state, policy);
+
+         if (next && (time < (time_t) state.lastRun[task] || until >= next)) {
+            due |= 1 << task;
+         }
+      }
+      return due;
+   }
+
+   /* 
+    *  Absolute time of the next wake for the earliest task. A wake in the quiet time 
+    *  is moved to the catch-up wake and the skipped wakes are counted once per quiet time.
+    */
+   time_t GetWakeTime(StateData &state, time_t time, BatteryPolicy policy)
+   {
+      time_t      wake     = time + (policy == POLICY_MINIMAL ? BATTERY_MINIMAL_INTERVAL : 24 * 60 * 60);
+      const char *reason   = "check";
+      uint32_t    shortest = 0;
+
+      for (int task = 0; task < TASK_COUNT; task++) {
+         time_t   run    = GetNextRun(task, state, policy);
+         uint32_t period = GetPeriod(task, policy);
+
+         if (run) {
+            LOG_I("Schedule: %-7s every %5u s, next %s (in %ld s)", GetTaskName(task), 
+               (unsigned) period, getHourMinString(run).c_str(), (long) (run - time));
+            if (run < wake) {
+               wake   = run;
+               reason = GetTaskName(task);
+            }
+            shortest = shortest ? min(shortest, period) : period;
+         }
+      }
+      if (GetPeriod(TASK_WEATHER, policy) && quotaInterval > GetPolicyInterval(policy, periods[TASK_WEATHER])) {
+         LOG_I("Schedule: the quota raises the fetch interval to %u s", (unsigned) quotaInterval);
+      }
+      if (wake < time + SCHEDULE_MIN_SLEEP) {
+         wake = (time + SCHEDULE_MIN_SLEEP + SECS_PER_MIN - 1) / SECS_PER_MIN * SECS_PER_MIN;
+      }
+      if (shortest && IsQuiet(wake)) {
+         time_t catchUp = GetCatchUp();
+
+         if ((time_t) state.quietWake != catchUp) {
+            uint32_t skipped = (catchUp - wake + shortest - 1) / shortest;
+            
+            state.quietWake     = catchUp;
+            state.quietSkips   += skipped;
+            state.quietSavedMs += skipped * (state.battery.count ? state.battery.sumWakeMs / state.battery.count : 0);
+            LOG_I("Schedule: quiet time skips %u wakes", (unsigned) skipped);
+         }
+         wake   = catchUp;
+         reason = "catch-up";
+      }
+      LOG_I("Schedule: wake at %s in %ld s for %s (policy %s)", getDateTimeString(wake).c_str(), 
+         (long) (wake - time), reason, GetPolicyName(policy));
+      state.plannedWake = wake;
+      return wake;
+   }
+
+   /* 
+    *  Learn the update cadence of the provider from the data times of the fetches:
+    *  the greatest common divisor of their differences in whole minutes, so a jitter of
+    *  the data time below half a minute does not matter. Data as old as the call is live.
+    *  A divisor down to SCHEDULE_MIN_CADENCE is a changed cadence and the learning restarts
+    *  with the last difference. A fetch without new data is counted.
+    */
+   static void AddFetch(StateData &state, time_t dataTime, time_t time)
+   {
+      if (dataTime == (time_t) state.providerTime) {
+         state.staleFetches++;
+      } else if (abs(time - dataTime) < SCHEDULE_MIN_CADENCE / 2) {
+         state.providerCadence = 1;
+      } else if (state.providerTime && dataTime > (time_t) state.providerTime) {
+         uint32_t diff = (dataTime - state.providerTime + SCHEDULE_MIN_CADENCE / 2) / SCHEDULE_MIN_CADENCE * SCHEDULE_MIN_CADENCE;
+         uint32_t a    = diff;
+         uint32_t b    = state.providerCadence > 1 ? state.providerCadence : 0;
+
+         while (b) {
+            uint32_t rest = a % b;
+            
+            a = b;
+            b = rest;
+         }
+         state.providerCadence = a <= SCHEDULE_MIN_CADENCE ? diff : a;
+      }
+      LOG_I("Schedule: data of %s is %ld s old, provider cadence %u s, %u fetches without new data", 
+         getHourMinString(dataTime).c_str(), (long) (time - dataTime), (unsigned) state.providerCadence, (unsigned) state.staleFetches);
+      state.providerTime = dataTime;
+   }
+
+   /* Print the configured periods */
+   void Print()
+   {
+      for (int task = 0; task < TASK_COUNT; task++) {
+         Serial.printf("sched %s %u\n", GetTaskName(task), (unsigned) periods[task]);
+      }
+   }
+
+   /* Execute a serial command, returns false if it is no schedule command */
+   bool Command(String line)
+   {
+      line.trim();
+      if (!line.startsWith("sched")) {
+         return false;
+      }
+      line = line.substring(5);
+      line.trim();
+      if (line == "reset") {
+         Reset();
+         Save();
+      } else if (line.length() > 0) {
+         int    space = line.indexOf(' ');
+         String name  = space > 0 ? line.substring(0, space) : line;
+         int    value = space > 0 ? line.substring(space + 1).toInt() : -1;
+         int    task  = 0;
+
+         while (task < TASK_COUNT && !(name == GetTaskName(task))) {
+            task++;
+         }
+         if (task < TASK_COUNT && value >= 0) {
+            periods[task] = value;
+            Save();
+         } else {
+            Serial.println("usage: sched [reset | <sensor|clock|weather|render|ghost> <seconds>]");
+         }
+      }
+      Print();
+      return true;
+   }
+};
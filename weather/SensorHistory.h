@@ -0,0 +1,224 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file SensorHistory.h
+  *
+  * History of the SHT30 values with hourly aggregates.
+  */
+#pragma once
+#include "FlashRing.h"
+
+/**
+  * First sample of a sector, stored in the ring header.
+  */
+struct SensorBase
+{
+   uint32_t minute;    //!< local time in minutes
+   int16_t  temp;      //!< temperature in 0.1 C
+   int16_t  humidity;  //!< humidity in 0.1 %
+};
+
+/**
+  * Difference of a sample to the previous one.
+  */
+struct SensorSample
+{
+   uint16_t minutes;   //!< minutes since the previous sample (never 0xFFFF)
+   int8_t   temp;      //!< temperature change in 0.1 C
+   int8_t   humidity;  //!< humidity change in 0.1 %
+};
+
+/**
+  * Aggregated values of one hour.
+  */
+struct SensorHour
+{
+   uint32_t hour;         //!< local time in hours, 0 = no values
+   int16_t  minTemp;      //!< min temperature in 0.1 C
+   int16_t  avgTemp;      //!< average temperature in 0.1 C
+   int16_t  maxTemp;      //!< max temperature in 0.1 C
+   int16_t  minHumidity;  //!< min humidity in 0.1 %
+   int16_t  avgHumidity;  //!< average humidity in 0.1 %
+   int16_t  maxHumidity;  //!< max humidity in 0.1 %
+};
+
+/**
+  * The aggregate of the running hour, part of the state.
+  */
+struct SensorAggregate
+{
+   SensorHour hour;         //!< min and max of the running hour
+   int32_t    sumTemp;      //!< sum of the temperatures
+   int32_t    sumHumidity;  //!< sum of the humidities
+   uint16_t   count;        //!< number of the samples
+};
+
+/**
+  * Stores every SHT30 reading as delta to the previous one in the "sensors"
+  * partition (4 bytes, about 64000 samples) and the finished hours in the
+  * "hourly" partition. The aggregate of the running hour is updated with
+  * every sample, so the history drawing only reads the hourly records.
+  */
+class SensorHistory
+{
+protected:
+   FlashRing  samples;  //!< Ring of the samples
+   FlashRing  hours;    //!< Ring of the finished hours
+   SensorBase last;     //!< The last stored sample
+   bool       begun;    //!< The last sample is read
+   bool       valid;    //!< The last sample is valid
+
+protected:
+   /* Read the last sample: the base of the current sector plus all its differences */
+   void Begin()
+   {
+      RingHeader header;
+
+      begun = true;
+      valid = samples.Header(0, header);
+      if (valid) {
+         SensorSample records[64];
+         int          index = 0;
+         int          count = 0;
+
+         memcpy(&last, header.base, sizeof(last));
+         while ((count = samples.Read(0, index, records, 64)) > 0) {
+            for (int i = 0; i < count; i++) {
+               last.minute   += records[i].minutes;
+               last.temp     += records[i].temp;
+               last.humidity += records[i].humidity;
+            }
+            index += count;
+         }
+      }
+   }
+
+   /* Store the finished hour */
+   void AddHour(SensorAggregate &aggregate)
+   {
+      SensorHour &hour = aggregate.hour;
+
+      hour.avgTemp     = aggregate.sumTemp / aggregate.count;
+      hour.avgHumidity = aggregate.sumHumidity / aggregate.count;
+      if (!hours.Append(&hour)) {
+         hours.NewSector(NULL);
+         hours.Append(&hour);
+      }
+   }
+
+public:
+   SensorHistory()
+      : samples("sensors", sizeof(SensorSample))
+      , hours("hourly", sizeof(SensorHour))
+      , begun(false)
+      , valid(false)
+   {
+      memset(&last, 0, sizeof(last));
+   }
+
+   /* Store one reading and update the aggregate of the running hour */
+   void Add(time_t time, int16_t temp, int16_t humidity, SensorAggregate &aggregate)
+   {
+      uint32_t minute = time / SECS_PER_MIN;
+      uint32_t hour   = time / SECS_PER_HOUR;
+      uint32_t start  = millis();
+
+      if (!begun) {
+         Begin();
+      }
+      if (aggregate.count && aggregate.hour.hour != hour) {
+         AddHour(aggregate);
+         aggregate.count = 0;
+      }
+      if (!aggregate.count) {
+         aggregate.hour.hour        = hour;
+         aggregate.hour.minTemp     = aggregate.hour.maxTemp     = temp;
+         aggregate.hour.minHumidity = aggregate.hour.maxHumidity = humidity;
+         aggregate.sumTemp          = aggregate.sumHumidity      = 0;
+      }
+      aggregate.hour.minTemp     = min(aggregate.hour.minTemp,     temp);
+      aggregate.hour.maxTemp     = max(aggregate.hour.maxTemp,     temp);
+      aggregate.hour.minHumidity = min(aggregate.hour.minHumidity, humidity);
+      aggregate.hour.maxHumidity = max(aggregate.hour.maxHumidity, humidity);
+      aggregate.sumTemp         += temp;
+      aggregate.sumHumidity     += humidity;
+      aggregate.count++;
+
+      SensorSample sample;
+      int          dTemp     = temp - last.temp;
+      int          dHumidity = humidity - last.humidity;
+
+      sample.minutes  = minute - last.minute;
+      sample.temp     = dTemp;
+      sample.humidity = dHumidity;
+      // a new sector starts with an absolute base if the difference does not fit
+      if (!valid || minute < last.minute || minute - last.minute >= 0xFFFF
+         || dTemp < -128 || dTemp > 127 || dHumidity < -128 || dHumidity > 127
+         || !samples.Append(&sample)) {
+         SensorBase base = { minute, temp, humidity };
+
+         valid = samples.NewSector(&base);
+      }
+      last.minute   = minute;
+      last.temp     = temp;
+      last.humidity = humidity;
+      LOG_I("SensorHistory: %.1f C %.1f %% stored in %lu ms", temp / 10.0, humidity / 10.0,
+         (unsigned long) (millis() - start));
+   }
+
+   /*
+    *  Fill the hours that end with the hour of the time, the oldest first.
+    *  Hours without values have the hour 0. Returns the number of hours with values.
+    */
+   int GetHours(SensorHour *result, int count, time_t time, const SensorAggregate &aggregate)
+   {
+      uint32_t last  = time / SECS_PER_HOUR;
+      uint32_t first = last - count + 1;
+      int      found = 0;
+
+      memset(result, 0, count * sizeof(SensorHour));
+      for (int age = 0; age < hours.Sectors(); age++) {
+         SensorHour records[32];
+         int        index  = 0;
+         int        read   = 0;
+         bool       older  = false;
+
+         while ((read = hours.Read(age, index, records, 32)) > 0) {
+            for (int i = 0; i < read; i++) {
+               if (records[i].hour >= first && records[i].hour <= last) {
+                  result[records[i].hour - first] = records[i];
+                  found++;
+               }
+               older = older || records[i].hour < first;
+            }
+            index += read;
+         }
+         if (index == 0 || older) { // the older sectors are before the first hour
+            break;
+         }
+      }
+      if (aggregate.count && aggregate.hour.hour >= first && aggregate.hour.hour <= last) {
+         SensorHour &hour = result[aggregate.hour.hour - first];
+
+         hour             = aggregate.hour;
+         hour.avgTemp     = aggregate.sumTemp / aggregate.count;
+         hour.avgHumidity = aggregate.sumHumidity / aggregate.count;
+         found++;
+      }
+      return found;
+   }
+};
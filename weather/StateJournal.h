@@ -0,0 +1,172 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file StateJournal.h
+  *
+  * Append-only journal of the state record in a flash partition.
+  */
+#pragma once
+#include <esp_partition.h>
+#include "FrameStore.h"
+#include "Log.h"
+#include "Utils.h"
+
+#define STATE_ENTRY_MAGIC  0x4A53  // "SJ"
+#define STATE_ENTRY_SIZE   256
+
+/**
+  * Header in front of every journal entry.
+  */
+struct StateEntryHeader
+{
+   uint16_t magic;     //!< STATE_ENTRY_MAGIC
+   uint16_t version;   //!< Version of the record
+   uint16_t size;      //!< Size of the record
+   uint16_t reserved;  //!< Always 0xFFFF
+   uint32_t sequence;  //!< Increasing number of the entry
+   uint32_t crc;       //!< crc32 of the header fields before it and the record
+};
+
+/**
+  * Every save appends one CRC protected entry with the complete record to the
+  * next free slot of the partition. The partition is used as a ring, a sector
+  * is only erased when the journal enters it, so the flash wears evenly and a
+  * save costs one write (plus one sector erase every 16th save).
+  * The load scans for the valid entry with the highest sequence number.
+  */
+class StateJournal
+{
+protected:
+   const char            *label;       //!< Name of the partition
+   const esp_partition_t *partition;   //!< The partition or NULL
+   uint32_t               sequence;    //!< Sequence of the last valid entry
+   uint32_t               lastOffset;  //!< Offset of the last valid entry
+   bool                   found;       //!< A valid entry was found
+
+protected:
+   /* Is the slot unused since the last erase? */
+   bool IsBlank(const uint8_t *slot)
+   {
+      for (int i = 0; i < STATE_ENTRY_SIZE; i++) {
+         if (slot[i] != 0xFF) {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   /* CRC of the entry: the header without the crc, so a corrupted sequence cannot win the load, and the record */
+   static uint32_t EntryCrc(const StateEntryHeader *header, const void *data)
+   {
+      return Crc32(data, header->size, Crc32(header, offsetof(StateEntryHeader, crc)));
+   }
+
+public:
+   StateJournal(const char *l)
+      : label(l)
+      , partition(NULL)
+      , sequence(0)
+      , lastOffset(0)
+      , found(false)
+   {
+   }
+
+   /*
+    *  Load the last valid record. A record with another version or size is
+    *  copied as far as both sizes allow, so new members must be appended.
+    */
+   bool Load(void *data, size_t size, uint16_t &version)
+   {
+      partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+      if (!partition) {
+         LOG_E("StateJournal: partition %s not found", label);
+         return false;
+      }
+
+      uint32_t                start  = millis();
+      const void             *mapped = NULL;
+      spi_flash_mmap_handle_t handle;
+
+      if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &handle) != ESP_OK) {
+         return false;
+      }
+      found = false;
+      for (uint32_t offset = 0; offset < partition->size; offset += STATE_ENTRY_SIZE) {
+         const uint8_t          *slot   = (const uint8_t *) mapped + offset;
+         const StateEntryHeader *header = (const StateEntryHeader *) slot;
+
+         if (header->magic == STATE_ENTRY_MAGIC && header->size <= STATE_ENTRY_SIZE - sizeof(StateEntryHeader)
+            && (!found || header->sequence > sequence)
+            && EntryCrc(header, slot + sizeof(StateEntryHeader)) == header->crc) {
+            found      = true;
+            sequence   = header->sequence;
+            lastOffset = offset;
+            version    = header->version;
+            memset(data, 0, size);
+            memcpy(data, slot + sizeof(StateEntryHeader), min((size_t) header->size, size));
+         }
+      }
+      spi_flash_munmap(handle);
+      LOG_I("StateJournal: %s entry %u at 0x%05x in %lu ms", found ? "loaded" : "no valid",
+         (unsigned) sequence, (unsigned) lastOffset, (unsigned long) (millis() - start));
+      return found;
+   }
+
+   /* Append the record as the next entry */
+   bool Save(const void *data, size_t size, uint16_t version)
+   {
+      if (!partition || size > STATE_ENTRY_SIZE - sizeof(StateEntryHeader)) {
+         return false;
+      }
+      uint32_t start  = millis();
+      uint32_t offset = found ? (lastOffset + STATE_ENTRY_SIZE) % partition->size : 0;
+      uint8_t  slot[STATE_ENTRY_SIZE];
+      bool     erase  = offset % FLASH_SECTOR_SIZE == 0;
+
+      if (!erase) { // an interrupted save could have left a used slot
+         esp_partition_read(partition, offset, slot, sizeof(slot));
+         if (!IsBlank(slot)) {
+            offset = (offset - offset % FLASH_SECTOR_SIZE + FLASH_SECTOR_SIZE) % partition->size;
+            erase  = true;
+         }
+      }
+      if (erase && esp_partition_erase_range(partition, offset, FLASH_SECTOR_SIZE) != ESP_OK) {
+         return false;
+      }
+
+      StateEntryHeader header;
+
+      header.magic    = STATE_ENTRY_MAGIC;
+      header.version  = version;
+      header.size     = size;
+      header.reserved = 0xFFFF;
+      header.sequence = found ? sequence + 1 : 1;
+      header.crc      = EntryCrc(&header, data);
+      memset(slot, 0xFF, sizeof(slot));
+      memcpy(slot, &header, sizeof(header));
+      memcpy(slot + sizeof(header), data, size);
+      if (esp_partition_write(partition, offset, slot, sizeof(header) + size) != ESP_OK) {
+         return false;
+      }
+      found      = true;
+      sequence   = header.sequence;
+      lastOffset = offset;
+      LOG_I("StateJournal: entry %u saved at 0x%05x in %lu ms%s", (unsigned) sequence,
+         (unsigned) offset, (unsigned long) (millis() - start), erase ? " (sector erased)" : "");
+      return true;
+   }
+};
@@ -0,0 +1,109 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Stats.h
+  * 
+  * Latency and cpu statistics of the always on mode.
+  */
+#pragma once
+
+/* The kinds of the updates in the event loop */
+enum UpdateKind
+{
+   UPDATE_CLOCK  = 0,  //!< Clock line every minute
+   UPDATE_SENSOR = 1,  //!< SHT30 line on a change
+   UPDATE_TASKS  = 2,  //!< Due tasks of the scheduler
+   UPDATE_PAGE   = 3,  //!< Page after a button press
+   UPDATE_TOUCH  = 4,  //!< Page after a touch
+   UPDATE_KINDS  = 5
+};
+
+/**
+  * Collects the latency of every update kind and the busy time of the 
+  * event loop, the rest of the time the loop waits in delay().
+  */
+class UpdateStats
+{
+protected:
+   uint32_t count[UPDATE_KINDS];  //!< Number of the updates
+   uint32_t sumMs[UPDATE_KINDS];  //!< Sum of the latencies
+   uint32_t maxMs[UPDATE_KINDS];  //!< Slowest update
+   uint32_t busyMs;               //!< Time of the loop without the waiting
+   uint32_t startMs;              //!< Start of the statistics
+
+public:
+   UpdateStats()
+      : busyMs(0)
+      , startMs(0)
+   {
+      memset(count, 0, sizeof(count));
+      memset(sumMs, 0, sizeof(sumMs));
+      memset(maxMs, 0, sizeof(maxMs));
+   }
+
+   /* Name of the update kind for the output */
+   static const char *GetKindName(int kind)
+   {
+      switch (kind) {
+         case UPDATE_CLOCK:  return "clock";
+         case UPDATE_SENSOR: return "sensor";
+         case UPDATE_TASKS:  return "tasks";
+         case UPDATE_PAGE:   return "page";
+         case UPDATE_TOUCH:  return "touch";
+         default:            return "unknown";
+      }
+   }
+
+   /* Start a new period of the statistics */
+   void Reset()
+   {
+      memset(count, 0, sizeof(count));
+      memset(sumMs, 0, sizeof(sumMs));
+      memset(maxMs, 0, sizeof(maxMs));
+      busyMs  = 0;
+      startMs = millis();
+   }
+
+   /* Add the latency of one update */
+   void Add(UpdateKind kind, uint32_t ms)
+   {
+      count[kind]++;
+      sumMs[kind] += ms;
+      maxMs[kind]  = max(maxMs[kind], ms);
+   }
+
+   /* Add the busy time of one pass of the loop */
+   void AddBusy(uint32_t ms)
+   {
+      busyMs += ms;
+   }
+
+   /* Print the latencies and the cpu utilization since the reset */
+   void Print()
+   {
+      uint32_t elapsed = max((uint32_t) (millis() - startMs), (uint32_t) 1);
+
+      Serial.printf("Stats: %lu s, cpu %lu.%lu %%\n", (unsigned long) (elapsed / 1000), 
+         (unsigned long) (busyMs * 100ULL / elapsed), (unsigned long) (busyMs * 1000ULL / elapsed % 10));
+      for (int kind = 0; kind < UPDATE_KINDS; kind++) {
+         if (count[kind]) {
+            Serial.printf("Stats: %-6s %4lu updates, avg %5lu ms, max %5lu ms\n", GetKindName(kind), 
+               (unsigned long) count[kind], (unsigned long) (sumMs[kind] / count[kind]), (unsigned long) maxMs[kind]);
+         }
+      }
+   }
+};
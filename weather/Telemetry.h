@@ -0,0 +1,192 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Telemetry.h
+  *
+  * Binary telemetry record per wake, collected in the "telemetry" partition
+  * and uploaded in batches to a collector while the wifi is up for a fetch.
+  */
+#pragma once
+#include <HTTPClient.h>
+#include <WiFiClient.h>
+#include "FlashRing.h"
+#include "Log.h"
+
+#define TELEMETRY_MAGIC    0x314D4C54  // "TLM1"
+#define TELEMETRY_VERSION  1
+
+#define TELEMETRY_FETCHED       0x01  // the weather was fetched
+#define TELEMETRY_FETCH_FAILED  0x02  // the fetch failed
+#define TELEMETRY_USB           0x04  // the M5Paper was on usb power
+
+/**
+  * One wake, little endian like the upload.
+  */
+struct __attribute__((packed)) TelemetryRecord
+{
+   uint32_t time;        //!< RTC time of the end of the wake
+   uint16_t wakeMs;      //!< Duration of the wake
+   uint16_t radioMs;     //!< Wifi on time of the wake
+   uint16_t fetchMs;     //!< Request until the parsed forecast, 0 = no fetch
+   uint16_t renderMs;    //!< Drawing of the pushed canvases
+   uint16_t millivolt;   //!< Battery voltage
+   int8_t   rssi;        //!< Wifi signal strength, 0 = no wifi
+   uint8_t  reason;      //!< WakeReason
+   uint8_t  flags;       //!< TELEMETRY_FETCHED, ...
+   uint8_t  policy;      //!< BatteryPolicy
+   uint16_t minFreeKb;   //!< Low water mark of the internal heap
+};
+
+/**
+  * Head of an upload, the records follow.
+  */
+struct __attribute__((packed)) TelemetryBatch
+{
+   uint32_t magic;       //!< TELEMETRY_MAGIC
+   uint8_t  version;     //!< TELEMETRY_VERSION
+   uint8_t  recordSize;  //!< sizeof(TelemetryRecord)
+   uint16_t count;       //!< Number of the records
+   uint8_t  device[6];   //!< Wifi MAC address of the M5Paper
+   uint16_t pending;     //!< Records left for the next upload
+};
+
+/**
+  * Appends one record per wake and uploads the records newer than the last
+  * upload with one http POST. The sectors carry the time of their first
+  * record, so the upload skips the sectors that are already sent.
+  */
+class Telemetry
+{
+protected:
+   FlashRing records;  //!< Ring of the records
+   uint8_t   batch[sizeof(TelemetryBatch) + TELEMETRY_BATCH * sizeof(TelemetryRecord)]; //!< Body of the upload
+
+   /* Time of the first record of the sector that is age sectors older than the current, 0 = none */
+   uint32_t FirstTime(int age)
+   {
+      RingHeader header;
+      uint32_t   time = 0;
+
+      if (age >= 0 && records.Header(age, header)) {
+         memcpy(&time, header.base, sizeof(time));
+      }
+      return time;
+   }
+
+   /* Collect the oldest records after the time into the batch, returns the number of the records left */
+   int Collect(uint32_t sent, uint16_t &count)
+   {
+      TelemetryRecord *batchRecords = (TelemetryRecord *) (batch + sizeof(TelemetryBatch));
+      int              pending      = 0;
+
+      count = 0;
+      if (!records.Begin()) {
+         return 0;
+      }
+      for (int age = records.Sectors() - 1; age >= 0; age--) {
+         uint32_t newer = FirstTime(age - 1);
+
+         if (!FirstTime(age) || (newer && newer <= sent)) {
+            continue; // missing or completely sent
+         }
+         for (int index = 0; index < records.Capacity(); ) {
+            TelemetryRecord read[12];
+            int             found = records.Read(age, index, read, 12);
+
+            for (int i = 0; i < found; i++) {
+               if (read[i].time <= sent) {
+                  continue;
+               }
+               if (count < TELEMETRY_BATCH) {
+                  batchRecords[count++] = read[i];
+               } else {
+                  pending++;
+               }
+            }
+            if (found < 12) {
+               break;
+            }
+            index += found;
+         }
+      }
+      return pending;
+   }
+
+public:
+   Telemetry()
+      : records("telemetry", sizeof(TelemetryRecord))
+   {
+   }
+
+   /* Store the record of the wake, a new sector starts with the time of its first record */
+   void Add(const TelemetryRecord &record)
+   {
+      if (!records.Append(&record)) {
+         uint8_t base[8] = { 0 };
+
+         memcpy(base, &record.time, sizeof(record.time));
+         records.NewSector(base);
+         records.Append(&record);
+      }
+   }
+
+   /*
+    *  Upload the records after the time of the last upload with the open wifi connection.
+    *  The time advances only with an accepted upload, a failed one is repeated with the next fetch.
+    */
+   bool Upload(uint32_t &sent)
+   {
+      if (!strlen(TELEMETRY_SRV)) {
+         return false;
+      }
+      uint32_t        start  = millis();
+      TelemetryBatch *header = (TelemetryBatch *) batch;
+      uint16_t        count;
+      int             pending = Collect(sent, count);
+
+      if (!count) {
+         return true;
+      }
+      header->magic      = TELEMETRY_MAGIC;
+      header->version    = TELEMETRY_VERSION;
+      header->recordSize = sizeof(TelemetryRecord);
+      header->count      = count;
+      header->pending    = min(pending, 0xFFFF);
+      WiFi.macAddress(header->device);
+
+      WiFiClient client;
+      HTTPClient http;
+      size_t     size = sizeof(TelemetryBatch) + count * sizeof(TelemetryRecord);
+
+      http.setConnectTimeout(TELEMETRY_TIMEOUT_MS);
+      http.setTimeout(TELEMETRY_TIMEOUT_MS);
+      http.begin(client, TELEMETRY_SRV, TELEMETRY_PORT, "/telemetry");
+      http.addHeader("Content-Type", "application/octet-stream");
+
+      int httpCode = http.POST(batch, size);
+
+      http.end();
+      if (httpCode != HTTP_CODE_OK && httpCode != HTTP_CODE_NO_CONTENT) {
+         LOG_W("Telemetry: upload of %u records failed, error: %s", (unsigned) count, http.errorToString(httpCode).c_str());
+         return false;
+      }
+      sent = ((TelemetryRecord *) (batch + sizeof(TelemetryBatch)))[count - 1].time;
+      LOG_I("Telemetry: %u records (%u bytes) sent in %lu ms, %d pending", (unsigned) count, (unsigned) size,
+         (unsigned long) (millis() - start), pending);
+      return true;
+   }
+};
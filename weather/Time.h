@@ -20,6 +20,7 @@
   * Helper function to set the internal RTC date and time.
   */
 #pragma once
+#include "Log.h"
 
 /* Set the internal RTC clock with the weather timestamp */
 bool SetRTCDateTime(MyData &myData)
@@ -30,7 +31,7 @@ bool SetRTCDateTime(MyData &myData)
       rtc_time_t RTCtime;
       rtc_date_t RTCDate;
    
-      Serial.println("Epochtime: " + String(time));
+      LOG_I("Epochtime: %ld", (long) time);
       
       RTCDate.year = year(time);
       RTCDate.mon  = month(time);
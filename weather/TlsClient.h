@@ -0,0 +1,377 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file TlsClient.h
+  *
+  * Https transport of the weather fetch on mbedtls, the tls session of the
+  * last fetch is kept in the NVS and resumed by the next wake.
+  */
+#pragma once
+#include <WiFiClient.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/error.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/ssl.h>
+#include <nvs.h>
+#include "Log.h"
+
+#define TLS_SESSION_SIZE  2048  // max. bytes of a stored session with its ticket
+
+/* mbedtls state of an open connection, only allocated while it is open */
+struct TlsContext
+{
+   mbedtls_entropy_context  entropy;
+   mbedtls_ctr_drbg_context drbg;
+   mbedtls_x509_crt         ca;
+   mbedtls_ssl_config       config;
+   mbedtls_ssl_context      ssl;
+   mbedtls_ssl_session      session;
+   uint8_t                  stored[TLS_SESSION_SIZE];  //!< Session of the NVS
+   size_t                   storedSize;                //!< Size of the stored session, 0 = none
+   uint8_t                  buffer[TLS_SESSION_SIZE];  //!< Session after the handshake
+};
+
+/**
+  * Tls client for the HTTPClient. The WiFiClientSecure of the ESP32 cannot
+  * keep a session beyond the deep sleep, so every fetch costs a full handshake:
+  * about a second of the ESP32 crypto with the radio on. This client stores the
+  * session (with the session ticket of the server) in the NVS and offers it with
+  * the next connect, a resumed handshake needs one round trip and no public key
+  * operation. A failed resumption drops the stored session.
+  */
+class TlsClient : public WiFiClient
+{
+protected:
+   const char *name;         //!< NVS key of the session
+   const char *caCert;       //!< PEM of the root CA, "" = not verified with OPENWEATHER_TLS_INSECURE
+   WiFiClient  socket;       //!< Tcp connection
+   TlsContext *tls;          //!< mbedtls state, NULL = not connected
+   int         peeked;       //!< Byte of peek(), -1 = none
+   uint32_t    handshakeMs;  //!< Duration of the last handshake
+   bool        resumed;      //!< The last handshake resumed the stored session
+   bool        secured;      //!< The handshake of the connection is done
+
+   /* Send callback of mbedtls */
+   static int Send(void *ctx, const unsigned char *buf, size_t len)
+   {
+      size_t sent = ((WiFiClient *) ctx)->write(buf, len);
+
+      return sent ? sent : MBEDTLS_ERR_NET_SEND_FAILED;
+   }
+
+   /* Receive callback of mbedtls, waits up to the timeout for the first byte, 0 = closed by the server */
+   static int Receive(void *ctx, unsigned char *buf, size_t len, uint32_t timeout)
+   {
+      WiFiClient *socket = (WiFiClient *) ctx;
+
+      ((Stream *) socket)->setTimeout(timeout); // not the seconds of the WiFiClient
+      if (socket->readBytes(buf, 1) != 1) {
+         return socket->connected() ? MBEDTLS_ERR_SSL_TIMEOUT : 0;
+      }
+
+      int more = min(socket->available(), (int) len - 1);
+
+      more = more > 0 ? socket->read(buf + 1, more) : 0;
+      return 1 + max(more, 0);
+   }
+
+   /* Certificate callback of mbedtls, only a full handshake checks the certificate */
+   static int Verify(void *ctx, mbedtls_x509_crt *, int, uint32_t *)
+   {
+      ((TlsClient *) ctx)->resumed = false;
+      return 0;
+   }
+
+   void LogError(const char *action, int ret)
+   {
+      char text[80];
+
+      mbedtls_strerror(ret, text, sizeof(text));
+      LOG_E("TlsClient: %s of %s failed, %s", action, name, text);
+   }
+
+   /* Configure the client side of mbedtls */
+   int Setup(const char *host)
+   {
+      int ret;
+
+      mbedtls_entropy_init(&tls->entropy);
+      mbedtls_ctr_drbg_init(&tls->drbg);
+      mbedtls_x509_crt_init(&tls->ca);
+      mbedtls_ssl_config_init(&tls->config);
+      mbedtls_ssl_init(&tls->ssl);
+      mbedtls_ssl_session_init(&tls->session);
+      if ((ret = mbedtls_ctr_drbg_seed(&tls->drbg, mbedtls_entropy_func, &tls->entropy, (const unsigned char *) name, strlen(name))) != 0
+         || (ret = mbedtls_ssl_config_defaults(&tls->config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+         return ret;
+      }
+      if (caCert[0] || !OPENWEATHER_TLS_INSECURE) { // an empty CA fails the parse, no request without the verification
+         if ((ret = mbedtls_x509_crt_parse(&tls->ca, (const unsigned char *) caCert, strlen(caCert) + 1)) != 0) {
+            return ret;
+         }
+         mbedtls_ssl_conf_ca_chain(&tls->config, &tls->ca, NULL);
+         mbedtls_ssl_conf_authmode(&tls->config, MBEDTLS_SSL_VERIFY_REQUIRED);
+      } else {
+         mbedtls_ssl_conf_authmode(&tls->config, MBEDTLS_SSL_VERIFY_OPTIONAL);
+      }
+      mbedtls_ssl_conf_rng(&tls->config, mbedtls_ctr_drbg_random, &tls->drbg);
+      mbedtls_ssl_conf_verify(&tls->config, Verify, this);
+#ifdef MBEDTLS_SSL_SESSION_TICKETS
+      mbedtls_ssl_conf_session_tickets(&tls->config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+      if ((ret = mbedtls_ssl_setup(&tls->ssl, &tls->config)) != 0 || (ret = mbedtls_ssl_set_hostname(&tls->ssl, host)) != 0) {
+         return ret;
+      }
+      mbedtls_ssl_set_bio(&tls->ssl, &socket, Send, NULL, Receive);
+      return 0;
+   }
+
+   /* Offer the stored session to the server */
+   void LoadSession()
+   {
+      nvs_handle nvs_arg;
+
+      tls->storedSize = sizeof(tls->stored);
+      if (nvs_open("TlsSession", NVS_READONLY, &nvs_arg) != ESP_OK) {
+         tls->storedSize = 0;
+         return;
+      }
+      if (nvs_get_blob(nvs_arg, name, tls->stored, &tls->storedSize) != ESP_OK || tls->storedSize > sizeof(tls->stored)) {
+         tls->storedSize = 0;
+      }
+      nvs_close(nvs_arg);
+      if (tls->storedSize && (mbedtls_ssl_session_load(&tls->session, tls->stored, tls->storedSize) != 0
+         || mbedtls_ssl_set_session(&tls->ssl, &tls->session) != 0)) {
+         LOG_W("TlsClient: stored session of %s is invalid", name);
+         DropSession();
+      }
+   }
+
+   /* Store the session of the handshake if it differs from the stored one, e.g. a new ticket */
+   void SaveSession()
+   {
+      nvs_handle nvs_arg;
+      size_t     size = 0;
+
+      if (mbedtls_ssl_get_session(&tls->ssl, &tls->session) != 0
+         || mbedtls_ssl_session_save(&tls->session, tls->buffer, sizeof(tls->buffer), &size) != 0) {
+         LOG_W("TlsClient: session of %s not stored (%u bytes)", name, (unsigned) size);
+         return;
+      }
+      if (size == tls->storedSize && !memcmp(tls->buffer, tls->stored, size)) {
+         return;
+      }
+      nvs_open("TlsSession", NVS_READWRITE, &nvs_arg);
+      nvs_set_blob(nvs_arg, name, tls->buffer, size);
+      nvs_commit(nvs_arg);
+      nvs_close(nvs_arg);
+   }
+
+   /* Forget the stored session, the next connect makes a full handshake */
+   void DropSession()
+   {
+      nvs_handle nvs_arg;
+
+      tls->storedSize = 0;
+      if (nvs_open("TlsSession", NVS_READWRITE, &nvs_arg) == ESP_OK) {
+         nvs_erase_key(nvs_arg, name);
+         nvs_commit(nvs_arg);
+         nvs_close(nvs_arg);
+      }
+   }
+
+   /* Read timeout of mbedtls from the stream timeout, 0 would wait forever */
+   void SetReadTimeout()
+   {
+      mbedtls_ssl_conf_read_timeout(&tls->config, max((uint32_t) getTimeout(), (uint32_t) 1));
+   }
+
+public:
+   TlsClient(const char *n, const char *ca)
+      : name(n)
+      , caCert(ca)
+      , tls(NULL)
+      , peeked(-1)
+      , handshakeMs(0)
+      , resumed(false)
+      , secured(false)
+   {
+   }
+
+   ~TlsClient()
+   {
+      stop();
+   }
+
+   int connect(const char *host, uint16_t port) override
+   {
+      return connect(host, port, (int32_t) getTimeout());
+   }
+
+   /* Tcp connect and handshake within the timeout, the stored session is resumed if the server accepts it */
+   int connect(const char *host, uint16_t port, int32_t timeout) override
+   {
+      uint32_t start = millis();
+      int      ret;
+
+      stop();
+      if (!socket.connect(host, port, timeout)) {
+         return 0;
+      }
+      if (!(tls = (TlsContext *) calloc(1, sizeof(TlsContext)))) {
+         LOG_E("TlsClient: no memory for %s", name);
+         stop();
+         return 0;
+      }
+      if ((ret = Setup(host)) != 0) {
+         LogError("setup", ret);
+         stop();
+         return 0;
+      }
+      LoadSession();
+
+      uint32_t handshakeStart = millis();
+
+      resumed = tls->storedSize > 0;
+      mbedtls_ssl_conf_read_timeout(&tls->config, max(timeout - (int32_t) (handshakeStart - start), (int32_t) 1));
+      while ((ret = mbedtls_ssl_handshake(&tls->ssl)) == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+      }
+      handshakeMs = millis() - handshakeStart;
+      if (ret != 0) {
+         LogError(resumed ? "resumed handshake" : "handshake", ret);
+         if (resumed) {
+            DropSession();
+         }
+         stop();
+         return 0;
+      }
+      if (!resumed && !caCert[0]) {
+         LOG_W("TlsClient: the certificate of %s is not verified, no CA", host);
+      }
+      LOG_D("TlsClient: %s handshake with %s in %lu ms", resumed ? "resumed" : "full", host, (unsigned long) handshakeMs);
+      secured = true;
+      SaveSession();
+      return 1;
+   }
+
+   void stop() override
+   {
+      if (tls) {
+         if (secured && socket.connected()) {
+            mbedtls_ssl_close_notify(&tls->ssl);
+         }
+         mbedtls_ssl_session_free(&tls->session);
+         mbedtls_ssl_free(&tls->ssl);
+         mbedtls_ssl_config_free(&tls->config);
+         mbedtls_x509_crt_free(&tls->ca);
+         mbedtls_ctr_drbg_free(&tls->drbg);
+         mbedtls_entropy_free(&tls->entropy);
+         free(tls);
+         tls = NULL;
+      }
+      socket.stop();
+      peeked  = -1;
+      secured = false;
+   }
+
+   uint8_t connected() override
+   {
+      return tls && (socket.connected() || available());
+   }
+
+   size_t write(uint8_t c) override { return write(&c, 1); }
+   size_t write(const uint8_t *data, size_t size) override
+   {
+      size_t sent = 0;
+
+      while (tls && sent < size) {
+         int ret = mbedtls_ssl_write(&tls->ssl, data + sent, size - sent);
+
+         if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+         }
+         if (ret <= 0) {
+            LogError("write", ret);
+            break;
+         }
+         sent += ret;
+      }
+      return sent;
+   }
+   using Print::write;
+
+   /* Decrypted bytes without a wait, a record on the socket is decrypted first */
+   int available() override
+   {
+      if (!tls) {
+         return 0;
+      }
+      if (!mbedtls_ssl_get_bytes_avail(&tls->ssl) && socket.available()) {
+         SetReadTimeout();
+         mbedtls_ssl_read(&tls->ssl, NULL, 0);
+      }
+      return mbedtls_ssl_get_bytes_avail(&tls->ssl) + (peeked >= 0);
+   }
+
+   int read() override
+   {
+      uint8_t c;
+
+      return read(&c, 1) == 1 ? c : -1;
+   }
+
+   /* Blocks up to the stream timeout like the WiFiClient, -1 at the timeout or the end */
+   int read(uint8_t *data, size_t size) override
+   {
+      if (!tls || !size) {
+         return tls ? 0 : -1;
+      }
+      if (peeked >= 0) {
+         data[0] = peeked;
+         peeked  = -1;
+         return 1;
+      }
+      SetReadTimeout();
+
+      int ret = mbedtls_ssl_read(&tls->ssl, data, size);
+
+      return ret > 0 ? ret : -1;
+   }
+
+   int peek() override
+   {
+      uint8_t c;
+
+      if (peeked < 0 && read(&c, 1) == 1) {
+         peeked = c;
+      }
+      return peeked;
+   }
+
+   /* Duration of the last handshake */
+   uint32_t GetHandshakeMillis()
+   {
+      return handshakeMs;
+   }
+
+   /* Did the last handshake resume the stored session? */
+   bool IsResumed()
+   {
+      return resumed;
+   }
+};
@@ -22,22 +22,128 @@
 #pragma once
 #include <Time.h>
 #include <TimeLib.h> 
+#include "Log.h"
+
+/**
+  * Short text in a fixed buffer, it lives on the stack of the caller
+  * so the formatting needs no heap. Longer texts are truncated.
+  */
+class SmallString
+{
+protected:
+   char   text[32];  //!< Text with the termination
+   size_t used;      //!< Length of the text
+
+public:
+   SmallString()
+      : used(0)
+   {
+      text[0] = 0;
+   }
+
+   SmallString(const char *s)
+      : used(0)
+   {
+      text[0] = 0;
+      Append(s);
+   }
+
+   const char *c_str() const          { return text; }
+   operator const char *() const      { return text; }
+   size_t      length() const         { return used; }
+
+   /* Append one character */
+   SmallString &Append(char c)
+   {
+      if (used < sizeof(text) - 1) {
+         text[used++] = c;
+         text[used]   = 0;
+      }
+      return *this;
+   }
+
+   /* Append a text */
+   SmallString &Append(const char *s)
+   {
+      while (*s) {
+         Append(*s++);
+      }
+      return *this;
+   }
+
+   /* Append a number with at least digits characters and leading zeros */
+   SmallString &AppendNumber(int value, int digits = 1)
+   {
+      char     reverse[12];
+      int      count = 0;
+      unsigned rest  = value < 0 ? -value : value;
+
+      do {
+         reverse[count++] = '0' + rest % 10;
+         rest /= 10;
+      } while (rest && count < (int) sizeof(reverse));
+      while (count < digits && count < (int) sizeof(reverse)) {
+         reverse[count++] = '0';
+      }
+      if (value < 0) {
+         Append('-');
+      }
+      while (count) {
+         Append(reverse[--count]);
+      }
+      return *this;
+   }
+
+   /* Append a rounded number with the decimals */
+   SmallString &AppendFloat(float value, int decimals)
+   {
+      int  scale  = 1;
+      
+      for (int i = 0; i < decimals; i++) {
+         scale *= 10;
+      }
+      long scaled = lroundf(fabsf(value) * scale);
+
+      if (value < 0 && scaled) {
+         Append('-');
+      }
+      AppendNumber(scaled / scale);
+      if (decimals > 0) {
+         Append('.').AppendNumber(scaled % scale, decimals);
+      }
+      return *this;
+   }
+
+   /* Append the date in the DD.MM.YYYY format */
+   SmallString &AppendDate(int day, int month, int year)
+   {
+      return AppendNumber(day, 2).Append('.').AppendNumber(month, 2).Append('.').AppendNumber(year, 4);
+   }
+
+   /* Append the time in the HH:MM:SS format, without the seconds if negative */
+   SmallString &AppendTime(int hour, int minute, int second = -1)
+   {
+      AppendNumber(hour, 2).Append(':').AppendNumber(minute, 2);
+      if (second >= 0) {
+         Append(':').AppendNumber(second, 2);
+      }
+      return *this;
+   }
+};
 
 /* Convert the RTC date time to DD.MM.YYYY HH:MM:SS */
-String getRTCDateTimeString() 
+SmallString getRTCDateTimeString() 
 {
-   char       buff[32];
-   rtc_date_t date_struct;
-   rtc_time_t time_struct;
+   SmallString text;
+   rtc_date_t  date_struct;
+   rtc_time_t  time_struct;
    
    M5.RTC.getDate(&date_struct);
    M5.RTC.getTime(&time_struct);
 
-   sprintf(buff,"%02d.%02d.%04d %02d:%02d:%02d",
-      date_struct.day,  date_struct.mon, date_struct.year,
-      time_struct.hour, time_struct.min, time_struct.sec);
-
-   return (String) buff;
+   text.AppendDate(date_struct.day, date_struct.mon, date_struct.year).Append(' ');
+   text.AppendTime(time_struct.hour, time_struct.min, time_struct.sec);
+   return text;
 }
 
 /* Read the RTC timestamp */
@@ -61,91 +167,84 @@ time_t GetRTCTime()
 }
 
 /* Convert the date part of the RTC timestamp */
-String getRTCDateString() 
+SmallString getRTCDateString() 
 {
-   char       buff[32];
-   rtc_date_t date_struct;
+   SmallString text;
+   rtc_date_t  date_struct;
    
    M5.RTC.getDate(&date_struct);
-
-   sprintf(buff,"%02d.%02d.%04d",
-      date_struct.day,  date_struct.mon, date_struct.year);
-
-   return (String) buff;
+   return text.AppendDate(date_struct.day, date_struct.mon, date_struct.year);
 }
 
 /* Convert the time part of the RTC timestamp */
-String getRTCTimeString() 
+SmallString getRTCTimeString() 
 {
-   char       buff[32];
-   rtc_time_t time_struct;
+   SmallString text;
+   rtc_time_t  time_struct;
    
    M5.RTC.getTime(&time_struct);
-
-   sprintf(buff,"%02d:%02d:%02d",      
-      time_struct.hour, time_struct.min, time_struct.sec);
-
-   return (String) buff;
+   return text.AppendTime(time_struct.hour, time_struct.min, time_struct.sec);
 }
 
 /* Convert the time_t to the DD.MM.YYYY HH:MM:SS format */
-String getDateTimeString(time_t rawtime)
+SmallString getDateTimeString(time_t rawtime)
 {
-   char buff[32];
+   SmallString  text;
+   tmElements_t tm;
    
-   sprintf(buff,"%02d.%02d.%04d %02d:%02d:%02d",
-      day(rawtime), month(rawtime), year(rawtime),
-      hour(rawtime), minute(rawtime), second(rawtime));
-
-   return (String) buff;
+   breakTime(rawtime, tm);
+   text.AppendDate(tm.Day, tm.Month, tm.Year + 1970).Append(' ');
+   return text.AppendTime(tm.Hour, tm.Minute, tm.Second);
 }
 
 /* Convert the time_t to the date part DD.MM.YYYY */
-String getDateString(time_t rawtime)
+SmallString getDateString(time_t rawtime)
 {
-   char buff[32];
+   SmallString  text;
+   tmElements_t tm;
    
-   sprintf(buff,"%02d.%02d.%04d",
-      day(rawtime), month(rawtime), year(rawtime));
+   breakTime(rawtime, tm);
+   return text.AppendDate(tm.Day, tm.Month, tm.Year + 1970);
+}
 
-   return (String) buff;
+/* Convert the time_t to the day and month D.M. of the graph labels */
+SmallString getDayMonthString(time_t rawtime)
+{
+   SmallString  text;
+   tmElements_t tm;
+   
+   breakTime(rawtime, tm);
+   return text.AppendNumber(tm.Day).Append('.').AppendNumber(tm.Month).Append('.');
 }
 
 /* Convert the time_t to the time part HH:MM:SS format */
-String getTimeString(time_t rawtime)
+SmallString getTimeString(time_t rawtime)
 {
-   char buff[32];
+   SmallString  text;
+   tmElements_t tm;
    
-   sprintf(buff,"%02d:%02d:%02d",
-      hour(rawtime), minute(rawtime), second(rawtime));
-
-   return (String) buff;
+   breakTime(rawtime, tm);
+   return text.AppendTime(tm.Hour, tm.Minute, tm.Second);
 }
 
 /* Convert the hour of the time_t */
-String getHourString(time_t rawtime)
+SmallString getHourString(time_t rawtime)
 {
-   char buff[32];
+   SmallString text;
    
-   sprintf(buff,"%02d",
-      hour(rawtime));
-
-   return (String) buff;
+   return text.AppendNumber(rawtime / SECS_PER_HOUR % 24, 2);
 }
 
 /* Convert the minute of the time_t */
-String getHourMinString(time_t rawtime)
+SmallString getHourMinString(time_t rawtime)
 {
-   char buff[32];
+   SmallString text;
    
-   sprintf(buff,"%02d:%02d",
-      hour(rawtime), minute(rawtime));
-
-   return (String) buff;
+   return text.AppendTime(rawtime / SECS_PER_HOUR % 24, rawtime / SECS_PER_MIN % 60);
 }
 
 /* Convert the rssi value to a string value between 0 and 100 % */
-String WifiGetRssiAsQuality(int rssi)
+SmallString WifiGetRssiAsQuality(int rssi)
 {
    int quality = 0;
 
@@ -156,7 +255,7 @@ String WifiGetRssiAsQuality(int rssi)
    } else {
       quality = 2 * (rssi + 100);
    }
-   return String(quality);
+   return SmallString().AppendNumber(quality);
 }
 
 /* Convert the rssi value to a int value between 0 and 100 % */
@@ -174,6 +273,32 @@ int WifiGetRssiAsQualityInt(int rssi)
    return quality;
 }
 
+/* Standard crc32 (IEEE 802.3), crc allows to continue a previous calculation */
+uint32_t Crc32(const void *data, size_t size, uint32_t crc = 0)
+{
+   const uint8_t *p = (const uint8_t *) data;
+   
+   crc = ~crc;
+   while (size--) {
+      crc ^= *p++;
+      for (int k = 0; k < 8; k++) {
+         crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+      }
+   }
+   return ~crc;
+}
+
+/* FNV-1a hash of a buffer, hash allows to continue a previous calculation */
+uint32_t Fnv1a(const void *data, size_t size, uint32_t hash = 2166136261u)
+{
+   const uint8_t *p = (const uint8_t *) data;
+   
+   while (size--) {
+      hash = (hash ^ *p++) * 16777619u;
+   }
+   return hash;
+}
+
 /* Convert a day, month, year to a julian int
  * The moon phase calculation is part of the github project
  * https://github.com/G6EJD/ESP32-Revised-Weather-Display-42-E-Paper
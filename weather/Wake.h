@@ -0,0 +1,85 @@
+/*
+   Copyright (C) 2021 SFini
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+  * @file Wake.h
+  * 
+  * Detection of the reason of the wake.
+  */
+#pragma once
+#include <Wire.h>
+#include <esp_sleep.h>
+#include "Log.h"
+
+#define BM8563_ADDRESS  0x51  // I2C address of the RTC
+#define BM8563_STATUS2  0x01  // control and status register 2
+#define BM8563_AF       0x08  // alarm flag
+#define BM8563_TF       0x04  // timer flag
+
+/* The reasons of a wake */
+enum WakeReason
+{
+   WAKE_POWER_ON = 0,  //!< Reset, first start or the power switch
+   WAKE_ALARM    = 1,  //!< Alarm or timer of the BM8563
+   WAKE_BUTTON   = 2,  //!< Power button, the user waits for the display
+   WAKE_USB      = 3   //!< Deep sleep timer after a shutdown on usb power
+};
+
+/* Name of the wake reason for the log output */
+const char *GetWakeReasonName(WakeReason reason)
+{
+   switch (reason) {
+      case WAKE_ALARM:  return "alarm";
+      case WAKE_BUTTON: return "button";
+      case WAKE_USB:    return "usb";
+      default:          return "power on";
+   }
+}
+
+/*
+ *  Read the control and status register 2 of the BM8563. The M5.RTC.begin() clears
+ *  the alarm and timer flags, so this runs before the InitEPD() with its own Wire start.
+ */
+uint8_t ReadRTCStatus()
+{
+   Wire.begin(21, 22);
+   Wire.beginTransmission(BM8563_ADDRESS);
+   Wire.write(BM8563_STATUS2);
+   if (Wire.endTransmission(false) != 0 || Wire.requestFrom((uint8_t) BM8563_ADDRESS, (uint8_t) 1) != 1) {
+      return 0;
+   }
+   return Wire.read();
+}
+
+/* 
+ *  Why is the M5Paper awake? The button is checked first because the user waits,
+ *  then the deep sleep timer of a shutdown on usb power and the flags of the RTC
+ *  that were read with ReadRTCStatus() at the start of the wake.
+ */
+WakeReason GetWakeReason(uint8_t status)
+{
+   WakeReason reason = WAKE_POWER_ON;
+
+   if (M5.BtnP.isPressed()) {
+      reason = WAKE_BUTTON;
+   } else if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+      reason = WAKE_USB;
+   } else if (status & (BM8563_AF | BM8563_TF)) {
+      reason = WAKE_ALARM;
+   }
+   LOG_I("Wake: %s (rtc status 0x%02x)", GetWakeReasonName(reason), status);
+   return reason;
+}
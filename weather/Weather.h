@@ -23,11 +23,63 @@
 #include <HTTPClient.h>
 #include <WiFiClient.h>
 #include <ArduinoJson.h>
+#include <nvs.h>
+#include "Budget.h"
+#include "Heap.h"
+#include "Log.h"
+#include "Quota.h"
 #include "Utils.h"
+#if OPENWEATHER_TLS
+#include "TlsClient.h"
+static_assert(sizeof(OPENWEATHER_CA) > 1 || OPENWEATHER_TLS_INSECURE, "OPENWEATHER_TLS needs the root CA of the server in OPENWEATHER_CA");
+#endif
 
-#define MAX_HOURLY   24
-#define MAX_FORECAST  8
-#define MIN_RAIN     10
+#define MAX_HOURLY         24
+#define HOURLY_STEP         3
+#define MAX_HOURLY_CACHE   48
+#define MAX_FORECAST        8
+#define MIN_RAIN           10
+#define WEATHER_CACHE_VER   1
+
+/**
+  * One stored hourly entry of the forecast.
+  */
+struct WeatherHour
+{
+   uint32_t time;                          //!< local timestamp
+   float    temp;                          //!< temperature
+   float    winddir;                       //!< wind direction
+   float    windspeed;                     //!< wind speed
+   char     main[16];                      //!< description of the weather
+   char     icon[4];                       //!< openweathermap icon
+};
+
+/**
+  * One stored daily entry of the forecast.
+  */
+struct WeatherDay
+{
+   uint32_t sunrise;                       //!< local sunrise timestamp
+   uint32_t sunset;                        //!< local sunset timestamp
+   float    maxTemp;                       //!< max temperature
+   float    minTemp;                       //!< min temperature
+   float    rain;                          //!< rain in mm
+   float    humidity;                      //!< humidity
+   float    pressure;                      //!< air pressure
+};
+
+/**
+  * The complete forecast of the last fetch, stored in the NVS 
+  * so the wakes between the fetches could render without wifi.
+  */
+struct WeatherCache
+{
+   uint16_t    version;                    //!< WEATHER_CACHE_VER
+   int32_t     timeOffset;                 //!< timezone offset of the fetch
+   WeatherHour current;                    //!< current values at the fetch
+   WeatherHour hourly[MAX_HOURLY_CACHE];   //!< hourly forecast starting with the fetch hour
+   WeatherDay  daily[MAX_FORECAST];        //!< daily forecast starting with the fetch day
+};
 
 /**
   * Class for reading all the weather data from openweathermap.
@@ -55,6 +107,8 @@ public:
    float  forecastHumidity[MAX_FORECAST];  //!< humidity of the dayly forecast
    float  forecastPressure[MAX_FORECAST];  //!< air pressure
 
+   WeatherCache cache;                     //!< Complete forecast of the last fetch
+
 protected:
    /* Convert UTC time to local time */
    time_t LocalTime(time_t time)
@@ -65,9 +119,14 @@ protected:
    /* Calls the openweathermap request and deserialisation the json data. */
    bool GetOpenWeatherJsonDoc(DynamicJsonDocument &doc)
    {
+#if OPENWEATHER_TLS
+      TlsClient  client("weather", OPENWEATHER_CA);
+#else
       WiFiClient client;
+#endif
       HTTPClient http;
       String     uri;
+      uint32_t   start;
       
       uri += "/data/3.0/onecall";
       uri += "?lat=" + String((float) LATITUDE, 5);
@@ -75,73 +134,92 @@ protected:
       uri += "&units=metric&lang=en&exclude=minutely";
       uri += "&appid=" + (String) OPENWEATHER_API;
 
-      Serial.printf("GetWeather: http://%s/%s\n", OPENWEATHER_SRV, uri.c_str());
+      LOG_I("GetWeather: %s://%s%s", OPENWEATHER_TLS ? "https" : "http", OPENWEATHER_SRV, uri.c_str());
 
       client.stop();
+      myBudget.Start(BUDGET_FETCH);
+      start = millis();
       http.begin(client, OPENWEATHER_SRV, OPENWEATHER_PORT, uri);
+      http.useHTTP10(true); // getStream() does not decode a chunked answer
+      http.setConnectTimeout(myBudget.Remaining());
+      http.setTimeout(min(myBudget.Remaining(), (uint32_t) UINT16_MAX));
       
       int httpCode = http.GET();
       
       if (httpCode != HTTP_CODE_OK) {
-         Serial.printf("GetWeather failed, error: %s", http.errorToString(httpCode).c_str());
+         LOG_E("GetWeather failed, error: %s", http.errorToString(httpCode).c_str());
+         myBudget.Expired(); // records a timeout as overrun
          client.stop();
          http.end();
          return false;
       } else {
-         DeserializationError error = deserializeJson(doc, http.getStream());
+         myBudget.Start(BUDGET_PARSE);
+
+         DeadlineStream       stream(http.getStream());
+         DeserializationError error = deserializeJson(doc, stream);
          
          if (error) {
-            Serial.print(F("deserializeJson() failed: "));
-            Serial.println(error.c_str());
+            LOG_E("deserializeJson() failed: %s", error.c_str());
+            myBudget.Expired(); // records a cut body as overrun
             return false;
          } else {
+#if OPENWEATHER_TLS
+            LOG_I("GetWeather: tls handshake %lu ms (%s), transfer %lu ms", (unsigned long) client.GetHandshakeMillis(),
+               client.IsResumed() ? "resumed" : "full", (unsigned long) (millis() - start - client.GetHandshakeMillis()));
+#else
+            LOG_D("GetWeather: transfer %lu ms", (unsigned long) (millis() - start));
+#endif
             return true;
          }
       }
    }
 
-   /* Fill from the json data into the internal data. */
+   /* Copy one current or hourly json entry into the cache. */
+   void FillHour(WeatherHour &hour, const JsonObject &entry)
+   {
+      const char *main = entry["weather"][0]["main"].as<const char *>();
+      const char *icon = entry["weather"][0]["icon"].as<const char *>();
+      
+      hour.time      = LocalTime(entry["dt"].as<int>());
+      hour.temp      = entry["temp"].as<float>();
+      hour.winddir   = entry["wind_deg"].as<float>();
+      hour.windspeed = entry["wind_speed"].as<float>();
+      strlcpy(hour.main, main ? main : "", sizeof(hour.main));
+      strlcpy(hour.icon, icon ? icon : "", sizeof(hour.icon));
+   }
+
+   /* Fill from the json data into the cache and the internal data. */
    bool Fill(const JsonObject &root) 
    {
       Clear();
+      memset(&cache, 0, sizeof(cache));
 
       currentTimeOffset = root["timezone_offset"].as<int>();
-      currentTime       = LocalTime(root["current"]["dt"].as<int>());
-
-      sunrise           = LocalTime(root["current"]["sunrise"].as<int>());
-      sunset            = LocalTime(root["current"]["sunset"].as<int>());
-      winddir           = root["current"]["wind_deg"].as<float>();
-      windspeed         = root["current"]["wind_speed"].as<float>();
-
+      cache.version     = WEATHER_CACHE_VER;
+      cache.timeOffset  = currentTimeOffset;
+      FillHour(cache.current, root["current"]);
+      
       JsonArray hourly_list = root["hourly"];
-      hourlyTime[0]    = LocalTime(root["current"]["dt"].as<int>());
-      hourlyMaxTemp[0] = root["current"]["temp"].as<float>();
-      hourlyMain[0]    = root["current"]["weather"][0]["main"].as<const char *>();
-      hourlyIcon[0]    = root["current"]["weather"][0]["icon"].as<const char *>();
-      for (int i = 1; i < MAX_HOURLY; i++) {
-         if (i < hourly_list.size()) {
-            hourlyTime[i]    = LocalTime(hourly_list[i - 1]["dt"].as<int>());
-            hourlyMaxTemp[i] = hourly_list[i - 1]["temp"].as<float>();
-            hourlyMain[i]    = hourly_list[i - 1]["weather"][0]["main"].as<const char *>();
-            hourlyIcon[i]    = hourly_list[i - 1]["weather"][0]["icon"].as<const char *>();
-         }
+      for (int i = 0; i < MAX_HOURLY_CACHE && i < (int) hourly_list.size(); i++) {
+         FillHour(cache.hourly[i], hourly_list[i]);
       }
       
       JsonArray dayly_list  = root["daily"];
-      for (int i = 0; i < MAX_FORECAST; i++) {
-         if (i < dayly_list.size()) {
-            forecastMaxTemp[i]  = dayly_list[i]["temp"]["max"].as<float>();
-            forecastMinTemp[i]  = dayly_list[i]["temp"]["min"].as<float>();
-            forecastRain[i]     = dayly_list[i]["rain"].as<float>();
-            forecastHumidity[i] = dayly_list[i]["humidity"].as<float>();
-            forecastPressure[i] = dayly_list[i]["pressure"].as<float>();
-            if (forecastRain[i] > maxRain) {
-               maxRain = forecastRain[i];
-            }
-         }
+      for (int i = 0; i < MAX_FORECAST && i < (int) dayly_list.size(); i++) {
+         WeatherDay &day = cache.daily[i];
+         
+         day.sunrise  = LocalTime(dayly_list[i]["sunrise"].as<int>());
+         day.sunset   = LocalTime(dayly_list[i]["sunset"].as<int>());
+         day.maxTemp  = dayly_list[i]["temp"]["max"].as<float>();
+         day.minTemp  = dayly_list[i]["temp"]["min"].as<float>();
+         day.rain     = dayly_list[i]["rain"].as<float>();
+         day.humidity = dayly_list[i]["humidity"].as<float>();
+         day.pressure = dayly_list[i]["pressure"].as<float>();
       }
+      cache.daily[0].sunrise = LocalTime(root["current"]["sunrise"].as<int>());
+      cache.daily[0].sunset  = LocalTime(root["current"]["sunset"].as<int>());
           
-      return true;
+      return Restore(cache.current.time);
    }
 
 public:
@@ -175,14 +253,142 @@ public:
       memset(forecastPressure, 0, sizeof(forecastPressure));
    }
 
-   /* Start the request and the filling. */
-   bool Get()
+   /* 
+    *  Start the request and the filling and store the forecast for the next wakes.
+    *  Every request takes a call of the quota, without one the stored forecast stays.
+    */
+   bool Get(QuotaState &quota)
    {
+      if (!ApiQuota::Acquire(quota, GetRTCTime())) {
+         return false;
+      }
       DynamicJsonDocument doc(35 * 1024);
    
-      if (GetOpenWeatherJsonDoc(doc)) {
-         return Fill(doc.as<JsonObject>());
+      if (!GetOpenWeatherJsonDoc(doc)) {
+         return false;
+      }
+      myHeap.Sample(HEAP_PARSE);
+      if (Fill(doc.as<JsonObject>())) {
+         ApiQuota::SetOffset(quota, cache.timeOffset);
+         Save();
+         return true;
       }
       return false;
    }
+
+   /* Load the forecast of the last fetch from the NVS */
+   bool Load()
+   {
+      nvs_handle nvs_arg;
+      size_t     size = sizeof(cache);
+      bool       ok   = false;
+      
+      if (nvs_open("Weather", NVS_READONLY, &nvs_arg) == ESP_OK) {
+         ok = nvs_get_blob(nvs_arg, "cache", &cache, &size) == ESP_OK
+            && size == sizeof(cache) && cache.version == WEATHER_CACHE_VER;
+         nvs_close(nvs_arg);
+      }
+      if (!ok) {
+         memset(&cache, 0, sizeof(cache));
+      }
+      return ok;
+   }
+
+   /* Store the forecast of the last fetch to the NVS */
+   void Save()
+   {
+      nvs_handle nvs_arg;
+      
+      nvs_open("Weather", NVS_READWRITE, &nvs_arg);
+      nvs_set_blob(nvs_arg, "cache", &cache, sizeof(cache));
+      nvs_commit(nvs_arg);
+      nvs_close(nvs_arg);
+   }
+
+   /* 
+    * The night of the stored forecast that contains the local time or comes next,
+    * from the sunset to the sunrise of the next day. False beyond the forecast.
+    */
+   bool GetNight(time_t time, time_t &start, time_t &end)
+   {
+      if (cache.version != WEATHER_CACHE_VER) {
+         return false;
+      }
+      for (int i = 0; i < MAX_FORECAST; i++) {
+         if (cache.daily[i].sunrise && time < (time_t) cache.daily[i].sunrise) {
+            start = i > 0 ? cache.daily[i - 1].sunset : cache.daily[0].sunset - SECS_PER_DAY;
+            end   = cache.daily[i].sunrise;
+            return true;
+         }
+      }
+      return false;
+   }
+
+   /* 
+    * Fill the internal data from the stored forecast for the given local time.
+    * The hourly strip moves in its column steps of HOURLY_STEP hours from the
+    * fetch time, so the screen stays the same between the steps. The current
+    * values come from the hourly entry of the step, the days follow the time.
+    */
+   bool Restore(time_t time)
+   {
+      time_t base      = cache.current.time;
+      time_t step      = HOURLY_STEP * SECS_PER_HOUR;
+      time_t shown     = time > base ? base + (time - base) / step * step : time;
+      bool   fetchHour = shown / SECS_PER_HOUR == base / SECS_PER_HOUR;
+      int    hour      = fetchHour ? 0 : -1;
+      int    day       = (time / SECS_PER_DAY) - (base / SECS_PER_DAY);
+
+      if (cache.version != WEATHER_CACHE_VER || day < 0 || day >= MAX_FORECAST) {
+         return false;
+      }
+      for (int i = 0; i < MAX_HOURLY_CACHE; i++) {
+         time_t start = cache.hourly[i].time;
+         
+         if (start && start <= shown && shown < start + (time_t) SECS_PER_HOUR) {
+            hour = i;
+            break;
+         }
+      }
+      if (hour < 0 || hour + MAX_HOURLY - 1 > MAX_HOURLY_CACHE) {
+         return false;
+      }
+      Clear();
+      
+      const WeatherHour &current = fetchHour ? cache.current : cache.hourly[hour];
+
+      currentTimeOffset = cache.timeOffset;
+      currentTime       = fetchHour ? cache.current.time : shown;
+      sunrise           = cache.daily[day].sunrise;
+      sunset            = cache.daily[day].sunset;
+      winddir           = current.winddir;
+      windspeed         = current.windspeed;
+
+      hourlyTime[0]    = currentTime;
+      hourlyMaxTemp[0] = current.temp;
+      hourlyMain[0]    = current.main;
+      hourlyIcon[0]    = current.icon;
+      for (int i = 1; i < MAX_HOURLY; i++) {
+         const WeatherHour &entry = cache.hourly[hour + i - 1];
+         
+         hourlyTime[i]    = entry.time;
+         hourlyMaxTemp[i] = entry.temp;
+         hourlyMain[i]    = entry.main;
+         hourlyIcon[i]    = entry.icon;
+      }
+      
+      for (int i = 0; i < MAX_FORECAST - day; i++) { // the forecast starts with today, the days behind stay cleared
+         const WeatherDay &daily = cache.daily[i + day];
+
+         forecastMaxTemp[i]  = daily.maxTemp;
+         forecastMinTemp[i]  = daily.minTemp;
+         forecastRain[i]     = daily.rain;
+         forecastHumidity[i] = daily.humidity;
+         forecastPressure[i] = daily.pressure;
+         if (forecastRain[i] > maxRain) {
+            maxRain = forecastRain[i];
+         }
+      }
+      return true;
+   }
 };
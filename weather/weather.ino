@@ -28,65 +28,471 @@
 #include "Battery.h"
 #include "EPD.h"
 #include "EPDWifi.h"
+#include "FrameStore.h"
+#include "Log.h"
 #include "Moon.h"
+#include "Schedule.h"
 #include "SHT30.h"
+#include "Stats.h"
 #include "Time.h"
 #include "Utils.h"
+#include "Wake.h"
 #include "Weather.h"
 
-// Refresh the M5Paper info more often.
-// #define REFRESH_PARTLY 1
-
 MyData         myData;            // The collection of the global data
 WeatherDisplay myDisplay(myData); // The global display helper class
+Schedule       mySchedule;        // The periods of the refresh tasks
+UpdateStats    myStats;           // Latencies of the always on mode
+bool           alwaysOn = false;  // Event loop on usb power instead of the shutdown
 
-/* Start and M5Paper instance */
-void setup()
+/* Render the frames of the next hours until the next fetch from the stored forecast, up to the end of the render budget */
+void PrerenderFrames()
 {
-#ifndef REFRESH_PARTLY
-   InitEPD(true);
-   if (StartWiFi(myData.wifiRSSI)) {
-      GetBatteryValues(myData);
-      GetSHT30Values(myData);
-      GetMoonValues(myData);
-      if (myData.weather.Get()) {
-         SetRTCDateTime(myData);
+   time_t   now       = GetRTCTime();
+   uint32_t period    = mySchedule.GetPeriod(TASK_WEATHER, (BatteryPolicy) myData.state.policy);
+   time_t   nextFetch = now + period;
+   
+   for (int i = 1; i <= PRERENDER_FRAMES && !myBudget.Expired(); i++) {
+      time_t time = now - now % SECS_PER_HOUR + i * SECS_PER_HOUR;
+
+      if ((period && time >= nextFetch) || !myData.weather.Restore(time)) {
+         break;
       }
-      myData.Dump();
-      myDisplay.Show();
-      StopWiFi();
-   }
-   ShutdownEPD(60 * 60); // every 1 hour
-#else 
-   myData.LoadNVS();
-   if (myData.nvsCounter == 1) {
-      InitEPD(true);
+      GetMoonValues(myData, myData.weather.currentTime);
+      myDisplay.RenderFrame(time);
+   }
+}
+
+/* 
+ *  Has the visible data changed since the last refresh?
+ *  Otherwise the refresh is skipped and only the update time could be shown.
+ */
+bool IsDisplayChanged()
+{
+   uint32_t hash = myDisplay.GetHash();
+
+   myData.state.displayWakes++;
+   if (hash == myData.state.displayHash) {
+      myData.state.displaySkips++;
+      LOG_I("Display unchanged");
+      if (UNCHANGED_TIME_UPDATE) {
+         myDisplay.ShowM5PaperInfo();
+      }
+      return false;
+   }
+   myData.state.displayHash = hash;
+   return true;
+}
+
+/* 
+ *  Show all the data. The weather comes from the stored forecast and is 
+ *  only fetched from openweathermap if requested or if there is no usable forecast.
+ *  Without a fetch the pre-rendered frame of the hour is used if available.
+ *  Returns true if the weather was fetched.
+ */
+bool ShowWeather(bool fetch, bool clear)
+{
+   time_t now     = GetRTCTime();
+   bool   weather = !fetch && myData.weather.Load() && myData.weather.Restore(now);
+   bool   fetched = false;
+   
+   GetSHT30Values(myData);
+   if (!weather && !ApiQuota::Available(myData.state.quota, now)) { // a denied call must not pay the wifi
+      ApiQuota::Deny(myData.state.quota);
+      weather = myData.weather.Load() && myData.weather.Restore(now);
+   } else if (!weather) {
+      uint32_t radioStart = millis();
+      
       if (StartWiFi(myData.wifiRSSI)) {
-         GetBatteryValues(myData);
+         uint32_t fetchStart = millis();
+
+         myHeap.Sample(HEAP_WIFI);
+         weather = fetched = myData.weather.Get(myData.state.quota);
+         myData.fetchMillis     = millis() - fetchStart;
+         myData.telemetryFlags |= fetched ? TELEMETRY_FETCHED : TELEMETRY_FETCH_FAILED;
+         if (fetched) {
+            time_t dataTime = myData.weather.cache.current.time;
+            time_t rtcTime  = GetRTCTime();
+
+            Schedule::AddFetch(myData.state, dataTime, rtcTime);
+            // the data time of a provider with an update cadence lags behind, it only corrects a wrong clock
+            if (myData.state.providerCadence <= 1 || abs(rtcTime - dataTime) > (time_t) myData.state.providerCadence) {
+               SetRTCDateTime(myData);
+            }
+            myData.telemetry.Upload(myData.state.telemetrySent); // the radio is up anyway
+         }
+         if (alwaysOn) {
+            SleepWiFi();
+         } else {
+            StopWiFi();
+         }
+      }
+      myData.radioMillis += millis() - radioStart;
+      if (!weather) { // fallback to the last forecast
+         weather = myData.weather.Load() && myData.weather.Restore(GetRTCTime());
+      }
+   }
+   if (weather) {
+      myBudget.Start(BUDGET_RENDER); // the page is always shown, only the optional frames and pages are skipped
+      GetMoonValues(myData, myData.weather.currentTime); // the next rise and set of the shown step, not of the wake
+      if (clear) {
+         myData.state.displayHash = 0;
+      }
+      if (IsDisplayChanged()) {
+         if (fetched || !myDisplay.ShowFrame(now - now % SECS_PER_HOUR, clear)) {
+            myDisplay.Show(clear);
+         }
+      }
+      myData.Dump();
+      if (fetched) {
+         PrerenderFrames();
+      }
+      myDisplay.RenderPages();
+   }
+   return fetched;
+}
+
+/* Show the weather of the stored forecast without network, false if there is none */
+bool ShowStoredWeather()
+{
+   time_t now = GetRTCTime();
+   
+   if (!myData.weather.Load() || !myData.weather.Restore(now)) {
+      return false;
+   }
+   GetMoonValues(myData, myData.weather.currentTime);
+   if (!myDisplay.ShowFrame(now - now % SECS_PER_HOUR, false)) {
+      myDisplay.Show(false);
+   }
+   myData.state.displayHash = myDisplay.GetHash();
+   return true;
+}
+
+/* 
+ *  The button and the touch cycle through the pages, all from the stored data and
+ *  the page store, so the first pixel never waits for the network.
+ *  The step is 1 for the next and -1 for the previous page, the forecast pages need a forecast.
+ */
+void ShowNextPage(int step = 1)
+{
+   bool forecast = myData.weather.cache.version == WEATHER_CACHE_VER || myData.weather.Load();
+   int  page     = myData.state.page;
+
+   GetSHT30Values(myData);
+   for (int i = 0; i < PAGE_COUNT; i++) {
+      page = (page + step + PAGE_COUNT) % PAGE_COUNT;
+      if (page == PAGE_WEATHER) {
+         if (ShowStoredWeather()) {
+            return;
+         }
+      } else if (forecast || page == PAGE_HISTORY) {
+         myDisplay.ShowPage(page);
+         return;
+      }
+   }
+}
+
+/* 
+ *  Flip the pages with the touch screen: a swipe to the left or a tap on the right half
+ *  shows the next page, a swipe to the right or a tap on the left half the previous one.
+ *  Returns true if a page was shown.
+ */
+bool HandleTouch()
+{
+   static int startX = -1;
+   static int lastX  = -1;
+
+   if (!M5.TP.available()) {
+      return false;
+   }
+   M5.TP.update();
+   if (!M5.TP.isFingerUp()) {
+      lastX = M5.TP.readFinger(0).x;
+      if (startX < 0) {
+         startX = lastX;
+      }
+      return false;
+   }
+   if (startX < 0) {
+      return false;
+   }
+
+   uint32_t start = millis();
+   int      dx    = lastX - startX;
+   int      step  = abs(dx) >= PAGE_TOUCH_SWIPE ? (dx < 0 ? 1 : -1) : (startX >= 480 ? 1 : -1);
+
+   startX = -1;
+   ShowNextPage(step);
+   LOG_I("Touch: %s %+d in %lu ms", abs(dx) >= PAGE_TOUCH_SWIPE ? "swipe" : "tap", step, (unsigned long) (millis() - start));
+   myStats.Add(UPDATE_TOUCH, millis() - start);
+   return true;
+}
+
+/* Keep the pages touchable for the given seconds after the last flip */
+void WaitTouch(uint32_t secs)
+{
+   uint32_t last = millis();
+
+   StartTouch();
+   while (millis() - last < secs * 1000 && myBudget.WakeLeft()) {
+      if (HandleTouch()) {
+         last = millis();
+      }
+      delay(20);
+   }
+}
+
+/* Count the time to the first pixel of a button wake against the target */
+void StoreFirstPixel()
+{
+   uint32_t firstPixel = myData.firstPixelMillis;
+
+   myData.state.buttonWakes++;
+   myData.state.firstPixelMs    = min(firstPixel, (uint32_t) 0xFFFF);
+   myData.state.maxFirstPixelMs = max(myData.state.maxFirstPixelMs, myData.state.firstPixelMs);
+   if (firstPixel > FIRST_PIXEL_TARGET_MS) {
+      myData.state.buttonMissed++;
+   }
+   LOG_I("FirstPixel: %lu ms (target %d ms)", (unsigned long) firstPixel, FIRST_PIXEL_TARGET_MS);
+}
+
+/* 
+ *  Run the due tasks of the scheduler. A full refresh includes the M5Paper information,
+ *  otherwise only the due lines of the M5Paper information are updated.
+ */
+void RunTasks(int due)
+{
+   BatteryPolicy policy = (BatteryPolicy) myData.state.policy;
+   
+   for (int task = 0; task < TASK_COUNT; task++) {
+      if (due & (1 << task)) {
+         LOG_I("Schedule: %s due", Schedule::GetTaskName(task));
+      }
+   }
+   // the M5Paper information needs the weather page on the display
+   if ((due & ((1 << TASK_WEATHER) | (1 << TASK_RENDER) | (1 << TASK_GHOST))) || (due && !myData.state.displayHash)) {
+      bool fetch   = due & (1 << TASK_WEATHER);
+      bool fetched = ShowWeather(fetch, due & (1 << TASK_GHOST));
+      
+      due |= (1 << TASK_SENSOR) | (1 << TASK_CLOCK) | (1 << TASK_RENDER);
+      if (fetch && !fetched) { // retry after SCHEDULE_RETRY, not before the quota has a call
+         due &= ~(1 << TASK_WEATHER);
+         myData.state.lastRun[TASK_WEATHER] = GetRTCTime() + SCHEDULE_RETRY - mySchedule.GetPeriod(TASK_WEATHER, policy);
+      }
+   } else if (due & ((1 << TASK_SENSOR) | (1 << TASK_CLOCK))) {
+      int parts = 0;
+      
+      if (due & (1 << TASK_SENSOR)) {
          GetSHT30Values(myData);
-         GetMoonValues(myData);
-         if (myData.weather.Get()) {
-            SetRTCDateTime(myData);
+         parts |= M5PAPER_VALUES;
+      }
+      if (due & (1 << TASK_CLOCK)) {
+         parts |= M5PAPER_TIME;
+      }
+      myDisplay.ShowM5PaperInfo(parts);
+   }
+   
+   time_t now = GetRTCTime();
+   
+   for (int task = 0; task < TASK_COUNT; task++) {
+      if (due & (1 << task)) {
+         myData.state.lastRun[task] = now;
+      }
+   }
+}
+
+/* 
+ *  Last resort of a wake beyond its budget, called on the esp_timer task: it interrupts
+ *  the wake anywhere, so no log, state, I2C or flash. It counts the stop in the RTC memory
+ *  and switches off, the alarm of setup() restarts the M5Paper. On usb power the deep
+ *  sleep restarts it after SCHEDULE_RETRY.
+ */
+void BudgetWatchdog(void *)
+{
+   budgetWatchdogStops++;
+   M5.disableMainPower();
+   usbPowered = true;
+   esp_sleep_enable_timer_wakeup((uint64_t) SCHEDULE_RETRY * 1000000);
+   esp_deep_sleep_start();
+}
+
+/* Append the telemetry record of the wake, it is uploaded with the next fetch */
+void StoreTelemetry(WakeReason reason)
+{
+   TelemetryRecord record;
+
+   record.time      = GetRTCTime();
+   record.wakeMs    = min((uint32_t) millis(), (uint32_t) 0xFFFF);
+   record.radioMs   = min(myData.radioMillis,  (uint32_t) 0xFFFF);
+   record.fetchMs   = min(myData.fetchMillis,  (uint32_t) 0xFFFF);
+   record.renderMs  = min(myData.renderMillis, (uint32_t) 0xFFFF);
+   record.millivolt = myData.batteryMillivolt;
+   record.rssi      = constrain(myData.wifiRSSI, -128, 0);
+   record.reason    = reason;
+   record.flags     = myData.telemetryFlags | (IsUSBPowered() ? TELEMETRY_USB : 0);
+   record.policy    = myData.state.policy;
+   record.minFreeKb = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL) / 1024;
+   myData.telemetry.Add(record);
+}
+
+/* Execute the serial commands, waits the given time for them */
+void ProcessCommands(uint32_t waitMs)
+{
+   uint32_t start = millis();
+   
+   if (waitMs || Serial.available()) {
+      FlushLog(); // the answers must not mix with the stored records
+   }
+   while (Serial.available() || millis() - start < waitMs) {
+      if (Serial.available()) {
+         String line = Serial.readStringUntil('\n');
+         
+         line.trim();
+         if (line == "stats") {
+            myStats.Print();
+         } else if (!mySchedule.Command(line)) {
+            Serial.println("unknown command: " + line);
          }
-         myData.Dump();
-         myDisplay.Show();
-         StopWiFi();
-      }
-   } else {
-      InitEPD(false);
-      GetSHT30Values(myData);
-      myDisplay.ShowM5PaperInfo();
-      if (myData.nvsCounter >= 60) {
-         myData.nvsCounter = 0;
-      }
-   }
-   myData.nvsCounter++;
-   myData.SaveNVS();
-   ShutdownEPD(600); // 10 minute
-#endif // REFRESH_PARTLY   
+      } else {
+         delay(10);
+      }
+   }
 }
 
-/* Main loop. Never reached because of shutdown */
+/* 
+ *  Start and M5Paper instance. Every wake reason has its own way: the button shows
+ *  the next page at once and does the bookkeeping afterwards, the alarm runs the
+ *  due tasks of the scheduler and a power on additionally refreshes the display.
+ */
+void setup()
+{
+   myBudget.Begin(BudgetWatchdog);
+
+   uint8_t rtcStatus = ReadRTCStatus(); // before the M5.RTC.begin() clears the flags
+
+   InitEPD(false);
+   SetRTCAlarm(WakeBudget::GetWatchdogWake(GetRTCTime())); // the restart after a stop by the watchdog
+   myData.LoadState();
+   myHeap.Sample(HEAP_BOOT);
+
+   WakeReason reason = GetWakeReason(rtcStatus);
+   
+   WakeBudget::CountWatchdogStops(myData.state.budget, reason == WAKE_ALARM && myData.state.plannedWake && 
+      GetRTCTime() >= (time_t) myData.state.plannedWake + SCHEDULE_RETRY);
+   
+   myLog.SetHost(IsUSBPowered() || reason == WAKE_POWER_ON);
+   if (reason == WAKE_BUTTON) {
+      ShowNextPage();
+      StoreFirstPixel();
+   }
+   mySchedule.Load();
+   GetBatteryValues(myData);
+
+   int           lastPolicy = myData.state.policy;
+   BatteryPolicy policy     = GetBatteryPolicy(myData);
+   
+   mySchedule.SetQuietTime(myData, GetRTCTime());
+   mySchedule.SetQuota(myData.state.quota, GetRTCTime());
+   if (reason != WAKE_BUTTON) { // the page of a button wake stays until the next task shows the weather again
+      if (policy == POLICY_MINIMAL) {
+         if (lastPolicy != POLICY_MINIMAL) {
+            myDisplay.ShowLowBattery();
+         }
+      } else {
+         int due = mySchedule.GetDueTasks(myData.state, GetRTCTime(), policy);
+
+         if (lastPolicy == POLICY_MINIMAL || reason == WAKE_POWER_ON) { // replace the unknown or low battery screen
+            due |= 1 << TASK_RENDER;
+         }
+         RunTasks(due);
+      }
+   }
+   ProcessCommands(IsUSBPowered() && !ALWAYS_ON_USB ? SCHEDULE_CONSOLE_MS : 0);
+   if (reason == WAKE_BUTTON && PAGE_TOUCH_SECS && !IsUSBPowered()) {
+      WaitTouch(PAGE_TOUCH_SECS);
+   }
+
+   mySchedule.SetQuota(myData.state.quota, GetRTCTime()); // with the calls of the tasks
+   time_t wakeTime = mySchedule.GetWakeTime(myData.state, GetRTCTime(), policy);
+   
+   myHeap.Sample(HEAP_END);
+   myBudget.Disarm();
+   StoreBatteryValues(myData);
+   StoreTelemetry(reason);
+   myData.SaveState();
+   if (!ALWAYS_ON_USB) {
+      ShutdownEPD(wakeTime);
+   }
+   PowerOffEPD(wakeTime); // returns only on usb power
+   myLog.SetHost(true);
+   LOG_I("Always on: usb power");
+   alwaysOn = true;
+   myStats.Reset();
+   StartTouch();
+}
+
+/* 
+ *  Event loop of the always on mode on usb power, without the restart of every wake.
+ *  The tasks run on their schedule, the clock line is updated every minute with the
+ *  fast A2 waveform and the SHT30 line on a change. A button press or the touch shows
+ *  the next page.
+ */
 void loop()
 {
+   static time_t shownMinute = 0;
+   static time_t lastSensor  = 0;
+   static time_t lastStats   = 0;
+   
+   if (!alwaysOn) {
+      return;
+   }
+   
+   uint32_t      start  = millis();
+   time_t        now    = GetRTCTime();
+   BatteryPolicy policy = (BatteryPolicy) myData.state.policy;
+   int           due    = mySchedule.GetDueTasks(myData.state, now, policy);
+   
+   M5.update();
+   if (M5.BtnP.wasPressed()) {
+      ShowNextPage();
+      myStats.Add(UPDATE_PAGE, millis() - start);
+   } else if (HandleTouch()) {
+   } else if (due) {
+      RunTasks(due);
+      mySchedule.SetQuietTime(myData, GetRTCTime());
+      mySchedule.SetQuota(myData.state.quota, GetRTCTime());
+      myData.SaveState();
+      PowerOffEPD(mySchedule.GetWakeTime(myData.state, GetRTCTime(), policy)); // the alarm after unplugging
+      shownMinute = GetRTCTime() / (time_t) SECS_PER_MIN;
+      myStats.Add(UPDATE_TASKS, millis() - start);
+   } else if (myData.state.displayHash && now / (time_t) SECS_PER_MIN != shownMinute) { // only on the weather page
+      myDisplay.ShowM5PaperInfo(M5PAPER_TIME, UPDATE_MODE_A2);
+      shownMinute = now / (time_t) SECS_PER_MIN;
+      myStats.Add(UPDATE_CLOCK, millis() - start);
+   } else if (myData.state.displayHash && now - lastSensor >= ALWAYS_ON_SENSOR) {
+      uint32_t sensorStart = millis();
+
+      GetSHT30Values(myData, false);
+      lastSensor = now;
+      if (myData.sht30Temperatur != myData.state.shownTemperatur || myData.sht30Humidity != myData.state.shownHumidity) {
+         myDisplay.ShowM5PaperInfo(M5PAPER_VALUES);
+         myStats.Add(UPDATE_SENSOR, millis() - sensorStart);
+      }
+   }
+   ProcessCommands(0);
+   FlushLog();
+   if (now - lastStats >= ALWAYS_ON_STATS) {
+      if (lastStats) {
+         myStats.Print();
+      }
+      lastStats = now;
+   }
+   myStats.AddBusy(millis() - start);
+
+   // wait for the next second, a touch ends the wait at once
+   uint32_t next = millis() + 1000 - millis() % 1000;
+   
+   while ((int32_t) (next - millis()) > 0 && !M5.TP.available()) {
+      delay(min(next - (uint32_t) millis(), (uint32_t) 20));
+   }
 }